@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "brush.h"
+#include "canvas.h"
+#include "chrome_trace.h"
+#include "headless_context.h"
+#include "layer.h"
+#include "png_export.h"
+#include "rect.h"
+#include "tools.h"
+#include "user_state.h"
+
+// Benchmarks the canvas engine's hot operations, without a window or a
+// display, so that results can be compared across commits and machines.
+
+static const char* USAGE = R"(Usage: brush_bench [options]
+
+  --size <width>x<height>  Size of the canvas (default 7680x4320)
+  --layers <n>,<n>,...     Layer counts to run each benchmark at
+                           (default 1,10,50,200)
+  --filter <text>          Only run benchmarks whose name contains this
+  --min-time <ms>          Time to run each benchmark for (default 500)
+  --json <file.json>       Write the results as JSON
+
+Like brush_render, it must be run from the build directory, so that the
+shaders can be found. Times are per operation, and include waiting for the
+GPU to finish. Allocations only count memory from operator new, on every
+thread.
+)";
+
+// Every allocation through operator new, including from background threads.
+static std::atomic<size_t> g_allocated_bytes = 0;
+static std::atomic<size_t> g_allocation_count = 0;
+
+void* operator new(size_t size) {
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    g_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+// Strokes and views are sized as in brush_render.
+static const glm::vec2 VIEW_SIZE(1920.0f, 1080.0f);
+static const std::vector<float> BRUSH_SIZES_TO_BENCH{ 1, 10, 100, 1000 };
+static const size_t MAX_ITERATIONS = 1000000;
+
+struct Options {
+    size_t width = 7680;
+    size_t height = 4320;
+    std::vector<size_t> layer_counts{ 1, 10, 50, 200 };
+    std::string filter;
+    double min_time_ms = 500.0;
+    std::optional<std::string> json_filename;
+};
+
+struct BenchResult {
+    std::string name;
+    size_t iterations;
+    double ns_per_op;
+    double gpu_ns_per_op;
+    double bytes_per_op;
+    double allocations_per_op;
+};
+
+static Options parse_options(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << USAGE;
+            std::exit(EXIT_SUCCESS);
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error(std::format("Unknown option or missing value: {}", arg));
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--size") {
+            size_t width = 0, height = 0;
+            char separator = '\0';
+            std::istringstream stream(value);
+            if (!(stream >> width >> separator >> height) || separator != 'x' || width == 0 || height == 0) {
+                throw std::runtime_error(std::format("Invalid size: {}", value));
+            }
+            options.width = width;
+            options.height = height;
+        } else if (arg == "--layers") {
+            options.layer_counts.clear();
+            std::istringstream stream(value);
+            std::string count;
+            while (std::getline(stream, count, ',')) {
+                size_t layer_count = std::stoull(count);
+                if (layer_count == 0) throw std::runtime_error(std::format("Invalid layer counts: {}", value));
+                options.layer_counts.push_back(layer_count);
+            }
+        } else if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--min-time") {
+            options.min_time_ms = std::stod(value);
+        } else if (arg == "--json") {
+            options.json_filename = value;
+        } else {
+            throw std::runtime_error(std::format("Unknown option: {}", arg));
+        }
+    }
+    return options;
+}
+
+class BenchRunner {
+    const Options& m_options;
+    std::vector<BenchResult> m_results;
+    GLuint m_query;
+
+public:
+    BenchRunner(const Options& options) : m_options(options), m_query(0) {
+        glGenQueries(1, &m_query);
+        std::cout << std::format("{:<36}{:>10}{:>14}{:>14}{:>14}{:>10}\n",
+            "benchmark", "ops", "ns/op", "GPU ns/op", "bytes/op", "allocs/op");
+    }
+    ~BenchRunner() { glDeleteQueries(1, &m_query); }
+    BenchRunner(const BenchRunner&) = delete;
+    BenchRunner& operator=(const BenchRunner&) = delete;
+
+    bool is_selected(const std::string& name) const {
+        return name.find(m_options.filter) != std::string::npos;
+    }
+
+    // Runs `op` in batches, growing the batch until it takes at least the
+    // minimum time, and reports on the last batch. `op` is passed the index
+    // of the operation within its batch. `cleanup`, if given, is passed the
+    // batch size and runs untimed after each batch.
+    void run(
+        const std::string& name,
+        const std::function<void(size_t)>& op,
+        const std::function<void(size_t)>& cleanup = nullptr
+    ) {
+        if (!is_selected(name)) return;
+
+        // Warms up caches and anything that is created lazily.
+        op(0);
+        if (cleanup) cleanup(1);
+
+        size_t iterations = 1;
+        while (true) {
+            glFinish();
+            size_t start_bytes = g_allocated_bytes.load();
+            size_t start_allocations = g_allocation_count.load();
+            auto start = std::chrono::steady_clock::now();
+            glBeginQuery(GL_TIME_ELAPSED, m_query);
+
+            for (size_t i = 0; i < iterations; i++) op(i);
+
+            glEndQuery(GL_TIME_ELAPSED);
+            glFinish();
+            double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            size_t bytes = g_allocated_bytes.load() - start_bytes;
+            size_t allocations = g_allocation_count.load() - start_allocations;
+            GLuint64 gpu_ns = 0;
+            glGetQueryObjectui64v(m_query, GL_QUERY_RESULT, &gpu_ns);
+            if (cleanup) cleanup(iterations);
+
+            double min_time_ns = m_options.min_time_ms * 1e6;
+            if (elapsed_ns >= min_time_ns || iterations >= MAX_ITERATIONS) {
+                BenchResult result{
+                    name,
+                    iterations,
+                    elapsed_ns / iterations,
+                    double(gpu_ns) / iterations,
+                    double(bytes) / iterations,
+                    double(allocations) / iterations,
+                };
+                std::cout << std::format("{:<36}{:>10}{:>14.0f}{:>14.0f}{:>14.0f}{:>10.1f}\n",
+                    result.name, result.iterations, result.ns_per_op, result.gpu_ns_per_op,
+                    result.bytes_per_op, result.allocations_per_op);
+                m_results.push_back(result);
+                return;
+            }
+
+            // Aims a little past the minimum time, without growing too fast
+            // on the strength of a single short batch.
+            double predicted = min_time_ns * 1.2 / std::max(elapsed_ns / iterations, 1.0);
+            iterations = std::clamp(size_t(predicted), iterations + 1, std::min(iterations * 100, MAX_ITERATIONS));
+        }
+    }
+
+    const std::vector<BenchResult>& results() const { return m_results; }
+};
+
+// Paints a diagonal stroke across every layer, each at a different offset,
+// so that compositing has real tiles to blend.
+static void paint_layers(Canvas& canvas, Brush& brush) {
+    const std::vector<Layer>& layers = canvas.get_layers();
+    glm::vec2 size = canvas.size();
+    brush.size() = 200.0f;
+    for (size_t i = 0; i < layers.size(); i++) {
+        auto layer = canvas.lookup_layer(layers[i].id());
+        float offset = float(i % 16) / 16.0f * size.y;
+        CursorState start(glm::vec2(0.0f, offset), 1.0f);
+        CursorState end(glm::vec2(size.x, size.y - offset), 1.0f);
+        glm::vec3 color(float(i % 3) / 2.0f, float(i % 5) / 4.0f, float(i % 7) / 6.0f);
+        layer.value().get().mark_dirty(brush.draw_segment(layer.value().get(), start, end, color));
+    }
+}
+
+static Brush& find_brush(ToolManager& tools, const std::string& name) {
+    tools.select_tool_by_name(name);
+    auto tool = tools.get_selected_tool();
+    Brush* brush = tool.has_value() ? dynamic_cast<Brush*>(&tool.value().get()) : nullptr;
+    if (brush == nullptr) throw std::runtime_error(std::format("No brush named {}", name));
+    return *brush;
+}
+
+static void wait_for_export(Canvas& canvas, const std::shared_ptr<PngExport>& png_export) {
+    canvas.finish_readbacks();
+    while (!png_export->is_finished()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (png_export->error().has_value()) {
+        throw std::runtime_error(png_export->error().value());
+    }
+}
+
+static void bench_draw_segment(BenchRunner& runner, const Options& options, ToolManager& tools) {
+    Canvas canvas(options.width, options.height);
+    canvas.gpu_profiler().set_enabled(false);
+    Layer::Id layer_id = canvas.insert_new_layer_above_selected(std::nullopt);
+    Layer& layer = canvas.lookup_layer(layer_id).value().get();
+    Brush& brush = find_brush(tools, "Pen");
+
+    // Segments are about as long as a fast stroke moves in one tick, and
+    // sweep across the middle of the canvas.
+    glm::vec2 center = canvas.size() / 2.0f;
+    for (float size : BRUSH_SIZES_TO_BENCH) {
+        runner.run(std::format("draw_segment/size={}", size), [&](size_t i) {
+            canvas.poll_readbacks();
+            brush.size() = size;
+            glm::vec2 offset(float(i % 64) * 8.0f - 256.0f, 0.0f);
+            CursorState start(center + offset, 0.5f);
+            CursorState end(center + offset + glm::vec2(24.0f, 32.0f), 1.0f);
+            layer.mark_dirty(brush.draw_segment(layer, start, end, glm::vec3(0.2f, 0.4f, 0.8f)));
+        });
+    }
+}
+
+static void bench_layers(BenchRunner& runner, const Options& options, ToolManager& tools, size_t layer_count) {
+    Canvas canvas(options.width, options.height);
+    canvas.gpu_profiler().set_enabled(false);
+    std::optional<Layer::Id> selected_layer;
+    for (size_t i = 0; i < layer_count; i++) {
+        selected_layer = canvas.insert_new_layer_above_selected(selected_layer);
+    }
+    paint_layers(canvas, find_brush(tools, "Pen"));
+    canvas.render(VIEW_SIZE, glm::vec2(0.0f), selected_layer);
+
+    std::vector<Layer::Id> layer_ids;
+    for (const Layer& layer : canvas.get_layers()) layer_ids.push_back(layer.id());
+    // The middle layer, so that it has layers both below and above it.
+    Layer::Id middle_layer = layer_ids[layer_ids.size() / 2];
+
+    // Every operation polls readbacks first, as each tick of the app does,
+    // so that compactions, undo records and evictions finish and each
+    // benchmark runs in the steady state the app reaches.
+    runner.run(std::format("render/full/layers={}", layer_count), [&](size_t) {
+        canvas.poll_readbacks();
+        canvas.invalidate_layer_cache();
+        canvas.render(VIEW_SIZE, glm::vec2(0.0f), middle_layer);
+    });
+
+    // What painting costs on top of the dabs: recompositing a brush-sized
+    // region of the selected layer.
+    runner.run(std::format("render/partial/layers={}", layer_count), [&](size_t i) {
+        canvas.poll_readbacks();
+        Rect dirty_rect(int(i % 64) * 16, int(options.height / 2), 256, 256);
+        canvas.lookup_layer(middle_layer).value().get().mark_dirty(dirty_rect);
+        canvas.render(VIEW_SIZE, glm::vec2(0.0f), middle_layer);
+    });
+
+    std::vector<Layer::Id> inserted_layers;
+    runner.run(std::format("insert_layer/layers={}", layer_count), [&](size_t) {
+        canvas.poll_readbacks();
+        inserted_layers.push_back(canvas.insert_new_layer_above_selected(middle_layer));
+    }, [&](size_t) {
+        for (Layer::Id layer_id : inserted_layers) canvas.delete_selected_layer(layer_id);
+        inserted_layers.clear();
+    });
+
+    if (layer_count >= 2) {
+        // Alternates, so that the layer order is the same after every batch
+        // of an even size.
+        runner.run(std::format("move_layer/layers={}", layer_count), [&](size_t i) {
+            canvas.poll_readbacks();
+            if (i % 2 == 0) canvas.move_layer_up(middle_layer);
+            else canvas.move_layer_down(middle_layer);
+        }, [&](size_t iterations) {
+            if (iterations % 2 == 1) canvas.move_layer_down(middle_layer);
+        });
+    }
+
+    size_t found_count = 0;
+    // Looking up queues no work, and polling would cost more than the
+    // lookup itself, so what is pending is drained once up front instead.
+    canvas.finish_readbacks();
+    runner.run(std::format("lookup_layer/layers={}", layer_count), [&](size_t i) {
+        if (canvas.lookup_layer(layer_ids[i % layer_ids.size()]).has_value()) found_count++;
+    });
+    if (found_count == 0 && runner.is_selected(std::format("lookup_layer/layers={}", layer_count))) {
+        throw std::runtime_error("lookup_layer found nothing");
+    }
+
+    std::string png_filename = (std::filesystem::temp_directory_path() / "brush_bench.png").string();
+    runner.run(std::format("save_as_png/layers={}", layer_count), [&](size_t) {
+        wait_for_export(canvas, canvas.save_as_png(png_filename));
+    });
+    std::filesystem::remove(png_filename);
+}
+
+static void write_json(const std::string& filename, const Options& options, const std::vector<BenchResult>& results) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(std::format("Failed to open {} for writing", filename));
+    }
+    file << "{\n";
+    file << std::format("  \"renderer\": \"{}\",\n", escape_json(reinterpret_cast<const char*>(glGetString(GL_RENDERER))));
+    file << std::format("  \"width\": {},\n  \"height\": {},\n", options.width, options.height);
+    file << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        file << (i == 0 ? "\n" : ",\n");
+        file << std::format("    {{\"name\": \"{}\", \"iterations\": {}, \"ns_per_op\": {:.1f}, \"gpu_ns_per_op\": {:.1f}, "
+            "\"bytes_per_op\": {:.1f}, \"allocations_per_op\": {:.2f}}}",
+            escape_json(result.name), result.iterations, result.ns_per_op, result.gpu_ns_per_op,
+            result.bytes_per_op, result.allocations_per_op);
+    }
+    file << "\n  ]\n}\n";
+    if (!file.flush()) {
+        throw std::runtime_error(std::format("Failed to write {}", filename));
+    }
+}
+
+static void run(const Options& options) {
+    // Must outlive everything that holds on to GL objects.
+    HeadlessContext context;
+    std::cout << std::format("Renderer: {}\n", reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+    std::cout << std::format("Canvas: {}x{}\n\n", options.width, options.height);
+
+    ToolManager tools;
+    BenchRunner runner(options);
+    bench_draw_segment(runner, options, tools);
+    for (size_t layer_count : options.layer_counts) {
+        bench_layers(runner, options, tools, layer_count);
+    }
+
+    if (options.json_filename.has_value()) {
+        write_json(options.json_filename.value(), options, runner.results());
+        std::cout << std::format("\nWrote {}\n", options.json_filename.value());
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        run(parse_options(argc, argv));
+    } catch (const std::exception& e) {
+        std::cerr << "brush_bench failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
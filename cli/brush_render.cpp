@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "brush.h"
+#include "canvas.h"
+#include "chrome_trace.h"
+#include "document.h"
+#include "headless_context.h"
+#include "png_export.h"
+#include "replay.h"
+#include "stroke_recording.h"
+#include "tools.h"
+#include "user_state.h"
+
+// Renders documents from the command line, without a window or a display.
+
+static const char* USAGE = R"(Usage: brush_render [options]
+
+  --size <width>x<height>  Size of the new canvas (default 1920x1080, or
+                           the size of the replayed recording)
+  --open <file.brush>      Start from a document instead, at its size
+  --strokes <file>         Replay the commands in a stroke script
+  --record <file.brec>     Record the stroke script, for use with --replay
+  --replay <file.brec>     Replay a recording from the app, and report timings
+  --realtime               Replay with the recorded timing, not at full speed
+  --trace <file.json>      Write a Chrome trace of the render passes of the
+                           stroke script and the replay
+  --png <file.png>         Export the composite to a PNG
+  --save <file.brush>      Save the document
+  --vram-budget <MB>       Evict idle tiles to host memory beyond this
+
+Stroke scripts have one command per line. Positions are in pixels from the
+top left corner of the canvas, and colors, pressures and opacities go from
+0 to 1. Lines starting with # are ignored.
+
+  layer                    Add a layer above the selected one and select it
+  select <index>           Select a layer, counting from the bottom
+  tool <name>              Select a tool by name, e.g. Pen or Eraser
+  color <r> <g> <b>
+  size <pixels>
+  opacity <opacity>
+  stroke <x> <y> <pressure> <x> <y> <pressure> [...]
+
+Like mouse input, each point of a stroke takes one tick of the app, and a
+stroke needs at least two points to draw anything.
+)";
+
+// Strokes go through the same path as the mouse, so they are positioned in
+// screen space with a view of this size.
+static const glm::vec2 VIEW_SIZE(1920.0f, 1080.0f);
+// The rate at which the app samples input, which recorded scripts tick at.
+static const double TICK_SECONDS = 1.0 / 120.0;
+
+struct Options {
+    std::optional<size_t> width;
+    std::optional<size_t> height;
+    std::optional<std::string> open_filename;
+    std::optional<std::string> strokes_filename;
+    std::optional<std::string> record_filename;
+    std::optional<std::string> replay_filename;
+    bool is_realtime = false;
+    std::optional<std::string> trace_filename;
+    std::optional<std::string> png_filename;
+    std::optional<std::string> save_filename;
+    std::optional<size_t> vram_budget_mb;
+};
+
+static Options parse_options(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << USAGE;
+            std::exit(EXIT_SUCCESS);
+        }
+        if (arg == "--realtime") {
+            options.is_realtime = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw std::runtime_error(std::format("Unknown option or missing value: {}", arg));
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--size") {
+            size_t width = 0, height = 0;
+            char separator = '\0';
+            std::istringstream stream(value);
+            if (!(stream >> width >> separator >> height) || separator != 'x' || width == 0 || height == 0) {
+                throw std::runtime_error(std::format("Invalid size: {}", value));
+            }
+            options.width = width;
+            options.height = height;
+        } else if (arg == "--open") {
+            options.open_filename = value;
+        } else if (arg == "--strokes") {
+            options.strokes_filename = value;
+        } else if (arg == "--record") {
+            options.record_filename = value;
+        } else if (arg == "--replay") {
+            options.replay_filename = value;
+        } else if (arg == "--trace") {
+            options.trace_filename = value;
+        } else if (arg == "--png") {
+            options.png_filename = value;
+        } else if (arg == "--save") {
+            options.save_filename = value;
+        } else if (arg == "--vram-budget") {
+            options.vram_budget_mb = std::stoull(value);
+        } else {
+            throw std::runtime_error(std::format("Unknown option: {}", arg));
+        }
+    }
+    return options;
+}
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Points are in image space, with y pointing down, whereas canvas space has
+// y pointing up.
+static CursorState image_to_screen_space(const Canvas& canvas, CursorState point) {
+    glm::vec2 canvas_pos(point.pos.x, float(canvas.height()) - point.pos.y);
+    return CursorState(canvas.canvas_space_to_screen_space(canvas_pos), point.pressure);
+}
+
+// Returns the number of strokes replayed. Every tick is passed to the
+// recorder, which ignores them unless it has been started.
+static size_t replay_script(
+    Canvas& canvas,
+    ToolManager& tools,
+    UserState& user_state,
+    StrokeRecorder& recorder,
+    const std::string& filename
+) {
+    std::ifstream file(filename);
+    if (!file) {
+        throw std::runtime_error(std::format("Failed to open {}", filename));
+    }
+
+    double time = 0.0;
+    auto tick = [&](bool is_mouse_down) {
+        canvas.gpu_profiler().begin_frame();
+        // Compactions, undo records and evictions only finish from here,
+        // as they do in the app.
+        canvas.poll_readbacks();
+        recorder.record(time, VIEW_SIZE, canvas, tools, user_state, is_mouse_down);
+        tools.handle_mouse(canvas, user_state, is_mouse_down);
+        time += TICK_SECONDS;
+    };
+
+    size_t stroke_count = 0;
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); line_number++) {
+        std::istringstream stream(line);
+        std::string command;
+        if (!(stream >> command) || command.starts_with("#")) continue;
+
+        auto fail = [&]() {
+            return std::runtime_error(std::format("{}:{}: invalid command: {}", filename, line_number, line));
+        };
+        auto selected_brush = [&]() -> Brush& {
+            auto tool_opt = tools.get_selected_tool();
+            Brush* brush = tool_opt.has_value() ? dynamic_cast<Brush*>(&tool_opt.value().get()) : nullptr;
+            if (brush == nullptr) throw fail();
+            return *brush;
+        };
+
+        if (command == "layer") {
+            user_state.selected_layer = canvas.insert_new_layer_above_selected(user_state.selected_layer);
+        } else if (command == "select") {
+            size_t index;
+            if (!(stream >> index) || index >= canvas.get_layers().size()) throw fail();
+            user_state.selected_layer = canvas.get_layers()[index].id();
+        } else if (command == "tool") {
+            std::string name;
+            std::getline(stream >> std::ws, name);
+            if (!tools.lookup_tool_by_name(name).has_value()) throw fail();
+            tools.select_tool_by_name(name);
+        } else if (command == "color") {
+            glm::vec3 color;
+            if (!(stream >> color.r >> color.g >> color.b)) throw fail();
+            user_state.selected_color = color;
+        } else if (command == "size") {
+            float size;
+            if (!(stream >> size) || size <= 0.0f) throw fail();
+            selected_brush().size() = size;
+        } else if (command == "opacity") {
+            float opacity;
+            if (!(stream >> opacity)) throw fail();
+            selected_brush().opacity() = std::clamp(opacity, 0.0f, 1.0f);
+        } else if (command == "stroke") {
+            std::vector<CursorState> points;
+            glm::vec2 pos;
+            float pressure;
+            while (stream >> pos.x >> pos.y >> pressure) {
+                points.push_back(CursorState(pos, pressure));
+            }
+            if (points.size() < 2 || !stream.eof()) throw fail();
+            for (const CursorState& point : points) {
+                user_state.cursor = image_to_screen_space(canvas, point);
+                tick(true);
+            }
+            tick(false);
+            stroke_count++;
+        } else {
+            throw fail();
+        }
+    }
+    return stroke_count;
+}
+
+static void run(const Options& options) {
+    // Must outlive everything that holds on to GL objects.
+    HeadlessContext context;
+    std::cout << std::format("Renderer: {}\n", reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+
+    std::optional<StrokeRecording> recording;
+    if (options.replay_filename.has_value()) {
+        recording = read_stroke_recording(options.replay_filename.value());
+    }
+
+    size_t width = options.width.value_or(recording.has_value() ? recording.value().canvas_width : 1920);
+    size_t height = options.height.value_or(recording.has_value() ? recording.value().canvas_height : 1080);
+    if (options.open_filename.has_value()) {
+        Document document = read_document(options.open_filename.value());
+        width = document.width;
+        height = document.height;
+    }
+
+    Canvas canvas(width, height);
+    ToolManager tools;
+    UserState user_state;
+    if (options.vram_budget_mb.has_value()) {
+        canvas.set_vram_budget(options.vram_budget_mb.value() * 1024 * 1024);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (options.open_filename.has_value()) {
+        user_state.selected_layer = canvas.open_document(options.open_filename.value());
+        std::cout << std::format("Opened {} ({}x{}, {} layers) in {:.1f} ms\n",
+            options.open_filename.value(), width, height, canvas.get_layers().size(), milliseconds_since(start));
+    } else {
+        user_state.selected_layer = canvas.insert_new_layer_above_selected(std::nullopt);
+    }
+
+    // Sizes the view, which strokes are mapped through.
+    canvas.render(VIEW_SIZE, glm::vec2(0.0f), user_state.selected_layer);
+
+    if (options.trace_filename.has_value()) canvas.gpu_profiler().start_trace();
+
+    if (options.strokes_filename.has_value()) {
+        StrokeRecorder recorder;
+        if (options.record_filename.has_value()) recorder.start(canvas, 0.0);
+
+        start = std::chrono::steady_clock::now();
+        size_t stroke_count = replay_script(canvas, tools, user_state, recorder, options.strokes_filename.value());
+        glFinish();
+        std::cout << std::format("Replayed {} strokes in {:.1f} ms\n", stroke_count, milliseconds_since(start));
+
+        if (options.record_filename.has_value()) {
+            size_t frame_count = recorder.frame_count();
+            recorder.stop(options.record_filename.value());
+            std::cout << std::format("Recorded {} frames to {}\n", frame_count, options.record_filename.value());
+        }
+    }
+
+    if (recording.has_value()) {
+        replay_recording(recording.value(), canvas, tools, user_state, options.is_realtime);
+    }
+
+    if (options.trace_filename.has_value()) {
+        ChromeTrace trace;
+        canvas.gpu_profiler().stop_trace(trace);
+        trace.write(options.trace_filename.value());
+        std::cout << std::format("Wrote trace to {}\n", options.trace_filename.value());
+    }
+
+    start = std::chrono::steady_clock::now();
+    canvas.render(VIEW_SIZE, glm::vec2(0.0f), user_state.selected_layer);
+    glFinish();
+    std::cout << std::format("Composited in {:.1f} ms\n", milliseconds_since(start));
+    if (size_t count = canvas.take_unreadable_tile_count(); count > 0) {
+        std::cerr << std::format("Warning: {} damaged tiles couldn't be read, and were cleared\n", count);
+    }
+
+    if (options.png_filename.has_value()) {
+        start = std::chrono::steady_clock::now();
+        std::shared_ptr<PngExport> png_export = canvas.save_as_png(options.png_filename.value());
+        canvas.finish_readbacks();
+        while (!png_export->is_finished()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (png_export->error().has_value()) {
+            throw std::runtime_error(png_export->error().value());
+        }
+        std::cout << std::format("Exported {} in {:.1f} ms\n", options.png_filename.value(), milliseconds_since(start));
+    }
+
+    if (options.save_filename.has_value()) {
+        start = std::chrono::steady_clock::now();
+        std::shared_ptr<DocumentWriter> writer = canvas.save_document(options.save_filename.value());
+        canvas.finish_readbacks();
+        while (!writer->is_finished()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (writer->error().has_value()) {
+            throw std::runtime_error(writer->error().value());
+        }
+        std::cout << std::format("Saved {} ({} tiles, {} bytes) in {:.1f} ms\n", options.save_filename.value(),
+            writer->stats().tile_count, writer->stats().output_bytes, milliseconds_since(start));
+    }
+}
+
+int main(int argc, char** argv) {
+    try {
+        run(parse_options(argc, argv));
+    } catch (const std::exception& e) {
+        std::cerr << "brush_render failed: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
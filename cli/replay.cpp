@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "brush.h"
+#include "canvas.h"
+#include "gl_state.h"
+#include "gpu_profiler.h"
+#include "replay.h"
+#include "stroke_recording.h"
+#include "tools.h"
+#include "user_state.h"
+
+static size_t total_dab_count(const ToolManager& tool_manager) {
+    size_t count = 0;
+    for (const auto& tool : tool_manager.tools()) {
+        if (const Brush* brush = dynamic_cast<const Brush*>(tool.get())) count += brush->dab_count();
+    }
+    return count;
+}
+
+static std::string format_percentiles(const std::string& label, std::vector<double> values) {
+    if (values.empty()) return label;
+    std::sort(values.begin(), values.end());
+    auto percentile = [&](double p) {
+        size_t index = std::min(values.size() - 1, size_t(p / 100.0 * values.size()));
+        return values[index];
+    };
+    return std::format("{:<14}{:>9.3f}{:>9.3f}{:>9.3f}{:>9.3f}",
+        label, percentile(50), percentile(95), percentile(99), values.back());
+}
+
+void replay_recording(
+    const StrokeRecording& recording,
+    Canvas& canvas,
+    ToolManager& tool_manager,
+    UserState& user_state,
+    bool is_realtime
+) {
+    const std::vector<RecordedFrame>& frames = recording.frames;
+    if (frames.empty()) return;
+
+    // Timestamps are read back once the replay is over, so they never stall it.
+    const size_t QUERIES_PER_FRAME = 3;
+    std::vector<GLuint> queries(frames.size() * QUERIES_PER_FRAME);
+    glGenQueries(GLsizei(queries.size()), queries.data());
+
+    std::vector<double> cpu_frame_ms(frames.size());
+    std::vector<double> cpu_composite_ms(frames.size());
+    size_t start_dab_count = total_dab_count(tool_manager);
+
+    // Sizes the view, which the first frame's cursor is mapped through.
+    canvas.render(frames[0].screen_size, frames[0].cursor.pos, user_state.selected_layer);
+    glFinish();
+
+    using Clock = std::chrono::steady_clock;
+    auto milliseconds_between = [](Clock::time_point start, Clock::time_point end) {
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    };
+    Clock::time_point replay_start = Clock::now();
+    GlState::take_counts();
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        const RecordedFrame& frame = frames[i];
+        if (is_realtime) {
+            std::this_thread::sleep_until(replay_start + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(frame.time)));
+        }
+
+        canvas.gpu_profiler().begin_frame();
+        Clock::time_point frame_start = Clock::now();
+        glQueryCounter(queries[i * QUERIES_PER_FRAME], GL_TIMESTAMP);
+        // Like the app, finish whatever readbacks have arrived first, so
+        // their cost is part of the frame.
+        canvas.poll_readbacks();
+        replay_frame(frame, canvas, tool_manager, user_state);
+
+        Clock::time_point composite_start = Clock::now();
+        glQueryCounter(queries[i * QUERIES_PER_FRAME + 1], GL_TIMESTAMP);
+        canvas.render(frame.screen_size, frame.cursor.pos, user_state.selected_layer);
+        glQueryCounter(queries[i * QUERIES_PER_FRAME + 2], GL_TIMESTAMP);
+        Clock::time_point frame_end = Clock::now();
+
+        cpu_frame_ms[i] = milliseconds_between(frame_start, frame_end);
+        cpu_composite_ms[i] = milliseconds_between(composite_start, frame_end);
+    }
+    GlStateCounts gl_counts = GlState::take_counts();
+    glFinish();
+    double total_ms = milliseconds_between(replay_start, Clock::now());
+    size_t dab_count = total_dab_count(tool_manager) - start_dab_count;
+
+    std::vector<double> gpu_frame_ms(frames.size());
+    std::vector<double> gpu_composite_ms(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        GLuint64 timestamps[QUERIES_PER_FRAME];
+        for (size_t j = 0; j < QUERIES_PER_FRAME; j++) {
+            glGetQueryObjectui64v(queries[i * QUERIES_PER_FRAME + j], GL_QUERY_RESULT, &timestamps[j]);
+        }
+        gpu_frame_ms[i] = (timestamps[2] - timestamps[0]) / 1e6;
+        gpu_composite_ms[i] = (timestamps[2] - timestamps[1]) / 1e6;
+    }
+    glDeleteQueries(GLsizei(queries.size()), queries.data());
+    canvas.gpu_profiler().finish();
+
+    std::cout << std::format("Replayed {} frames ({:.1f} s recorded) in {:.1f} ms{}\n",
+        frames.size(), frames.back().time, total_ms, is_realtime ? " in real time" : "");
+    std::cout << std::format("{} dabs, {:.0f} dabs/s\n", dab_count, dab_count / (total_ms / 1000.0));
+    std::cout << std::format("Per frame: {:.1f} draw calls, {:.1f} dispatches, {:.1f} state changes ({:.1f} skipped)\n",
+        double(gl_counts.draw_calls) / frames.size(),
+        double(gl_counts.dispatches) / frames.size(),
+        double(gl_counts.state_changes) / frames.size(),
+        double(gl_counts.skipped_changes) / frames.size());
+    std::cout << std::format("{:<14}{:>9}{:>9}{:>9}{:>9}\n", "ms", "p50", "p95", "p99", "max");
+    std::cout << format_percentiles("CPU frame", cpu_frame_ms) << "\n";
+    std::cout << format_percentiles("GPU frame", gpu_frame_ms) << "\n";
+    std::cout << format_percentiles("CPU composite", cpu_composite_ms) << "\n";
+    std::cout << format_percentiles("GPU composite", gpu_composite_ms) << "\n";
+
+    std::cout << std::format("\nPasses over the last {} frames, ms\n", GpuProfiler::HISTORY_FRAMES);
+    std::cout << std::format("{:<14}{:>9}{:>9}{:>9}{:>9}\n", "", "GPU avg", "GPU max", "CPU avg", "CPU max");
+    for (const GpuPassStats& pass : canvas.gpu_profiler().stats()) {
+        std::cout << std::format("{:<14}{:>9.3f}{:>9.3f}{:>9.3f}{:>9.3f}\n",
+            pass.name, pass.average_gpu_ms, pass.max_gpu_ms, pass.average_cpu_ms, pass.max_cpu_ms);
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "canvas.h"
+#include "stroke_recording.h"
+#include "tools.h"
+#include "user_state.h"
+
+// Replays a recording frame by frame, rendering the canvas after each one,
+// and prints percentiles of the CPU and GPU time per frame and per
+// composite, along with the dab throughput and the time spent in each
+// render pass. Frames are replayed as fast as possible, or in real time,
+// with the same gaps between them as recorded.
+void replay_recording(
+    const StrokeRecording& recording,
+    Canvas& canvas,
+    ToolManager& tool_manager,
+    UserState& user_state,
+    bool is_realtime
+);
@@ -1,16 +1,35 @@
 #pragma once
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <glm/fwd.hpp>
 #include <imgui.h>
 
+#include "autosave.h"
 #include "canvas.h"
+#include "document.h"
+#include "frame_scheduler.h"
+#include "frame_tracer.h"
+#include "gl_state.h"
 #include "gui.h"
+#include "png_export.h"
+#include "stroke_recording.h"
 #include "tools.h"
 #include "user_state.h"
 #include "window.h"
 #include <optional>
 
+// Everything that determines how the cursor overlay looks. If none of it
+// changes, the overlay from the previous frame can be reused.
+struct CursorOverlay {
+    std::optional<Tool::Id> tool_id;
+    glm::vec2 pos;
+    float size;
+
+    bool operator==(const CursorOverlay& other) const = default;
+};
+
 class App {
 public:
     App(
@@ -34,12 +53,27 @@ private:
     ToolManager m_tool_manager;
     UserState m_user_state;
 
-    double m_last_update_time;
+    double m_last_tick_time;
     double m_last_dt;
     const double m_target_internal_fps = 120.0;
-    const double m_target_internal_dt = 1.0 / m_target_internal_fps;
     const double m_target_display_fps = 60.0;
-    const double m_target_display_dt = 1.0 / m_target_display_fps;
+    FrameScheduler m_frame_scheduler;
+    FrameTracer m_frame_tracer;
+
+    // Exports still being encoded, oldest first.
+    std::vector<std::shared_ptr<PngExport>> m_exports;
+    std::optional<PngExportStats> m_last_export_stats;
+    // Document saves still being written, oldest first.
+    std::vector<std::shared_ptr<DocumentWriter>> m_document_saves;
+    Autosave m_autosave;
+    StrokeRecorder m_stroke_recorder;
+
+    std::optional<CursorOverlay> m_last_cursor_overlay;
+    size_t m_skipped_frames;
+    size_t m_partial_frames;
+    size_t m_full_frames;
+    // The GL work issued during the previous tick.
+    GlStateCounts m_last_gl_counts;
 
     void handle_inputs();
     std::optional<Tool::Id> resolve_temp_tool(const ImGuiIO& io);
@@ -48,9 +82,17 @@ private:
 
     void render();
     void render_cursor();
+    CursorOverlay get_cursor_overlay();
+    void count_frame(FrameKind frame_kind);
 
-    std::string get_new_image_filename();
+    std::string get_new_filename(const char* extension);
+    std::string get_autosave_filename();
     void save_image_to_downloads();
+    void update_exports();
+    void handle_document_request();
+    void update_document_saves();
+    void toggle_stroke_recording();
+    void toggle_trace();
 
     glm::vec2 get_mouse_pos_in_canvas_window();
     glm::vec2 get_mouse_pos_in_canvas();
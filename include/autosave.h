@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "canvas.h"
+#include "document.h"
+#include "layer.h"
+
+// `Autosave` periodically saves the canvas to a document in the background.
+// Only tiles that changed since the previous autosave are read back and
+// compressed. They are appended to the file along with a new index, which
+// the header is then pointed at, while unchanged tiles stay where they
+// already are in the file. Once most of the file is taken up by tiles and
+// indices that are no longer referenced, it is rewritten from scratch.
+class Autosave {
+    struct SavedLayer {
+        DocumentLayerInfo info;
+        // Indexed row by row like the layer's tiles. Empty tiles have no record.
+        std::vector<std::optional<DocumentTileRecord>> tiles;
+    };
+
+    std::string m_filename;
+    double m_interval_seconds;
+    double m_next_save_time;
+
+    // What the file holds as of the last successful autosave, from the
+    // bottom layer up. A file size of 0 means there's nothing to append to.
+    std::vector<Layer::Id> m_saved_order;
+    std::unordered_map<Layer::Id, SavedLayer> m_saved_layers;
+    uint64_t m_file_size;
+    uint64_t m_live_bytes;
+
+    // The save in flight, and the layers it is saving.
+    std::shared_ptr<DocumentWriter> m_writer;
+    std::vector<Layer::Id> m_writer_order;
+    std::vector<SavedLayer> m_writer_layers;
+
+    std::optional<DocumentSaveStats> m_last_stats;
+    std::optional<std::string> m_last_error;
+
+public:
+    Autosave(std::string filename, double interval_seconds);
+
+    const std::string& filename() const { return m_filename; }
+    double interval_seconds() const { return m_interval_seconds; }
+    void set_interval_seconds(double seconds);
+    double next_save_time() const { return m_next_save_time; }
+
+    // Collects a finished save, and starts the next one if it is due and
+    // anything changed. Should be called once per tick.
+    void update(Canvas& canvas, double now);
+    bool is_saving() const { return m_writer != nullptr; }
+
+    const std::optional<DocumentSaveStats>& last_stats() const { return m_last_stats; }
+    const std::optional<std::string>& last_error() const { return m_last_error; }
+
+private:
+    void finish_save();
+    void start_save(Canvas& canvas);
+};
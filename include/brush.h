@@ -1,21 +1,39 @@
 #pragma once
 #include <algorithm>
+#include <optional>
+#include <vector>
 
-#include <glm/fwd.hpp>
+#include <glm/glm.hpp>
 
+#include "buffer.h"
+#include "history.h"
 #include "program.h"
+#include "rect.h"
 #include "texture.h"
 #include "tools.h"
 #include "user_state.h"
 
 class Canvas;
+class Layer;
+
+// A single circular stamp of the brush. Must match the std430 layout in `dab.vert`.
+struct Dab {
+    glm::vec2 center;
+    float radius;
+    float opacity;
+    glm::vec4 color;
+};
 
 class Brush : public Tool {
 public:
     float& size() { return m_size; }
     float& opacity() { return m_opacity; }
+    // Dabs drawn since the brush was created, for benchmarks.
+    size_t dab_count() const { return m_dab_count; }
 
+    void on_mouse_press(Canvas& canvas, UserState& user_state) override;
     void on_mouse_down(Canvas& canvas, UserState& user_state) override;
+    void on_mouse_release(Canvas& canvas, UserState& user_state) override;
     void render_cursor(const Canvas& canvas, const glm::vec2 cursor_pos) override;
 
     void decrease_size();
@@ -23,6 +41,11 @@ public:
     void decrease_opacity() { m_opacity = std::max(0.0f, m_opacity - 0.1f); }
     void increase_opacity() { m_opacity = std::min(1.0f, m_opacity + 0.1f); }
 
+    // Draw straight onto a layer, in canvas space. Outside of a stroke,
+    // nothing goes into the history. Both return the region drawn to.
+    Rect draw_at_point(Layer& layer, glm::vec2 mouse_pos, float pressure, glm::vec3 color);
+    Rect draw_segment(Layer& layer, CursorState start, CursorState end, glm::vec3 color);
+
 protected:
     float m_size;
     float m_opacity;
@@ -30,35 +53,46 @@ protected:
     Program m_brush_program;
     Program m_cursor_program;
 
+    // Dabs waiting to be drawn. They are uploaded together and drawn with
+    // one instanced call per tile they touch.
+    std::vector<Dab> m_dabs;
+    Buffer m_dab_buffer;
+    size_t m_dab_count;
+
+    // Region of the selected layer drawn to by the current stroke.
+    Rect m_stroke_rect;
+    // The tiles the current stroke has changed, as they were before it.
+    std::optional<TileEdit> m_stroke_edit;
 
     Brush();
 
-    void draw_at_point(glm::vec2 image_size, glm::vec2 mouse_pos, float pressure, glm::vec3 color, bool is_alpha_locked);
-    void draw_segment(glm::vec2 image_size, CursorState start, CursorState end, glm::vec3 color, bool is_alpha_locked);
+    void queue_dab(glm::vec2 pos, float pressure, glm::vec3 color);
+    void queue_segment(CursorState start, CursorState end, glm::vec3 color);
+    Rect flush_dabs(Layer& layer);
 
-    virtual void set_program_uniforms(
-        glm::vec2 image_size, 
-        glm::vec2 mouse_pos, float pressure, glm::vec3 color
-    );
-    virtual void set_blend_mode(bool is_alpha_locked) = 0;
+    virtual void set_blend_mode(const Layer& layer) = 0;
+    // Whether the brush can change the layer at all.
+    virtual bool can_draw_on(const Layer& layer) const { return true; }
+    // Whether a dab can change a fully transparent tile. If not, we can
+    // skip those tiles without giving them storage.
+    virtual bool can_draw_on_empty_tile(const Layer& layer) const = 0;
 
-    void apply_program();
+    void apply_program(size_t num_dabs);
 };
 
 class Pen final : public Brush {
 public:
     Pen();
-    void set_blend_mode(bool is_alpha_locked);
+    void set_blend_mode(const Layer& layer);
+    bool can_draw_on(const Layer& layer) const;
+    bool can_draw_on_empty_tile(const Layer& layer) const;
 };
 
 class Eraser final : public Brush {
 public:
     Eraser();
-    void set_blend_mode(bool _is_alpha_locked);
-    void set_program_uniforms(
-        glm::vec2 image_size, 
-        glm::vec2 mouse_pos, float pressure, glm::vec3 color
-    );
+    void set_blend_mode(const Layer& layer);
+    bool can_draw_on_empty_tile(const Layer& _layer) const { return false; }
 };
 
 
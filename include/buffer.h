@@ -0,0 +1,82 @@
+#pragma once
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "gl_state.h"
+
+// RAII wrapper around an OpenGL buffer object bound to a single target.
+class Buffer {
+    GLuint m_id = 0;
+    GLenum m_target;
+    size_t m_size = 0;
+
+public:
+    Buffer(GLenum target) : m_target(target) {
+        glGenBuffers(1, &m_id);
+        if (m_id == 0) {
+            throw std::runtime_error("Failed to generate OpenGL buffer!");
+        }
+    }
+
+    ~Buffer() {
+        if (m_id != 0) {
+            glDeleteBuffers(1, &m_id);
+            GlState::forget_buffer(m_id);
+        }
+    }
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    Buffer(Buffer&& other) noexcept
+        : m_id(std::exchange(other.m_id, 0)),
+        m_target(other.m_target),
+        m_size(std::exchange(other.m_size, 0))
+    {}
+
+    Buffer& operator=(Buffer&& other) noexcept {
+        if (this != &other) {
+            if (m_id != 0) {
+                glDeleteBuffers(1, &m_id);
+                GlState::forget_buffer(m_id);
+            }
+            m_id = std::exchange(other.m_id, 0);
+            m_target = other.m_target;
+            m_size = std::exchange(other.m_size, 0);
+        }
+        return *this;
+    }
+
+    void bind() const {
+        GlState::bind_buffer(m_target, m_id);
+    }
+
+    void unbind() const {
+        GlState::bind_buffer(m_target, 0);
+    }
+
+    // Binds the buffer to an indexed binding point, e.g. a shader storage block.
+    void bind_base(GLuint index) const {
+        GlState::bind_buffer_base(m_target, index, m_id);
+    }
+
+    // Replaces the whole contents of the buffer. Since we always respecify the
+    // storage, the driver can orphan the old one instead of waiting for draws
+    // that are still reading from it.
+    void upload(const void* data, size_t size, GLenum usage = GL_STREAM_DRAW) {
+        bind();
+        glBufferData(m_target, size, data, usage);
+        m_size = size;
+    }
+
+    template<typename T>
+    void upload(const std::vector<T>& data, GLenum usage = GL_STREAM_DRAW) {
+        upload(data.data(), data.size() * sizeof(T), usage);
+    }
+
+    GLuint id() const { return m_id; }
+    size_t size() const { return m_size; }
+};
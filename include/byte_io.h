@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Little-endian encoding for the app's binary files.
+
+inline void put_u8(std::vector<uint8_t>& out, uint8_t value) {
+    out.push_back(value);
+}
+
+inline void put_u32(std::vector<uint8_t>& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) out.push_back(uint8_t(value >> (8 * i)));
+}
+
+inline void put_u64(std::vector<uint8_t>& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out.push_back(uint8_t(value >> (8 * i)));
+}
+
+inline void put_f32(std::vector<uint8_t>& out, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put_u32(out, bits);
+}
+
+// Reads little-endian values, and throws rather than reading past the end.
+class ByteReader {
+    std::span<const uint8_t> m_bytes;
+    size_t m_pos;
+    const std::string& m_filename;
+
+public:
+    ByteReader(std::span<const uint8_t> bytes, const std::string& filename)
+        : m_bytes(bytes), m_pos(0), m_filename(filename) {}
+
+    bool is_at_end() const { return m_pos == m_bytes.size(); }
+
+    std::span<const uint8_t> bytes(size_t size) {
+        if (size > m_bytes.size() - m_pos) {
+            throw std::runtime_error(std::format("{} is truncated or corrupt", m_filename));
+        }
+        std::span<const uint8_t> result = m_bytes.subspan(m_pos, size);
+        m_pos += size;
+        return result;
+    }
+
+    uint8_t u8() { return bytes(1)[0]; }
+
+    uint32_t u32() {
+        std::span<const uint8_t> b = bytes(4);
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= uint32_t(b[i]) << (8 * i);
+        return value;
+    }
+
+    uint64_t u64() {
+        std::span<const uint8_t> b = bytes(8);
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) value |= uint64_t(b[i]) << (8 * i);
+        return value;
+    }
+
+    float f32() {
+        uint32_t bits = u32();
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
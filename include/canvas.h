@@ -1,39 +1,128 @@
 #pragma once
 
+#include <array>
 #include <functional>
+#include <memory>
 #include <optional>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <glad/glad.h>
 #include <glm/fwd.hpp>
 
 #include "canvas_view.h"
+#include "dirty_region.h"
+#include "document.h"
 #include "frame_buffer.h"
+#include "frame_buffer_pool.h"
+#include "gpu_profiler.h"
+#include "history.h"
 #include "layer.h"
+#include "pixel_format.h"
+#include "png_export.h"
 #include "program.h"
+#include "readback.h"
+#include "rect.h"
+#include "residency_manager.h"
 #include "texture.h"
+#include "tile_atlas.h"
+#include "tile_compositor.h"
+#include "tile_compressor.h"
+
+// How much work `Canvas::render()` had to do for a frame.
+enum class FrameKind {
+	// Nothing changed, so the previous composite and view were reused.
+	Skipped,
+	// Only part of the composite, or only the view, was redrawn.
+	Partial,
+	// Every layer was recomposited.
+	Full,
+};
 
 // `Canvas` the canvas pixel data in both the CPU and GPU. It is
 // responsible for updating both textures whenever something is
 // drawn to the canvas.
 class Canvas {
 	glm::vec3 m_base_color;
+
+	// One atlas per pixel format, indexed by `PixelFormat`. Must be declared
+	// before the layers, since they hold on to them.
+	std::array<TileAtlas, PIXEL_FORMAT_COUNT> m_tile_atlases;
 	std::vector<Layer> m_layers;
+	// Pending readbacks may refer to tiles owned by the history, so the
+	// queue must outlive it.
+	ReadbackQueue m_readback_queue;
+	// Compresses tiles for the history on worker threads, so it must also
+	// outlive it.
+	TileCompressor m_tile_compressor;
+	// Declared after the atlases too, since removed layers live on in it.
+	History m_history;
+	ResidencyManager m_residency_manager;
 
+	// The composite of every layer. It is mipmapped so that the view can be
+	// zoomed out without aliasing, and its mips are only rebuilt over the
+	// regions that change.
 	FrameBuffer m_output_frame_buffer;
 
+	// Cached composites of every layer below and above the selected layer.
+	// While painting, only the selected layer changes, so a frame costs three
+	// blends regardless of how many layers the document has. The below cache
+	// is opaque (it includes the base color), while the above cache is
+	// transparent. Like the layers, both hold premultiplied color. Each
+	// cache is rebuilt in a single pass over all of its layers, so
+	// rebuilding it writes every pixel once however many layers it holds.
+	//
+	// A cache only has storage while some layer it covers has something to
+	// show, so a single layer needs neither, and neither does a new layer
+	// until it is painted on. Storage is taken from and given back to the
+	// pool, so it is rarely allocated more than once.
+	FrameBufferPool m_frame_buffer_pool;
+	std::optional<FrameBuffer> m_below_frame_buffer;
+	std::optional<FrameBuffer> m_above_frame_buffer;
+	std::optional<Layer::Id> m_cached_selected_layer;
+	bool m_is_layer_cache_valid;
+
+	// Parts of the caches and the output that have changed but have not
+	// been recomposited yet, because they were outside the view.
+	DirtyRegion m_stale_cache_region;
+	DirtyRegion m_stale_output_region;
+	// When the view is zoomed out, every layer is composited straight into
+	// the output's mip level that the view samples, at a fraction of the
+	// cost. The caches and full-resolution output are then only brought up
+	// to date where they are painted, zoomed into, exported or picked. This
+	// tracks what is stale at `m_preview_level`.
+	DirtyRegion m_stale_preview_region;
+	size_t m_preview_level;
+
+	// Number of output pixels recomposited by the last call to `render()`.
+	size_t m_last_dirty_area;
+
+	// Set when a document is opened, until its tiles have been streamed
+	// into the atlases, or the VRAM budget is reached.
+	bool m_is_streaming_document;
+
 	CanvasView m_canvas_view;
+	GpuProfiler m_gpu_profiler;
+	TileCompositor m_tile_compositor;
 
 	Program m_cursor_program;
+	Program m_quad_program;
+	Program m_downsample_program;
 
 public:
 	Canvas(size_t _width, size_t _height);
 	~Canvas() = default;
+	Canvas(const Canvas&) = delete;
+	Canvas& operator=(const Canvas&) = delete;
 
 	bool layer_exists(Layer::Id layer_id);
 	std::optional<std::reference_wrapper<Layer>> lookup_layer(Layer::Id layer_id);
 
-	Layer::Id insert_new_layer_above_selected(std::optional<Layer::Id> selected_layer);
+	Layer::Id insert_new_layer_above_selected(
+		std::optional<Layer::Id> selected_layer, 
+		PixelFormat format = PixelFormat::RGBA8
+	);
 	std::optional<Layer::Id> delete_selected_layer(std::optional<Layer::Id> selected_layer);
 	void move_layer_up(std::optional<Layer::Id> layer_id);
 	void move_layer_down(std::optional<Layer::Id> layer_id);
@@ -41,6 +130,16 @@ public:
 	void set_layer_visibility(Layer::Id layer_id, bool is_visible);
 	bool get_layer_alpha_lock(Layer::Id layer_id);
 	void set_layer_alpha_lock(Layer::Id layer_id, bool is_alpha_locked);
+	void set_layer_tint(Layer::Id layer_id, glm::vec3 tint);
+
+	// Inserting, deleting, moving and hiding layers are recorded in the
+	// history by the methods above. Edits to a layer's pixels are recorded
+	// by whoever makes them, e.g. brushes.
+	void push_history(HistoryEntry entry) { m_history.push(std::move(entry)); }
+	// Both return the layer that should be selected afterwards.
+	std::optional<Layer::Id> undo(std::optional<Layer::Id> selected_layer);
+	std::optional<Layer::Id> redo(std::optional<Layer::Id> selected_layer);
+	size_t history_bytes() const { return m_history.used_bytes(); }
 
 	glm::vec2 screen_space_to_canvas_space(glm::vec2 point) const { return m_canvas_view.screen_space_to_canvas_space(point); }
 	float screen_space_to_canvas_space(float dist) const { return m_canvas_view.screen_space_to_canvas_space(dist); };
@@ -56,28 +155,118 @@ public:
 	void move(glm::vec2 translation) { m_canvas_view.move(translation); }
 	void flip() { m_canvas_view.flip(); }
 	bool is_flipped() { return m_canvas_view.is_flipped(); }
+	ViewTransform view_transform() const { return m_canvas_view.view_transform(); }
+	void set_view_transform(const ViewTransform& transform) { m_canvas_view.set_view_transform(transform); }
 
-	std::optional<glm::vec3> get_color_at_pos(glm::vec2 pos);
+	// Calls `callback` with the composited color at `pos`, given in canvas
+	// space, once it has been read back. Nothing is called if `pos` is
+	// outside the canvas.
+	void request_color_at_pos(glm::vec2 pos, std::function<void(glm::vec3)> callback);
 
 	void bind_canvas_fbo() const;
 	void bind_screen_fbo() const { m_canvas_view.bind_fbo(); };
-	void render(glm::vec2 screen_size, glm::vec2 mouse_pos);
+	// Resets the screen texture to the view without any overlays, and binds
+	// it so that overlays like the cursor can be drawn on top.
+	void begin_overlay() { m_canvas_view.begin_overlay(); }
+	// Brings the composite and view textures up to date, redrawing only what
+	// has been invalidated since the last call and is visible in the view.
+	FrameKind render(glm::vec2 screen_size, glm::vec2 mouse_pos, std::optional<Layer::Id> selected_layer);
+
+	// Must be called whenever a change affects the appearance of a layer other
+	// than the selected one. Layer operations on `Canvas` call this themselves.
+	void invalidate_layer_cache() { m_is_layer_cache_valid = false; }
+
+	// Composites any stale parts of the canvas first, so the whole image is
+	// up to date. The image is read back asynchronously, then encoded and
+	// written on background threads, which the returned export reports on.
+	std::shared_ptr<PngExport> save_as_png(const std::string& filename);
+
+	// Saves every layer to a `.brush` document. Painted tiles are read back
+	// asynchronously, then compressed and written on background threads,
+	// which the returned writer reports on. A thread count of 0 uses every core.
+	std::shared_ptr<DocumentWriter> save_document(const std::string& filename, size_t thread_count = 0);
+	// Replaces every layer with those of a `.brush` document, and clears the
+	// history. Only the document's index is read up front. Tiles stay in the
+	// mapped file until they are first needed, or until they are streamed in
+	// by `stream_document_tiles()`. Throws if the document can't be read or
+	// doesn't match the canvas size. Returns the layer to select.
+	std::optional<Layer::Id> open_document(const std::string& filename);
+	// Restores a few more tiles of the opened document. Should be called once
+	// per tick while `is_streaming_document()`.
+	void stream_document_tiles();
+	bool is_streaming_document() const { return m_is_streaming_document; }
+	// Returns how many tiles couldn't be read back from their compressed
+	// pixels since the last call, e.g. from a damaged document. They are
+	// cleared instead, so the caller only has to tell the user.
+	size_t take_unreadable_tile_count();
 
-	void save_as_png(const char* filename) const;
+	// GPU readbacks complete a frame or two after they are requested, and
+	// their callbacks only run from here, as do those of tiles compressed
+	// in the background. Should be called once per tick.
+	void poll_readbacks();
+	// Waits for every pending readback, e.g. so a save finishes before exit.
+	void finish_readbacks();
+	bool has_pending_readbacks() const { return m_readback_queue.has_pending() || m_tile_compressor.has_pending(); }
+	ReadbackQueue& readback_queue() { return m_readback_queue; }
+	TileCompressor& tile_compressor() { return m_tile_compressor; }
+	// Times the passes that draw to the canvas, and those drawn over it.
+	GpuProfiler& gpu_profiler() { return m_gpu_profiler; }
 
 
 	size_t width() const { return m_output_frame_buffer.width(); }
 	size_t height() const { return m_output_frame_buffer.height(); }
 	glm::vec2 size() const { return glm::vec2(width(), height()); }
 	glm::vec2 window_size() const { return m_canvas_view.size(); }
+	Rect rect() const { return Rect(0, 0, int(width()), int(height())); }
+	size_t last_dirty_area() const { return m_last_dirty_area; }
 
 	const std::vector<Layer>& get_layers() const { return m_layers; }
+	const TileAtlas& tile_atlas(PixelFormat format) const { return m_tile_atlases[size_t(format)]; }
+	size_t tile_bytes_used() const;
+	size_t tile_bytes_reserved() const;
+	// Storage held by the below and above caches, and kept for them by the pool.
+	size_t layer_cache_bytes() const;
+	size_t pooled_layer_cache_bytes() const { return m_frame_buffer_pool.pooled_bytes(); }
+	ResidencyStats residency_stats() const { return m_residency_manager.stats(m_layers, tile_bytes_used()); }
+	void set_vram_budget(size_t bytes) { m_residency_manager.set_budget_bytes(bytes); }
 
 	const Texture2D& output_texture() const { return m_output_frame_buffer.texture(); }
-	const Texture2D& screen_texture() const { return m_canvas_view.get_view_texture(); }
+	const Texture2D& view_texture() const { return m_canvas_view.get_view_texture(); }
+	const Texture2D& screen_texture() const { return m_canvas_view.get_screen_texture(); }
 
 private:
 	void move_layer(std::optional<Layer::Id> layer_id, int delta);
+
+	// Layer operations that leave the history alone, for use by undo and redo.
+	std::optional<size_t> find_layer_index(Layer::Id layer_id) const;
+	void insert_layer_at(Layer layer, size_t index);
+	Layer remove_layer_at(size_t index);
+	void move_layer_to(size_t index, size_t new_index);
+	std::optional<Layer::Id> selection_after_removal(size_t index) const;
+
+	std::optional<Layer::Id> apply_history_entry(HistoryEntry& entry, bool is_undo, std::optional<Layer::Id> selected_layer);
+	std::optional<Layer::Id> set_layer_presence(
+		Layer::Id layer_id,
+		size_t index,
+		std::optional<Layer>& removed_layer,
+		bool should_be_present,
+		std::optional<Layer::Id> selected_layer
+	);
+
+	Rect update_output(const Rect& region);
+	bool update_layer_cache_storage();
+	void release_tile_pages();
+	void rebuild_layer_cache(std::optional<Layer::Id> selected_layer, const Rect& region);
+	void composite_layers(
+		std::vector<Layer>::iterator first,
+		std::vector<Layer>::iterator last,
+		const Rect& region,
+		size_t level = 0
+	);
+	size_t choose_preview_level() const;
+	Rect composite_preview(const Rect& region, size_t level);
+	void update_output_mips(const Rect& region, size_t base_level = 0);
+	void draw_texture(const Texture2D& texture);
 };
 
 
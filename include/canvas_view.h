@@ -5,8 +5,19 @@
 
 #include "frame_buffer.h"
 #include "program.h"
+#include "rect.h"
 #include "texture.h"
 
+// Where the user has moved the view to, without the screen size.
+struct ViewTransform {
+	glm::vec2 translation;
+	glm::vec2 scale;
+	float rotation;
+	bool is_flipped;
+
+	bool operator==(const ViewTransform& other) const = default;
+};
+
 class CanvasView {
 	bool m_flipped;
 	glm::vec2 m_scale;
@@ -15,9 +26,17 @@ class CanvasView {
 
 	size_t m_canvas_width, m_canvas_height;
 
+	// The canvas as seen through the view transform, and a copy of it with
+	// overlays such as the cursor drawn on top. Keeping them apart means the
+	// cursor can move without re-rendering the canvas.
 	FrameBuffer m_frame_buffer;
+	FrameBuffer m_overlay_frame_buffer;
 	Program m_program;
 
+	// Set whenever the transform changes, so that `render()` knows the view
+	// texture is out of date even if the canvas itself is not.
+	bool m_is_transform_dirty;
+
 public:
 	CanvasView(size_t canvas_width, size_t canvas_height);
 
@@ -26,6 +45,8 @@ public:
 	glm::vec2 scale() const { return m_scale; }
 	float rotation() const { return m_rotation; }
 	glm::mat3 get_transform() const;
+	ViewTransform view_transform() const { return ViewTransform{ m_translation, m_scale, m_rotation, m_flipped }; }
+	void set_view_transform(const ViewTransform& transform);
 
 	glm::vec2 screen_space_to_canvas_space(glm::vec2 point) const;
 	float screen_space_to_canvas_space(float dist) const;
@@ -40,12 +61,23 @@ public:
 	void move(glm::vec2 translation); 
 	void flip();
 
-	void render(glm::vec2 screen_size, const Texture2D& canvas);
+	void resize(glm::vec2 screen_size);
+	// Re-renders the view if the canvas, the transform or the screen size has
+	// changed since the last call. Returns whether anything was drawn.
+	bool render(const Texture2D& canvas, bool is_canvas_dirty);
+	// Resets the overlay to the current view and binds it for drawing.
+	void begin_overlay();
 	void bind_fbo() const;
 
+	float choose_lod(const Texture2D& canvas) const;
+	// The region of the canvas that can affect what is on screen, including
+	// the texels that filtering at the current mip level reaches into.
+	Rect visible_canvas_rect(const Texture2D& canvas) const;
+
 	size_t width() const { return m_frame_buffer.width(); }
 	size_t height() const { return m_frame_buffer.height(); }
 	glm::vec2 canvas_size() const { return glm::vec2(m_canvas_width, m_canvas_height); }
 	glm::vec2 size() const { return m_frame_buffer.size(); }
 	const Texture2D& get_view_texture() const { return m_frame_buffer.texture(); }
+	const Texture2D& get_screen_texture() const { return m_overlay_frame_buffer.texture(); }
 };
\ No newline at end of file
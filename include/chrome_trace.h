@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The clock every trace is timed with, so that events from the CPU tracer
+// and the GPU profiler line up.
+int64_t trace_clock_ns();
+
+// Escapes `text` for use inside a JSON string.
+std::string escape_json(const std::string& text);
+
+// Events on named threads, to be written out as a Chrome trace, which
+// chrome://tracing and Perfetto can open. Events on the same thread must
+// either nest or not overlap at all.
+class ChromeTrace {
+    struct Event {
+        std::string name;
+        size_t thread;
+        int64_t begin_ns;
+        int64_t end_ns;
+    };
+
+    std::vector<std::string> m_threads;
+    std::vector<Event> m_events;
+
+public:
+    // Returns the id of the thread with this name, adding it if needed.
+    size_t thread(const std::string& name);
+    void add_event(const std::string& name, size_t thread, int64_t begin_ns, int64_t end_ns);
+    size_t event_count() const { return m_events.size(); }
+
+    // Throws if the file can't be written.
+    void write(const std::string& filename) const;
+};
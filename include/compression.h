@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Lossless zlib compression, used to keep pixel data in host memory.
+std::vector<uint8_t> zlib_compress(const uint8_t* data, size_t size);
+// Throws if the data is corrupt or doesn't decompress to `expected_size` bytes.
+std::vector<uint8_t> zlib_decompress(const uint8_t* data, size_t size, size_t expected_size);
+std::vector<uint8_t> zlib_decompress(const std::vector<uint8_t>& data, size_t expected_size);
+
+// Compresses `data` into raw deflate blocks that can be concatenated with
+// those of the data that follows, so that separate parts of a stream can be
+// compressed in parallel. Only the part marked `is_final` ends the stream.
+// Matches never reach back before the start of `data`.
+void deflate_part(const uint8_t* data, size_t size, bool is_final, std::vector<uint8_t>& out);
+
+// Checksums for zlib streams and PNG chunks. Pass the previous result to
+// continue a checksum over more data.
+uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1);
+// The Adler-32 of two pieces of data, given the checksum of each and the
+// size of the second.
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size);
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,30 @@
+#pragma once
+#include <vector>
+
+#include "rect.h"
+
+// `DirtyRegion` tracks which parts of a canvas-sized image are out of date.
+// It splits the image into tile-sized cells, and remembers a bounding rect
+// within each cell, so that small changes stay small but distant changes
+// don't merge into one huge rect.
+class DirtyRegion {
+    int m_width, m_height;
+    int m_cells_x, m_cells_y;
+    std::vector<Rect> m_cells;
+
+public:
+    DirtyRegion(size_t width, size_t height);
+
+    void mark(const Rect& rect);
+    void mark_all() { mark(Rect(0, 0, m_width, m_height)); }
+
+    // Marks every cell overlapping `region` as clean, and returns the
+    // bounding rect of what was dirty within them. The caller is expected
+    // to bring that rect up to date.
+    Rect take(const Rect& region);
+
+    bool is_empty() const;
+
+private:
+    Rect cell_range(const Rect& rect) const;
+};
@@ -0,0 +1,216 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "layer.h"
+#include "mapped_file.h"
+#include "pixel_format.h"
+#include "readback.h"
+
+// Native `.brush` documents store every layer as a grid of independently
+// compressed tiles, so a layer's tiles can be loaded in any order, in
+// parallel, and only once they are needed. All values are little-endian.
+//
+//   Header:  "BRSH", u32 version, u32 width, u32 height, u32 tile size,
+//            u32 layer count, u64 index offset, u64 index size
+//   Tiles:   zlib streams of raw tile texels, in the layer's pixel format,
+//            with premultiplied color
+//   Index:   for each layer, from the bottom up:
+//              u32 name size, name, u8 format, u8 visible, u8 alpha locked,
+//              u8 reserved, f32 tint[3], u32 tile count, and for each tile:
+//                u32 x, u32 y, u8 kind, then either
+//                  f32 color[4] for a solid tile, or
+//                  u64 offset, u64 size for a painted one
+//
+// Empty tiles are left out of the index, so they cost nothing. The index
+// comes last since its size is only known once every tile has been written.
+//
+// Version 1 documents are the same, except that color (including that of
+// solid tiles) has straight alpha.
+
+struct DocumentLayerInfo {
+    std::string name;
+    PixelFormat format;
+    bool is_visible;
+    bool is_alpha_locked;
+    glm::vec3 tint;
+
+    bool operator==(const DocumentLayerInfo& other) const = default;
+};
+
+struct DocumentTile {
+    glm::ivec2 pos;
+    bool is_solid;
+    // The raw texel value of a solid tile.
+    glm::vec4 color;
+    // The compressed texels of a painted tile, within the mapped file.
+    std::span<const uint8_t> data;
+};
+
+struct DocumentLayer {
+    DocumentLayerInfo info;
+    std::vector<DocumentTile> tiles;
+};
+
+struct Document {
+    size_t width, height;
+    // False for version 1 documents, whose tiles need converting.
+    bool is_premultiplied;
+    std::vector<DocumentLayer> layers;
+    // Keeps the tile data of the layers readable.
+    std::shared_ptr<const MappedFile> file;
+};
+
+// Maps a document and reads its index, without touching any tile data.
+// Throws if the file isn't a valid document.
+Document read_document(const std::string& filename);
+
+// Convert the tiles of color layers in version 1 documents. Tiles have to
+// be decompressed for it, so they no longer refer to the mapped file.
+// Throws if a tile is corrupt.
+glm::vec4 premultiply_legacy_color(glm::vec4 color);
+std::vector<uint8_t> premultiply_legacy_tile(PixelFormat format, std::span<const uint8_t> data);
+
+// Where a saved tile ended up in the file.
+struct DocumentTileRecord {
+    glm::ivec2 pos;
+    bool is_solid;
+    glm::vec4 color;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct DocumentSaveStats {
+    // Only what this save wrote, which for an append is a fraction of the file.
+    size_t tile_count;
+    size_t output_bytes;
+    double seconds;
+};
+
+// `DocumentWriter` saves a document in the background. Layers and their
+// tiles are added from the main thread, either already compressed or as raw
+// texels that are still being read back from the GPU. Once started, a pool
+// of worker threads compresses tiles and appends them to the file as they
+// become available, in whatever order that happens to be. Once every tile is
+// written, the writer thread finishes the file with the index.
+//
+// The document is written next to `filename` and only moved in place once
+// complete, so a failed save never leaves a broken document behind. An
+// append instead adds tiles and a new index to the end of an existing
+// document, and points its header at the new index last.
+class DocumentWriter {
+    struct LayerRecord {
+        DocumentLayerInfo info;
+        std::vector<DocumentTileRecord> tiles;
+    };
+
+    struct Job {
+        size_t layer;
+        size_t tile;
+        std::vector<uint8_t> data;
+        bool is_compressed;
+        // Set instead of `data` for tiles that are still in a mapped file.
+        std::span<const uint8_t> mapped;
+    };
+
+    std::string m_filename;
+    std::string m_temp_filename;
+    std::optional<uint64_t> m_append_offset;
+    size_t m_width, m_height;
+    size_t m_thread_count;
+
+    std::vector<LayerRecord> m_layers;
+    // Documents that tiles are copied from must stay mapped until written.
+    std::vector<std::shared_ptr<const MappedFile>> m_mapped_files;
+
+    // The layer and tile index of every pending tile, by pending id.
+    std::vector<std::pair<size_t, size_t>> m_pending_tiles;
+
+    std::deque<Job> m_jobs;
+    size_t m_data_tile_count;
+    size_t m_undelivered_tiles;
+    std::atomic<size_t> m_tiles_written;
+    std::atomic<uint64_t> m_bytes_written;
+    bool m_is_started;
+    bool m_is_cancelled;
+
+    std::mutex m_mutex;
+    std::condition_variable m_job_ready;
+    std::mutex m_file_mutex;
+    FILE* m_file;
+    uint64_t m_file_end;
+
+    std::atomic<bool> m_is_finished;
+    std::optional<std::string> m_error;
+    DocumentSaveStats m_stats;
+
+    std::thread m_writer;
+
+public:
+    // A thread count of 0 uses every core.
+    DocumentWriter(std::string filename, size_t width, size_t height, size_t thread_count = 0);
+    // Waits for the file to be written. Tiles that can no longer be
+    // delivered cancel the save.
+    ~DocumentWriter();
+    DocumentWriter(const DocumentWriter&) = delete;
+    DocumentWriter& operator=(const DocumentWriter&) = delete;
+
+    // Appends to the document already at `filename`, which must have been
+    // written with the same size, after its first `file_size` bytes. Must
+    // be called before anything is added.
+    void append_to(uint64_t file_size) { m_append_offset = file_size; }
+
+    // Tiles added afterwards belong to this layer. Layers are added from the
+    // bottom up.
+    void add_layer(const DocumentLayerInfo& info);
+    void add_solid_tile(glm::ivec2 pos, glm::vec4 color);
+    void add_compressed_tile(glm::ivec2 pos, std::vector<uint8_t> compressed);
+    void add_mapped_tile(glm::ivec2 pos, std::span<const uint8_t> compressed, std::shared_ptr<const MappedFile> file);
+    // Adds a tile whose texels are handed over later through `deliver_tile()`.
+    // Returns the id to deliver them with.
+    size_t add_pending_tile(glm::ivec2 pos);
+    void deliver_tile(size_t pending_id, std::vector<uint8_t>&& texels);
+    // Adds a tile that is already in the document being appended to.
+    void add_existing_tile(glm::ivec2 pos, uint64_t offset, uint64_t size);
+
+    // Starts writing. No more layers or tiles may be added.
+    void start();
+
+    const std::string& filename() const { return m_filename; }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    bool is_finished() const { return m_is_finished; }
+    // Only valid once finished.
+    const std::optional<std::string>& error() const { return m_error; }
+    const DocumentSaveStats& stats() const { return m_stats; }
+    float progress() const;
+    // Only valid once finished without an error.
+    const std::vector<DocumentTileRecord>& tile_records(size_t layer) const { return m_layers[layer].tiles; }
+    uint64_t file_size() const { return m_file_end; }
+
+private:
+    void push_job(Job job);
+    void write_file();
+    void write_tiles();
+    void write_tile(Job& job);
+    std::vector<uint8_t> encode_index() const;
+    void fail(const std::string& message);
+};
+
+DocumentLayerInfo document_layer_info(const Layer& layer);
+// Adds a tile of `layer` to `writer`. Tiles that are only in the atlas are
+// read back through `queue`, and delivered to the writer once they arrive.
+void add_layer_tile(const std::shared_ptr<DocumentWriter>& writer, const Layer& layer, glm::ivec2 tile, ReadbackQueue& queue);
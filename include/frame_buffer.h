@@ -10,6 +10,8 @@
 #include <glad/glad.h>  
 #include <glm/glm.hpp>  
 
+#include "gl_state.h"
+#include "rect.h"
 #include "texture.h"
 
 class FrameBuffer {
@@ -17,7 +19,7 @@ class FrameBuffer {
     Texture2D m_texture;
 
 public:
-    FrameBuffer(size_t width, size_t height) : m_texture(width, height) {
+    FrameBuffer(size_t width, size_t height, bool is_mipmapped = false) : m_texture(width, height, is_mipmapped) {
         glGenFramebuffers(1, &m_id);
         if (m_id == 0) {
             throw std::runtime_error("Failed to generate framebuffer");
@@ -35,6 +37,7 @@ public:
     ~FrameBuffer() {
         if (m_id != 0) {
             glDeleteFramebuffers(1, &m_id);
+            GlState::forget_framebuffer(m_id);
         }
     }
 
@@ -50,6 +53,7 @@ public:
         if (this != &other) {
             if (m_id != 0) {
                 glDeleteFramebuffers(1, &m_id);
+                GlState::forget_framebuffer(m_id);
             }
             m_id = std::exchange(other.m_id, 0);
             m_texture = std::move(other.m_texture);
@@ -58,32 +62,25 @@ public:
     }
 
     void bind() const {
-        glBindFramebuffer(GL_FRAMEBUFFER, m_id);
+        GlState::bind_framebuffer(m_id);
     }
 
     static void unbind() {
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        GlState::bind_framebuffer(0);
     }
 
     void set_viewport() const {
         glViewport(0, 0, width(), height());
     }
 
-    std::optional<glm::vec3> get_color_at_pos(glm::vec2 point) {
-        if (point.x < 0 || point.x >= width() ||
-            point.y < 0 || point.y >= height()) {
-            return std::nullopt;
-        }
-
-        bind();
-
-        uint8_t pixel[4];
-        glReadPixels(int(point.x), int(point.y), 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &pixel);
-        glm::vec3 color = glm::vec3(pixel[0], pixel[1], pixel[2]) / 255.0f;
-
-        unbind();
+    // Restricts drawing and clearing to `rect`, until `disable_scissor()`.
+    static void set_scissor(const Rect& rect) {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(rect.min.x, rect.min.y, rect.width(), rect.height());
+    }
 
-        return color;
+    static void disable_scissor() {
+        glDisable(GL_SCISSOR_TEST);
     }
 
     void clear(glm::vec4 color) {
@@ -91,23 +88,10 @@ public:
         glClear(GL_COLOR_BUFFER_BIT);
     }
 
-    void get_pixel_data(std::vector<uint8_t>& pixels) const {
-        bind();
-
-        pixels.resize(width() * height() * 4);
-        glReadPixels(
-            0, 0,
-            width(), height(),
-            GL_RGBA,
-            GL_UNSIGNED_BYTE,
-            pixels.data()
-        );
-
-        unbind();
-    }
-
-    void reattach_texture() {
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture.id(), 0);
+    // Draws to mip `level` of the texture from now on. The framebuffer must
+    // be bound.
+    void reattach_texture(size_t level = 0) {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_texture.id(), GLint(level));
     }
 
     void resize(size_t width, size_t height) {
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#include "frame_buffer.h"
+
+// `FrameBufferPool` keeps released framebuffers around, so that one of the
+// same size can be handed out again without allocating new storage.
+// Allocating a canvas-sized texture stalls for as long as the driver takes
+// to find and commit the memory, which for large canvases is many frames.
+//
+// Framebuffers come back with whatever was last drawn to them, so their
+// owner must clear or overwrite everything it reads.
+class FrameBufferPool {
+    // Oldest first. Released framebuffers are only deleted to stay within
+    // `m_max_bytes`.
+    std::vector<FrameBuffer> m_frame_buffers;
+    size_t m_max_bytes;
+    size_t m_allocated_count;
+    size_t m_reused_count;
+
+public:
+    explicit FrameBufferPool(size_t max_bytes);
+    FrameBufferPool(const FrameBufferPool&) = delete;
+    FrameBufferPool& operator=(const FrameBufferPool&) = delete;
+
+    FrameBuffer acquire(size_t width, size_t height, bool is_mipmapped = false);
+    void release(FrameBuffer frame_buffer);
+
+    size_t pooled_bytes() const;
+    size_t allocated_count() const { return m_allocated_count; }
+    size_t reused_count() const { return m_reused_count; }
+};
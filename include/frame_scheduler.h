@@ -0,0 +1,52 @@
+#pragma once
+#include <optional>
+
+// `FrameScheduler` decides when the main loop wakes up, and what it should do
+// once it has. Input is sampled on one clock and the display is rendered on
+// another, but neither clock runs while the app is idle: the loop blocks on
+// OS events until there is new input or a display frame is owed.
+class FrameScheduler {
+    double m_input_dt;
+    double m_display_dt;
+
+    double m_next_input_time;
+    double m_next_display_time;
+
+    // After any input, we keep sampling at the input rate for a short while,
+    // since ImGui needs a few frames to settle hover states and the like.
+    double m_active_until;
+    bool m_is_held_active;
+    // While idle, the loop still wakes up by this time, e.g. for autosave.
+    std::optional<double> m_wake_time;
+
+    int m_pending_display_frames;
+
+public:
+    FrameScheduler(double input_fps, double display_fps);
+    ~FrameScheduler();
+    FrameScheduler(const FrameScheduler&) = delete;
+    FrameScheduler& operator=(const FrameScheduler&) = delete;
+
+    // Blocks until the next input tick should run, processing OS events
+    // while waiting. Returns the time at which the tick starts.
+    double wait_for_next_tick();
+
+    // Called when the window received user input this tick.
+    void notify_input(double now);
+    // Keeps the input clock running, e.g. while a mouse button is held.
+    void hold_active(bool is_active) { m_is_held_active = is_active; }
+    // Wakes the loop up by `time` even if there is no input by then.
+    void wake_at(std::optional<double> time) { m_wake_time = time; }
+    // Requests that at least one more display frame is rendered.
+    void invalidate(int frames = 1);
+
+    bool is_display_frame_due(double now) const;
+    void on_display_frame(double now);
+
+    bool is_active(double now) const { return m_is_held_active || now < m_active_until; }
+
+private:
+    // Processes OS events until `time`. Returns whether it waited at all,
+    // which it doesn't if `time` has already passed.
+    bool wait_until(double time);
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "chrome_trace.h"
+
+// Percentiles of a zone's durations since the histograms were last reset.
+struct TraceZoneStats {
+    std::string name;
+    size_t count;
+    double p50_ms;
+    double p95_ms;
+    double p99_ms;
+    double max_ms;
+};
+
+// `FrameTracer` times named zones of the main loop on the CPU. Every zone
+// keeps a histogram of its durations, so that a rare hitch still shows up in
+// its p99 and max rather than being averaged away. While tracing, each zone
+// is also kept as an event for a Chrome trace.
+//
+// Zones are marked with `TRACE_ZONE()`, which compiles to nothing unless
+// `BRUSH_TRACING` is defined.
+class FrameTracer {
+    // Durations are bucketed on a log scale, from 1 us up to about 16 s.
+    // Percentiles are reported as the upper bound of their bucket, so are
+    // within 9% of the true value.
+    static constexpr size_t BUCKETS_PER_DOUBLING = 8;
+    static constexpr size_t BUCKET_COUNT = BUCKETS_PER_DOUBLING * 24;
+
+    struct Zone {
+        const char* name;
+        std::array<uint64_t, BUCKET_COUNT> buckets;
+        size_t count;
+        int64_t max_ns;
+    };
+
+    struct TraceEvent {
+        size_t zone;
+        int64_t begin_ns;
+        int64_t end_ns;
+    };
+
+    std::vector<Zone> m_zones;
+    bool m_is_tracing;
+    std::vector<TraceEvent> m_trace;
+
+public:
+    FrameTracer();
+
+    // Names are compared by pointer first, so string literals are cheapest.
+    size_t find_zone(const char* name);
+    void record(size_t zone_index, int64_t begin_ns, int64_t end_ns);
+
+    // Zones are listed in the order they were first seen.
+    std::vector<TraceZoneStats> stats() const;
+    void reset_histograms();
+
+    void start_trace();
+    bool is_tracing() const { return m_is_tracing; }
+    // Stops tracing, and adds what was traced to `trace`.
+    void stop_trace(ChromeTrace& trace);
+
+private:
+    double bucket_upper_bound_ms(size_t bucket) const;
+};
+
+// Times its own lifetime as a zone.
+class TraceZone {
+    FrameTracer& m_tracer;
+    size_t m_zone;
+    int64_t m_begin_ns;
+
+public:
+    TraceZone(FrameTracer& tracer, const char* name)
+        : m_tracer(tracer), m_zone(tracer.find_zone(name)), m_begin_ns(trace_clock_ns()) {}
+    ~TraceZone() { m_tracer.record(m_zone, m_begin_ns, trace_clock_ns()); }
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+};
+
+#ifdef BRUSH_TRACING
+#define TRACE_ZONE_CONCAT_INNER(a, b) a##b
+#define TRACE_ZONE_CONCAT(a, b) TRACE_ZONE_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope as a zone of `tracer`.
+#define TRACE_ZONE(tracer, name) TraceZone TRACE_ZONE_CONCAT(trace_zone_, __LINE__)(tracer, name)
+#else
+#define TRACE_ZONE(tracer, name) ((void)0)
+#endif
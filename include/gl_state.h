@@ -0,0 +1,56 @@
+#pragma once
+#include <cstddef>
+
+#include <glad/glad.h>
+
+// How much GL work was issued since the counts were last taken.
+struct GlStateCounts {
+    // Binds that reached the driver, and those skipped because the object
+    // was already bound.
+    size_t state_changes = 0;
+    size_t skipped_changes = 0;
+    size_t draw_calls = 0;
+    size_t dispatches = 0;
+};
+
+// `GlState` shadows the bindings the renderer changes most often, so that
+// binding what is already bound never reaches the driver. Framebuffers,
+// programs, textures, buffers and the vertex array must all be bound through
+// here, and their deletion reported, or the shadow falls out of sync. Code
+// that binds things behind its back, such as ImGui's renderer, must be
+// followed by `invalidate()`.
+//
+// Like everything else touching GL, it must only be used on the thread that
+// owns the context.
+class GlState {
+public:
+    // Texture units past this are bound every time.
+    static constexpr size_t TRACKED_TEXTURE_UNITS = 16;
+
+    static void bind_framebuffer(GLuint id);
+    static void use_program(GLuint id);
+    static void bind_vertex_array(GLuint id);
+    static void active_texture(size_t unit);
+    // Binds to the active texture unit.
+    static void bind_texture(GLenum target, GLuint id);
+    static void bind_texture_to(size_t unit, GLenum target, GLuint id);
+    static void bind_buffer(GLenum target, GLuint id);
+    // Also binds the buffer to `target` itself, as GL does.
+    static void bind_buffer_base(GLenum target, GLuint index, GLuint id);
+
+    static void draw_arrays(GLenum mode, GLint first, GLsizei count);
+    static void draw_arrays_instanced(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+    static void dispatch_compute(GLuint groups_x, GLuint groups_y, GLuint groups_z);
+
+    // Deleting a bound object unbinds it, and its name may be handed out
+    // again, so deletions must be reported right after they happen.
+    static void forget_framebuffer(GLuint id);
+    static void forget_program(GLuint id);
+    static void forget_texture(GLuint id);
+    static void forget_buffer(GLuint id);
+    // Makes every binding unknown, so the next bind of each always happens.
+    static void invalidate();
+
+    // Returns the counts since the last call, and starts counting afresh.
+    static GlStateCounts take_counts();
+};
@@ -0,0 +1,125 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "chrome_trace.h"
+
+// Rolling timings of one pass, over its most recent frames.
+struct GpuPassStats {
+    std::string name;
+    double average_gpu_ms;
+    double max_gpu_ms;
+    double average_cpu_ms;
+    double max_cpu_ms;
+};
+
+// `GpuProfiler` times render passes on both the CPU and the GPU. Each pass
+// is bracketed by GPU timestamp queries, which unlike elapsed-time queries
+// can nest, and also place the pass on the GPU's timeline. Queries are
+// recycled through a ring of frames, and only read once the GPU reports them
+// available, a few frames later, so profiling never stalls the pipeline.
+// Frames whose queries still aren't available when their slot comes around
+// again are dropped.
+//
+// While tracing, every pass is also kept, so that the CPU and GPU timelines
+// can be added side by side to a Chrome trace.
+class GpuProfiler {
+    struct Zone {
+        size_t pass;
+        int64_t cpu_begin_ns;
+        int64_t cpu_end_ns;
+        GLuint begin_query;
+        GLuint end_query;
+    };
+
+    struct Frame {
+        std::vector<Zone> zones;
+        std::vector<GLuint> queries;
+        size_t used_queries = 0;
+        // Converts GPU timestamps to the CPU clock, as of the frame's start.
+        int64_t gpu_to_cpu_ns = 0;
+        bool is_pending = false;
+    };
+
+    struct PassHistory {
+        std::string name;
+        // Per-frame totals, in a ring.
+        std::vector<double> gpu_ms;
+        std::vector<double> cpu_ms;
+        size_t next_sample = 0;
+    };
+
+    struct TraceEvent {
+        size_t pass;
+        bool is_gpu;
+        int64_t begin_ns;
+        int64_t end_ns;
+    };
+
+    static constexpr size_t FRAMES_IN_FLIGHT = 4;
+    std::array<Frame, FRAMES_IN_FLIGHT> m_frames;
+    size_t m_current_frame;
+    bool m_is_enabled;
+    bool m_is_tracing;
+
+    std::vector<PassHistory> m_passes;
+    size_t m_dropped_frames;
+    std::vector<TraceEvent> m_trace;
+
+public:
+    // The number of frames that rolling stats are taken over.
+    static constexpr size_t HISTORY_FRAMES = 120;
+
+    GpuProfiler();
+    ~GpuProfiler();
+    GpuProfiler(const GpuProfiler&) = delete;
+    GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+    // Collects whatever earlier frames the GPU has finished, and starts
+    // timing a new one. Should be called once per tick.
+    void begin_frame();
+    // Waits for every frame in flight and collects it, e.g. before writing
+    // a trace.
+    void finish();
+
+    bool is_enabled() const { return m_is_enabled; }
+    void set_enabled(bool is_enabled) { m_is_enabled = is_enabled; }
+
+    // Passes are listed in the order they were first seen.
+    std::vector<GpuPassStats> stats() const;
+    size_t dropped_frames() const { return m_dropped_frames; }
+
+    void start_trace();
+    bool is_tracing() const { return m_is_tracing; }
+    // Stops tracing, and adds what was traced to `trace`.
+    void stop_trace(ChromeTrace& trace);
+
+    // Both return a handle for `end_pass()`, which is empty while disabled.
+    std::optional<size_t> begin_pass(const char* name);
+    void end_pass(std::optional<size_t> zone);
+
+private:
+    void sync_clocks(Frame& frame);
+    size_t find_pass(const char* name);
+    GLuint take_query(Frame& frame);
+    bool is_frame_available(const Frame& frame) const;
+    void collect_frame(Frame& frame);
+};
+
+// Times everything issued during its lifetime as one pass.
+class GpuPassScope {
+    GpuProfiler& m_profiler;
+    std::optional<size_t> m_zone;
+
+public:
+    GpuPassScope(GpuProfiler& profiler, const char* name)
+        : m_profiler(profiler), m_zone(profiler.begin_pass(name)) {}
+    ~GpuPassScope() { m_profiler.end_pass(m_zone); }
+    GpuPassScope(const GpuPassScope&) = delete;
+    GpuPassScope& operator=(const GpuPassScope&) = delete;
+};
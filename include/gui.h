@@ -1,12 +1,21 @@
 #pragma once
 #include <optional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <imgui_impl_glfw.h>
 #include <glm/fwd.hpp>
 
 #include "canvas.h"
+#include "document.h"
+#include "frame_tracer.h"
+#include "gl_state.h"
+#include "gpu_profiler.h"
 #include "layer.h"
+#include "pixel_format.h"
+#include "png_export.h"
+#include "residency_manager.h"
 #include "tools.h"
 #include "user_state.h"
 
@@ -15,6 +24,37 @@ struct DebugState {
     glm::vec2 mouse_pos;
     glm::vec2 canvas_pos;
     bool is_flipped;
+    size_t dirty_area;
+    size_t canvas_area;
+    size_t tile_bytes_used;
+    size_t tile_bytes_reserved;
+    size_t layer_cache_bytes;
+    size_t pooled_layer_cache_bytes;
+    size_t skipped_frames;
+    size_t partial_frames;
+    size_t full_frames;
+    GlStateCounts gl_counts;
+    ResidencyStats residency;
+    size_t history_bytes;
+    std::optional<float> export_progress;
+    std::optional<PngExportStats> last_export;
+    std::optional<float> document_save_progress;
+    std::optional<DocumentSaveStats> last_autosave;
+    std::optional<std::string> autosave_error;
+    // Only set while recording strokes.
+    std::optional<size_t> recorded_frames;
+    std::vector<TraceZoneStats> frame_zones;
+    std::vector<GpuPassStats> gpu_passes;
+    size_t dropped_gpu_frames;
+    bool is_tracing;
+};
+
+// A save or open asked for from the file window, which the app carries out.
+struct DocumentRequest {
+    enum class Kind { Save, Open };
+
+    Kind kind;
+    std::string filename;
 };
 
 // GUI class responsible for defining the interface layout in Dear ImGui.
@@ -27,6 +67,14 @@ private:
 
     std::optional<std::string> m_alert_message;
 
+    PixelFormat m_new_layer_format;
+
+    std::string m_document_path;
+    std::optional<DocumentRequest> m_document_request;
+    bool m_is_recording_toggled;
+    bool m_is_trace_toggled;
+    bool m_is_histogram_reset;
+
 public: 
     GUI(GLFWwindow* window, glm::vec2 canvas_size);
     ~GUI();
@@ -41,8 +89,9 @@ public:
     void define_color_picker_window(glm::vec3& color);
     void define_tool_window(ToolManager& tool_manager);
     void define_tool_properties_window(ToolManager& tool_manager);
-    void define_debug_window(DebugState& debug_state, UserState& user_state);
+    void define_debug_window(DebugState& debug_state, UserState& user_state, Canvas& canvas);
     void define_error_popup();
+    void define_file_window(std::optional<float> save_progress);
     void define_layer_window(Canvas& canvas, std::optional<Layer::Id>& selected_layer);
     void define_layer_buttons(Canvas& canvas, std::optional<Layer::Id>& selected_layer);
     void define_layer_list(Canvas& canvas, std::optional<Layer::Id>& selected_layer);
@@ -53,5 +102,13 @@ public:
     glm::vec2 get_mouse_position_on_canvas_window(glm::vec2 mouse_pos) const;
     glm::vec2 canvas_window_pos() const { return m_canvas_window_pos; };
     glm::vec2 canvas_window_size() const { return m_canvas_window_size; };
+
+    std::optional<DocumentRequest> take_document_request() { return std::exchange(m_document_request, std::nullopt); }
+    // Whether the record button was clicked since the last call.
+    bool take_recording_toggle() { return std::exchange(m_is_recording_toggled, false); }
+    // Whether the trace button was clicked since the last call.
+    bool take_trace_toggle() { return std::exchange(m_is_trace_toggled, false); }
+    bool take_histogram_reset() { return std::exchange(m_is_histogram_reset, false); }
+    void show_alert(const std::string& message) { m_alert_message = message; }
 };
 
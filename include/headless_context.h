@@ -0,0 +1,23 @@
+#pragma once
+
+// An OpenGL 4.3 core context without a window, for running the engine from
+// the command line. On Linux it is an EGL context with no surface, so it
+// works without a display, and on machines without a GPU it runs on Mesa's
+// llvmpipe (set `LIBGL_ALWAYS_SOFTWARE=1` to force it). On Windows it is a
+// hidden GLFW window. Everything is drawn to `FrameBuffer`s, so nothing is
+// ever presented. The context is current on the creating thread until
+// destroyed. Throws if no suitable context can be created.
+class HeadlessContext {
+#if defined(_WIN32)
+    void* m_window;
+#else
+    void* m_display;
+    void* m_context;
+#endif
+
+public:
+    HeadlessContext();
+    ~HeadlessContext();
+    HeadlessContext(const HeadlessContext&) = delete;
+    HeadlessContext& operator=(const HeadlessContext&) = delete;
+};
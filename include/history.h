@@ -0,0 +1,132 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "layer.h"
+#include "rect.h"
+#include "tile_atlas.h"
+#include "tile_compressor.h"
+
+// The tiles of a layer touched by one edit, such as a brush stroke. Tiles are
+// recorded copy-on-write, just before the edit first changes them, so an edit
+// only costs memory in proportion to the area it covered. Recorded tiles are
+// moved into compressed host memory in the background, by the
+// `TileCompressor`.
+class TileEdit {
+    // Shared with pending compressions, which only apply to a tile if it is
+    // still the one they read. Every swap bumps a tile's generation.
+    struct Tiles {
+        std::vector<Layer::Tile> tiles;
+        std::vector<uint64_t> generations;
+    };
+
+    Layer::Id m_layer_id;
+    TileAtlas* m_atlas;
+    std::vector<glm::ivec2> m_positions;
+    std::shared_ptr<Tiles> m_tiles;
+    // Which tiles have been recorded so far, indexed like the layer's tiles.
+    std::vector<bool> m_is_recorded;
+
+public:
+    explicit TileEdit(const Layer& layer);
+    ~TileEdit();
+    TileEdit(const TileEdit&) = delete;
+    TileEdit& operator=(const TileEdit&) = delete;
+    TileEdit(TileEdit&& other) noexcept = default;
+    TileEdit& operator=(TileEdit&& other) noexcept;
+
+    Layer::Id layer_id() const { return m_layer_id; }
+    bool is_empty() const { return m_positions.empty(); }
+
+    // Must be called before a tile is modified. Only the first call for a
+    // given tile records anything.
+    void record(const Layer& layer, glm::ivec2 tile);
+    // Called once the edit is done. Starts compressing the recorded tiles.
+    void finish(TileCompressor& compressor);
+    // Exchanges the recorded tiles with the layer's current ones. Swapping
+    // once undoes the edit, and swapping again redoes it.
+    void swap(Layer& layer, TileCompressor& compressor);
+
+    // Tiles still waiting to be compressed count at their full size.
+    size_t byte_size() const;
+
+private:
+    void compress_tiles(TileCompressor& compressor);
+    void free_tiles();
+};
+
+// A layer added to the canvas. While undone, the history holds on to the
+// layer so that it can be put back.
+struct LayerInsertion {
+    Layer::Id layer_id;
+    size_t index;
+    std::optional<Layer> removed_layer;
+};
+
+// A layer removed from the canvas. The history holds on to the layer, with
+// its tiles compressed in the background, until the deletion is undone.
+struct LayerDeletion {
+    Layer::Id layer_id;
+    size_t index;
+    std::optional<Layer> removed_layer;
+};
+
+struct LayerMove {
+    Layer::Id layer_id;
+    size_t from_index;
+    size_t to_index;
+};
+
+struct LayerVisibilityChange {
+    Layer::Id layer_id;
+    bool is_visible;
+};
+
+typedef std::variant<TileEdit, LayerInsertion, LayerDeletion, LayerMove, LayerVisibilityChange> HistoryEntry;
+
+size_t history_entry_byte_size(const HistoryEntry& entry);
+
+// `History` stores the undo and redo stacks. Once the entries take up more
+// than the budget, the oldest undo entries are dropped, but the most recent
+// one is always kept.
+class History {
+    struct Record {
+        HistoryEntry entry;
+        size_t bytes;
+    };
+
+    size_t m_budget_bytes;
+    size_t m_used_bytes;
+    std::deque<Record> m_undo_records;
+    std::vector<Record> m_redo_records;
+
+public:
+    explicit History(size_t budget_bytes);
+
+    // Adds a new edit, which discards everything that could be redone.
+    void push(HistoryEntry entry);
+    void clear();
+
+    // The caller applies the entry, then hands it back to the other stack.
+    std::optional<HistoryEntry> take_undo();
+    std::optional<HistoryEntry> take_redo();
+    void push_undone(HistoryEntry entry);
+    void push_redone(HistoryEntry entry);
+
+    bool can_undo() const { return !m_undo_records.empty(); }
+    bool can_redo() const { return !m_redo_records.empty(); }
+
+    size_t used_bytes() const { return m_used_bytes; }
+    size_t budget_bytes() const { return m_budget_bytes; }
+    void set_budget_bytes(size_t budget_bytes);
+
+private:
+    Record make_record(HistoryEntry entry) const;
+    void trim();
+};
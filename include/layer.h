@@ -1,38 +1,176 @@
 #pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <glm/fwd.hpp>
 
-#include "frame_buffer.h"
-#include "program.h"
-#include "texture.h"
+#include "mapped_file.h"
+#include "pixel_format.h"
+#include "readback.h"
+#include "rect.h"
+#include "tile_atlas.h"
+#include "tile_compressor.h"
 
+// A `Layer` stores its pixels as a grid of tiles. Tiles that are fully
+// transparent take no storage, and tiles that are a single solid color only
+// store that color. Only tiles with painted detail occupy a slot in the
+// shared `TileAtlas`, whose format decides the layer's pixel format.
+// Color is stored premultiplied by alpha, so layers blend associatively.
+//
+// Mask layers (`PixelFormat::R8`) only store coverage, and are drawn in a
+// single tint color.
 class Layer {
 public:
     typedef unsigned int Id;
 
+    struct Tile {
+        // Evicted tiles have painted detail, but it is stored compressed in
+        // host memory rather than in the atlas.
+        enum class Kind { Empty, Solid, Allocated, Evicted };
+
+        Kind kind;
+        TileAtlas::Slot slot;
+        // The raw (premultiplied) texel value of a solid tile. For masks,
+        // only red is used.
+        glm::vec4 color;
+        // The pixels of an evicted tile. An allocated tile that was restored
+        // and hasn't been drawn to since keeps them too, so that evicting it
+        // again only has to free its slot.
+        std::vector<uint8_t> compressed;
+        // Evicted tiles of a layer opened from a document may still only be
+        // in the file, which the layer keeps mapped. Only set within a layer.
+        std::span<const uint8_t> mapped;
+
+        Tile() {
+            kind = Kind::Empty;
+            slot = 0;
+            color = glm::vec4(0.0, 0.0, 0.0, 0.0);
+        }
+
+        std::span<const uint8_t> compressed_data() const {
+            return mapped.empty() ? std::span<const uint8_t>(compressed) : mapped;
+        }
+    };
+
 private:
     Id m_id;
     std::string m_name;
     bool m_is_visible;
     bool m_is_alpha_locked;
+    glm::vec3 m_tint;
 
-    FrameBuffer m_frame_buffer;
+    size_t m_width, m_height;
+    TileAtlas* m_atlas;
+    // The document the layer was opened from, if any of its tiles are still
+    // only stored there.
+    std::shared_ptr<const MappedFile> m_source_file;
+    // Page table of `tiles_x() * tiles_y()` tiles, stored row by row from
+    // the bottom of the canvas.
+    std::vector<Tile> m_tiles;
+    // Tiles whose pixels changed since the last `take_modified_tiles()`,
+    // indexed like `m_tiles`.
+    std::vector<bool> m_modified_tiles;
+    // Bumped whenever a tile's pixels or storage change, so that work
+    // finishing later, such as an eviction, can tell if it still applies.
+    std::vector<uint64_t> m_tile_generations;
+    // Tiles being compressed to be evicted. They keep their slot until then.
+    std::vector<bool> m_evicting_tiles;
+    // Points at the layer wherever it is moved to, so that late work can
+    // find it, or tell that it is gone.
+    std::shared_ptr<Layer*> m_handle;
+    // Tiles dropped since the last `take_unreadable_tile_count()`.
+    size_t m_unreadable_tile_count;
 
-    Program m_quad_program;
+    // Union of every region drawn to since the canvas last composited this layer.
+    Rect m_dirty_rect;
 
 public:
-    Layer(size_t width, size_t height);
-    ~Layer() = default;
+    Layer(size_t width, size_t height, TileAtlas& atlas);
+    ~Layer();
     Layer(const Layer&) = delete;
     Layer& operator=(const Layer&) = delete;
     Layer(Layer&& other) noexcept;
     Layer& operator=(Layer&& other) noexcept;
 
-    void bind_canvas_fbo() const;
-    void unbind_fbo() const { FrameBuffer::unbind(); };
+    // Composites the part of the layer within `region` 1:1 into the
+    // currently bound, canvas-sized framebuffer. Tiles within `region` must
+    // have been made resident first.
+    void render(const Rect& region) const;
+
+    // Prepares a tile to be drawn to, giving it its own storage if needed.
+    // Returns false if the tile is empty and `allocate_if_empty` is false,
+    // or if there is no room left in the atlas.
+    bool prepare_tile_for_write(glm::ivec2 tile, bool allocate_if_empty);
+    // Binds a prepared tile for drawing, with the viewport covering the tile
+    // and drawing scissored to `clip`, given in canvas space.
+    void bind_tile_for_drawing(glm::ivec2 tile, const Rect& clip) const;
+    // Returns tiles within `region` that are a single color back to the
+    // empty or solid state, freeing their storage. The tiles are checked on
+    // the GPU, and compacted once the results arrive through `queue`,
+    // unless they have changed by then.
+    void compact_tiles(const Rect& region, ReadbackQueue& queue);
+
+    // Starts moving every allocated tile into compressed host memory. Tiles
+    // that still have their compressed pixels free their slot right away,
+    // and the rest once `compressor` has compressed them. A tile drawn to in
+    // the meantime stays resident. Returns the number of tiles evicted.
+    size_t evict(TileCompressor& compressor);
+    // Brings evicted tiles within `region` back into the atlas, but no more
+    // than `max_tiles` of them. Tiles whose pixels can't be decompressed,
+    // e.g. from a damaged document, are cleared instead. Returns the number
+    // of tiles restored or cleared.
+    size_t make_resident(const Rect& region, size_t max_tiles = SIZE_MAX);
+    // Returns how many tiles `make_resident()` had to clear since the last
+    // call, and starts counting afresh.
+    size_t take_unreadable_tile_count() { return std::exchange(m_unreadable_tile_count, 0); }
+    // Frees the slots of allocated tiles within `region` that still have
+    // their compressed pixels, so that they can be restored again without
+    // losing anything. Returns the number of tiles released.
+    size_t release_clean_tiles(const Rect& region);
+    // Moves allocated tiles out of slots from `first_slot` on into the
+    // lowest free slots of the atlas, so that it can release its last
+    // pages. Tiles being evicted stay put. Returns the number of tiles moved.
+    size_t move_tiles_below(TileAtlas::Slot first_slot);
+    size_t evicted_tile_count(const Rect& region) const;
+    size_t resident_bytes() const { return allocated_tile_count() * m_atlas->bytes_per_tile(); }
+    size_t evicted_bytes() const;
+    // Resident bytes of tiles whose eviction is under way.
+    size_t evicting_bytes() const;
 
-    void render();
+    // Returns a copy of a tile for the undo history. An allocated tile is
+    // copied into a new slot on the GPU, so this doesn't wait for drawing to
+    // finish. If the atlas is full, the copy is compressed right away.
+    Tile copy_tile(glm::ivec2 tile) const;
+    // Puts `replacement` in place of a tile, and returns the tile it replaced.
+    // The returned tile never refers to the layer's source file.
+    Tile swap_tile(glm::ivec2 tile, Tile replacement);
+
+    // Tiles put into the layer may refer to `file` until they are restored.
+    void set_source_file(std::shared_ptr<const MappedFile> file) { m_source_file = std::move(file); }
+    const std::shared_ptr<const MappedFile>& source_file() const { return m_source_file; }
+    // Copies every tile still in the source file into memory, and lets go
+    // of the file.
+    void detach_source_file();
+
+    // Returns which tiles have been drawn to or swapped since the last call,
+    // indexed row by row like the page table, and starts tracking afresh.
+    // Used to only save what changed.
+    std::vector<bool> take_modified_tiles();
+
+    // Returns the range of tile coordinates overlapping `rect`.
+    Rect tile_range(const Rect& rect) const;
+    Rect tile_rect(glm::ivec2 tile) const;
+    const Tile& tile(glm::ivec2 tile) const { return m_tiles[tile_index(tile)]; }
+    int tiles_x() const { return (int(m_width) + TileAtlas::TILE_SIZE - 1) / TileAtlas::TILE_SIZE; }
+    int tiles_y() const { return (int(m_height) + TileAtlas::TILE_SIZE - 1) / TileAtlas::TILE_SIZE; }
+    size_t allocated_tile_count() const;
+    // Whether drawing the layer would leave the canvas as it was, because it
+    // is hidden or nothing has been painted on it.
+    bool is_blank() const;
 
     Id id() const { return m_id; }
 
@@ -40,14 +178,44 @@ public:
     void set_name(const std::string& name) { m_name = name; }
 
     bool is_visible() const { return m_is_visible; }
-    void set_visible(bool visible) { m_is_visible = visible; }
+    // Visibility changes affect every pixel of the layer.
+    void set_visible(bool visible) {
+        if (visible != m_is_visible) mark_dirty(rect());
+        m_is_visible = visible;
+    }
 
     bool is_alpha_locked() const { return m_is_alpha_locked; }
     void set_alpha_lock(bool locked) { m_is_alpha_locked = locked; }
 
-    size_t width() const { return m_frame_buffer.width(); }
-    size_t height() const { return m_frame_buffer.height(); }
-    glm::vec2 size() const { return m_frame_buffer.size(); }
+    TileAtlas& atlas() const { return *m_atlas; }
+    PixelFormat format() const { return m_atlas->format(); }
+    bool is_mask() const { return format() == PixelFormat::R8; }
+    const glm::vec3& tint() const { return m_tint; }
+    void set_tint(const glm::vec3& tint) {
+        if (tint != m_tint && is_mask()) mark_dirty(rect());
+        m_tint = tint;
+    }
 
-    const Texture2D& gpu_texture() const { return m_frame_buffer.texture(); }
+    const Rect& dirty_rect() const { return m_dirty_rect; }
+    void mark_dirty(const Rect& rect) { m_dirty_rect = m_dirty_rect.united(rect); }
+    void clear_dirty_rect() { m_dirty_rect = Rect(); }
+
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    glm::vec2 size() const { return glm::vec2(m_width, m_height); }
+    Rect rect() const { return Rect(0, 0, int(m_width), int(m_height)); }
+
+private:
+    // Alpha of a texel value from this layer's atlas.
+    float texel_alpha(const glm::vec4& texel) const { return is_mask() ? texel.r : texel.a; }
+    size_t tile_index(glm::ivec2 tile) const { return size_t(tile.y) * tiles_x() + tile.x; }
+    // Frees the slot of an allocated tile that still has its compressed
+    // pixels, leaving it evicted. Returns whether it did.
+    bool release_clean_tile(Tile& tile) const;
+    // Must be called whenever a tile is about to change, so that it is
+    // known to differ from its compressed pixels and from pending work.
+    void touch_tile(size_t index);
+    // Copies a tile out of the source file into its compressed buffer.
+    static void detach_tile(Tile& tile);
+    void free_tiles();
 };
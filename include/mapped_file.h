@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <string>
+
+// A file mapped read-only into memory. Pages are only read from disk once
+// they are first touched, so opening even a very large file is cheap.
+class MappedFile {
+    std::string m_path;
+    const uint8_t* m_data;
+    size_t m_size;
+#if defined(_WIN32)
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_file;
+#endif
+
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const std::string& path() const { return m_path; }
+    size_t size() const { return m_size; }
+    // Throws if the range reaches past the end of the file.
+    std::span<const uint8_t> bytes(uint64_t offset, uint64_t size) const;
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Calls `fn(i)` for every `i` below `count`, spread over every core, and
+// returns once all calls have. If any call throws, the remaining indices are
+// skipped and the first exception is rethrown on the calling thread.
+template <typename Fn>
+void parallel_for(size_t count, Fn&& fn) {
+    size_t thread_count = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    if (thread_count <= 1) {
+        for (size_t i = 0; i < count; i++) fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next_index(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    auto work = [&]() {
+        while (true) {
+            size_t i = next_index++;
+            if (i >= count) return;
+
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (error == nullptr) error = std::current_exception();
+                next_index = count;
+                return;
+            }
+        }
+    };
+
+    // The calling thread does its share of the work too.
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    if (error != nullptr) std::rethrow_exception(error);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+
+#include <glad/glad.h>
+
+// How a layer stores its pixels.
+enum class PixelFormat {
+    // A single coverage channel, tinted with the layer's color when it is
+    // composited. Meant for line art and masks.
+    R8,
+    RGBA8,
+    // Half float color, for layers where low opacity build-up would band.
+    RGBA16F,
+};
+
+constexpr size_t PIXEL_FORMAT_COUNT = 3;
+constexpr PixelFormat PIXEL_FORMATS[PIXEL_FORMAT_COUNT] = {
+    PixelFormat::R8,
+    PixelFormat::RGBA8,
+    PixelFormat::RGBA16F,
+};
+
+inline GLenum gl_internal_format(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::R8: return GL_R8;
+        case PixelFormat::RGBA8: return GL_RGBA8;
+        case PixelFormat::RGBA16F: return GL_RGBA16F;
+    }
+    return GL_RGBA8;
+}
+
+// Format and type for moving pixels to and from the CPU without conversion.
+inline GLenum gl_transfer_format(PixelFormat format) {
+    return format == PixelFormat::R8 ? GL_RED : GL_RGBA;
+}
+
+inline GLenum gl_transfer_type(PixelFormat format) {
+    return format == PixelFormat::RGBA16F ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE;
+}
+
+inline size_t bytes_per_pixel(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::R8: return 1;
+        case PixelFormat::RGBA8: return 4;
+        case PixelFormat::RGBA16F: return 8;
+    }
+    return 4;
+}
+
+inline const char* pixel_format_name(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::R8: return "Mask (R8)";
+        case PixelFormat::RGBA8: return "Color (RGBA8)";
+        case PixelFormat::RGBA16F: return "High Precision (RGBA16F)";
+    }
+    return "Unknown";
+}
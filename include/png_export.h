@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PngExportStats {
+    size_t input_bytes;
+    size_t output_bytes;
+    double seconds;
+    size_t thread_count;
+
+    double megabytes_per_second_per_core() const {
+        if (seconds <= 0.0 || thread_count == 0) return 0.0;
+        return input_bytes / (1024.0 * 1024.0) / seconds / thread_count;
+    }
+};
+
+// `PngExport` writes an RGBA8 image to a PNG file in the background. The
+// image is split into bands of rows, which a pool of worker threads filter
+// and compress independently. A writer thread streams the bands to disk in
+// order, each in its own IDAT chunk, so only the bands in flight are ever
+// held compressed in memory.
+class PngExport {
+    struct Band {
+        std::vector<uint8_t> data;
+        uint32_t adler;
+        size_t filtered_size;
+        bool is_ready = false;
+    };
+
+    std::string m_filename;
+    size_t m_width, m_height;
+    size_t m_thread_count;
+
+    std::vector<uint8_t> m_pixels;
+    size_t m_rows_per_band;
+    std::vector<Band> m_bands;
+    std::atomic<size_t> m_next_band;
+    std::atomic<size_t> m_bands_written;
+    std::atomic<bool> m_is_cancelled;
+
+    std::mutex m_mutex;
+    std::condition_variable m_band_ready;
+    std::condition_variable m_band_written;
+
+    std::atomic<bool> m_is_finished;
+    std::optional<std::string> m_error;
+    PngExportStats m_stats;
+
+    std::thread m_writer;
+    std::vector<std::thread> m_workers;
+
+public:
+    // A thread count of 0 uses every core.
+    PngExport(std::string filename, size_t width, size_t height, size_t thread_count = 0);
+    // Waits for the file to be written.
+    ~PngExport();
+    PngExport(const PngExport&) = delete;
+    PngExport& operator=(const PngExport&) = delete;
+
+    // Starts encoding. `pixels` are in OpenGL's row order, bottom row first.
+    void start(std::vector<uint8_t>&& pixels);
+
+    const std::string& filename() const { return m_filename; }
+    bool is_started() const { return !m_bands.empty(); }
+    bool is_finished() const { return m_is_finished; }
+    // Only valid once finished.
+    const std::optional<std::string>& error() const { return m_error; }
+    const PngExportStats& stats() const { return m_stats; }
+    float progress() const;
+
+private:
+    void write_file();
+    void encode_bands();
+    void encode_band(size_t band_index);
+    // The pixels of a PNG row, which are stored top row first.
+    const uint8_t* row(size_t y) const;
+};
@@ -2,26 +2,29 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include "glad/glad.h"
 #include "glm/glm.hpp"
 
+class LinkedProgram;
+
+// A handle to a linked shader program. Programs made from the same shader
+// files share one GL program, through the `ProgramRegistry`, so they are
+// cheap to create and copy.
 class Program {
 public:
     Program();
     Program(const std::string& vertex_path, const std::string& fragment_path);
-    ~Program();
-    Program(const Program&) = delete;
-    Program& operator=(const Program&) = delete;
-    Program(Program&&) noexcept;
-    Program& operator=(Program&&) noexcept;
+    explicit Program(const std::string& compute_path);
 
     void use() const;
     GLuint id() const;
 
     GLint get_uniform_location(const char* name);
     void set_uniform_1i(const char* name, int i);
+    void set_uniform_2i(const char* name, const glm::ivec2& v);
     void set_uniform_1f(const char* name, float f);
     void set_uniform_2f(const char* name, float f1, float f2);
     void set_uniform_3f(const char* name, float f1, float f2, float f3);
@@ -32,8 +35,5 @@ public:
     void set_uniform_mat3(const char* name, const glm::mat3& mat);
 
 private:
-    GLuint m_program_id;
-
-    std::string load_shader_source(const std::string& path);
-    GLuint compile_shader(const std::string& source, GLenum shader_type);
+    std::shared_ptr<LinkedProgram> m_program;
 };
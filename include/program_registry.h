@@ -0,0 +1,87 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+// A GL program, shared by every `Program` made from the same shader files.
+// Its link is only waited on when it is first used, so that drivers with
+// `KHR_parallel_shader_compile` can build every program requested up front
+// at the same time.
+class LinkedProgram {
+    GLuint m_program_id;
+    std::string m_name;
+    // Until the link is checked.
+    std::vector<GLuint> m_shaders;
+    bool m_is_checked;
+    // Where to write the linked binary, if it was built from source.
+    std::optional<std::filesystem::path> m_cache_path;
+    uint64_t m_cache_key;
+    std::vector<std::pair<std::string, GLint>> m_uniform_locations;
+
+public:
+    LinkedProgram(
+        GLuint program_id,
+        std::string name,
+        std::vector<GLuint> shaders,
+        std::optional<std::filesystem::path> cache_path,
+        uint64_t cache_key
+    );
+    ~LinkedProgram();
+    LinkedProgram(const LinkedProgram&) = delete;
+    LinkedProgram& operator=(const LinkedProgram&) = delete;
+
+    // Waits for the link if needed. Throws if it failed.
+    GLuint id();
+    // Locations are looked up once per name, and then cached.
+    GLint uniform_location(const char* name);
+
+private:
+    void check_link();
+};
+
+// `ProgramRegistry` builds each program once for the whole process, and
+// hands out the same one to everyone asking for the same shader files, for
+// as long as anyone holds on to it. Linked binaries are cached on disk, keyed
+// by the shader sources and the driver, so later runs can skip compiling.
+//
+// Like everything else touching GL, it must only be used on the thread
+// that owns the context.
+class ProgramRegistry {
+    std::unordered_map<std::string, std::weak_ptr<LinkedProgram>> m_programs;
+    std::filesystem::path m_cache_directory;
+    // Identifies the driver, since binaries only load on the one that made
+    // them. Read once a context exists.
+    std::optional<std::string> m_driver;
+    size_t m_compiled_count;
+    size_t m_cache_hit_count;
+
+    ProgramRegistry();
+
+public:
+    static ProgramRegistry& instance();
+    ProgramRegistry(const ProgramRegistry&) = delete;
+    ProgramRegistry& operator=(const ProgramRegistry&) = delete;
+
+    // Shader stages are taken from the file extensions: .vert, .frag or
+    // .comp. Throws if a file can't be read. Compile and link errors are
+    // thrown when the program is first used.
+    std::shared_ptr<LinkedProgram> get(const std::vector<std::string>& shader_paths);
+
+    // Defaults to a directory under the system's temporary directory. An
+    // empty path turns the disk cache off.
+    void set_cache_directory(const std::filesystem::path& directory) { m_cache_directory = directory; }
+
+    size_t compiled_count() const { return m_compiled_count; }
+    size_t cache_hit_count() const { return m_cache_hit_count; }
+
+private:
+    const std::string& driver();
+    GLuint load_cached_binary(const std::filesystem::path& path, uint64_t key);
+};
@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "buffer.h"
+#include "rect.h"
+
+// `ReadbackQueue` copies pixels from the GPU without stalling it. A request
+// copies a region of the bound framebuffer into a pixel buffer object and
+// places a fence behind it. Once the fence has passed, usually a frame or
+// two later, `poll()` maps the buffer and hands the pixels to the request's
+// callback, on the thread that owns the GL context. Buffers written by
+// shaders can be read back the same way.
+class ReadbackQueue {
+public:
+    // Pixels are tightly packed, row by row from the bottom of the region.
+    typedef std::function<void(std::vector<uint8_t>&& pixels)> Callback;
+
+private:
+    struct Request {
+        Buffer buffer;
+        GLsync fence;
+        size_t size;
+        Callback callback;
+    };
+
+    std::vector<Request> m_pending;
+    // Buffers of completed requests, kept around to be reused.
+    std::vector<Buffer> m_free_buffers;
+
+public:
+    ReadbackQueue() = default;
+    ~ReadbackQueue();
+    ReadbackQueue(const ReadbackQueue&) = delete;
+    ReadbackQueue& operator=(const ReadbackQueue&) = delete;
+
+    // Reads `region` of the currently bound read framebuffer.
+    void request(const Rect& region, GLenum format, GLenum type, size_t bytes_per_pixel, Callback callback);
+    // Reads the first `size` bytes of `source`. Shader writes to it must be
+    // made visible to buffer copies first.
+    void request_buffer(const Buffer& source, size_t size, Callback callback);
+
+    // Runs the callbacks of every request that has completed, in the order
+    // they were requested. Should be called once per tick.
+    void poll();
+    // Blocks until every pending request has completed. Only for when the
+    // pixels are needed right away, e.g. before exiting.
+    void finish();
+
+    bool has_pending() const { return !m_pending.empty(); }
+
+private:
+    Buffer take_buffer(size_t size);
+    void enqueue(Buffer buffer, size_t size, Callback callback);
+    void complete(Request& request);
+};
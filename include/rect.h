@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+// An axis aligned rectangle of pixels, covering [min, max) on both axes.
+// Any rectangle with a non-positive width or height is considered empty.
+struct Rect {
+    glm::ivec2 min;
+    glm::ivec2 max;
+
+    Rect() {
+        min = glm::ivec2(0, 0);
+        max = glm::ivec2(0, 0);
+    }
+    Rect(glm::ivec2 _min, glm::ivec2 _max) {
+        min = _min;
+        max = _max;
+    }
+    Rect(int x, int y, int width, int height) {
+        min = glm::ivec2(x, y);
+        max = glm::ivec2(x + width, y + height);
+    }
+
+    // Returns the smallest rectangle containing every pixel whose centre
+    // could lie within the circle.
+    static Rect from_circle(glm::vec2 center, float radius) {
+        glm::ivec2 lo = glm::ivec2(glm::floor(center - radius));
+        glm::ivec2 hi = glm::ivec2(glm::ceil(center + radius));
+        return Rect(lo, hi);
+    }
+
+    bool is_empty() const { return max.x <= min.x || max.y <= min.y; }
+    int width() const { return std::max(0, max.x - min.x); }
+    int height() const { return std::max(0, max.y - min.y); }
+    size_t area() const { return size_t(width()) * size_t(height()); }
+
+    Rect united(const Rect& other) const {
+        if (is_empty()) return other;
+        if (other.is_empty()) return *this;
+        return Rect(glm::min(min, other.min), glm::max(max, other.max));
+    }
+
+    Rect intersected(const Rect& other) const {
+        Rect result(glm::max(min, other.min), glm::min(max, other.max));
+        return result.is_empty() ? Rect() : result;
+    }
+
+    bool intersects(const Rect& other) const {
+        return !intersected(other).is_empty();
+    }
+};
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "layer.h"
+#include "rect.h"
+#include "tile_compressor.h"
+
+struct ResidencyStats {
+    size_t budget_bytes;
+    size_t resident_bytes;
+    size_t evicted_bytes;
+    size_t evicted_tiles;
+    size_t restored_tiles;
+    double last_eviction_ms;
+    double last_restore_ms;
+};
+
+// `ResidencyManager` keeps the painted tiles of every layer within a VRAM
+// budget. When the atlases hold more than the budget, the least recently
+// used layers are read back, compressed into host memory in the background,
+// and their slots freed. The selected layer is never evicted. Other layers are already
+// baked into the canvas' layer caches, so they are only restored when a
+// region of the caches has to be rebuilt.
+class ResidencyManager {
+    size_t m_budget_bytes;
+
+    uint64_t m_clock;
+    std::unordered_map<Layer::Id, uint64_t> m_last_used;
+
+    size_t m_evicted_tiles;
+    size_t m_restored_tiles;
+    double m_last_eviction_ms;
+    double m_last_restore_ms;
+
+public:
+    explicit ResidencyManager(size_t budget_bytes);
+
+    size_t budget_bytes() const { return m_budget_bytes; }
+    void set_budget_bytes(size_t budget_bytes) { m_budget_bytes = budget_bytes; }
+
+    // Marks a layer as recently used, so it is the last to be evicted.
+    void touch(Layer::Id layer_id);
+
+    // Restores evicted tiles of `layer` within `region`, but no more than
+    // `max_tiles` of them. Returns the number of tiles restored.
+    size_t make_resident(Layer& layer, const Rect& region, size_t max_tiles = SIZE_MAX);
+    // Evicts the tiles of `layer` within `region` that were restored and
+    // not drawn to since, which only frees their slots.
+    size_t release_restored(Layer& layer, const Rect& region);
+
+    // Evicts layers, least recently used first, until `resident_bytes` fits
+    // within the budget. Tiles already being evicted count as freed.
+    void enforce_budget(
+        std::vector<Layer>& layers,
+        std::optional<Layer::Id> selected_layer,
+        size_t resident_bytes,
+        TileCompressor& compressor
+    );
+
+    ResidencyStats stats(const std::vector<Layer>& layers, size_t resident_bytes) const;
+};
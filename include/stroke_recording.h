@@ -0,0 +1,94 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "canvas.h"
+#include "canvas_view.h"
+#include "tools.h"
+#include "user_state.h"
+
+// Stroke recordings capture everything tools act on during each tick of the
+// app, so that a session can be replayed exactly, e.g. to benchmark a build.
+// All values are little-endian.
+//
+//   Header:  "BREC", u32 version, u32 canvas width, u32 canvas height,
+//            u32 frame count
+//   Frames:  u8 flags, u32 microseconds since the previous frame,
+//            f32 cursor x, f32 cursor y, f32 pressure, then whichever of
+//            these changed since the previous frame, in this order:
+//              f32 screen size[2]
+//              f32 translation[2], f32 scale[2], f32 rotation, u8 flipped
+//              u8 tool name size, tool name
+//              f32 brush size, f32 brush opacity
+//              f32 color[3]
+//              u32 selected layer index, or 0xFFFFFFFF for none
+//
+// A tick without any changes costs 17 bytes.
+
+// What the tools saw on one tick.
+struct RecordedFrame {
+    // Seconds since the recording started.
+    double time;
+    // Cursor positions are in screen space, so they only mean something
+    // together with the screen size and the view.
+    glm::vec2 screen_size;
+    ViewTransform view;
+    std::string tool_name;
+    float brush_size;
+    float brush_opacity;
+    glm::vec3 color;
+    // Counted from the bottom.
+    std::optional<uint32_t> layer_index;
+    CursorState cursor;
+    bool is_mouse_down;
+};
+
+struct StrokeRecording {
+    size_t canvas_width, canvas_height;
+    std::vector<RecordedFrame> frames;
+};
+
+// Throws if the file isn't a valid recording.
+StrokeRecording read_stroke_recording(const std::string& filename);
+
+// `StrokeRecorder` records frames in memory, encoded as they come, and
+// writes them out once stopped.
+class StrokeRecorder {
+    std::vector<uint8_t> m_data;
+    std::optional<RecordedFrame> m_last_frame;
+    size_t m_frame_count;
+    size_t m_canvas_width, m_canvas_height;
+    double m_start_time;
+    bool m_is_recording;
+
+public:
+    StrokeRecorder();
+
+    void start(const Canvas& canvas, double now);
+    // Should be called on every tick, right before the tools handle the mouse.
+    void record(
+        double now,
+        glm::vec2 screen_size,
+        const Canvas& canvas,
+        ToolManager& tool_manager,
+        const UserState& user_state,
+        bool is_mouse_down
+    );
+    // Stops recording, and writes the recording to `filename`. Throws if
+    // the file can't be written.
+    void stop(const std::string& filename);
+
+    bool is_recording() const { return m_is_recording; }
+    size_t frame_count() const { return m_frame_count; }
+    size_t byte_count() const { return m_data.size(); }
+};
+
+// Puts the canvas, the tools and the user state back the way they were in
+// `frame`, then lets the selected tool handle the mouse like the app does.
+// Layers that don't exist yet are added on top. The screen size is left to
+// the caller, since it only takes effect when the canvas is rendered.
+void replay_frame(const RecordedFrame& frame, Canvas& canvas, ToolManager& tool_manager, UserState& user_state);
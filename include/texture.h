@@ -1,23 +1,27 @@
 #pragma once
+#include <algorithm>
 #include <stdexcept>
 #include <utility>      
 
 #include <glad/glad.h>  
 #include <glm/glm.hpp>
 
-class Texture2D {
-    const GLuint mip_map_level = 0;
+#include "gl_state.h"
 
+class Texture2D {
 public:
-    Texture2D(size_t width, size_t height) {
+    // Mipmapped textures get a full chain of levels down to 1x1. Filling in
+    // the levels is left to the owner, so that it can update only the
+    // regions that changed.
+    Texture2D(size_t width, size_t height, bool is_mipmapped = false) : m_is_mipmapped(is_mipmapped) {
         glGenTextures(1, &m_id);
         if (m_id == 0) {
             throw std::runtime_error("Failed to generate OpenGL texture!");
         }
 
-        glBindTexture(GL_TEXTURE_2D, m_id);
+        GlState::bind_texture(GL_TEXTURE_2D, m_id);
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, is_mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
         assign_texture(width, height);
@@ -26,6 +30,7 @@ public:
     ~Texture2D() {
         if (m_id != 0) {
             glDeleteTextures(1, &m_id);
+            GlState::forget_texture(m_id);
         }
     }
 
@@ -35,49 +40,58 @@ public:
     Texture2D(Texture2D&& other) noexcept
         : m_width(std::exchange(other.m_width, 0)),
         m_height(std::exchange(other.m_height, 0)),
+        m_mip_levels(std::exchange(other.m_mip_levels, 0)),
+        m_is_mipmapped(other.m_is_mipmapped),
         m_id(std::exchange(other.m_id, 0)) {}
 
     Texture2D& operator=(Texture2D&& other) noexcept {
         if (this != &other) {
             if (m_id != 0) {
                 glDeleteTextures(1, &m_id);
+                GlState::forget_texture(m_id);
             }
             m_id = std::exchange(other.m_id, 0);
             m_width = std::exchange(other.m_width, 0);
             m_height = std::exchange(other.m_height, 0);
+            m_mip_levels = std::exchange(other.m_mip_levels, 0);
+            m_is_mipmapped = other.m_is_mipmapped;
         }
         return *this;
     }
 
     void bind() const {
-        glBindTexture(GL_TEXTURE_2D, m_id);
+        GlState::bind_texture(GL_TEXTURE_2D, m_id);
     }
 
     static void unbind() {
-        glBindTexture(GL_TEXTURE_2D, 0);
+        GlState::bind_texture(GL_TEXTURE_2D, 0);
     }
 
     static void set_active(size_t slot) {
-        glActiveTexture(GL_TEXTURE0 + slot);
+        GlState::active_texture(slot);
     }
 
     void bind_to_0() const {
-        set_active(0);
-        bind();
+        GlState::bind_texture_to(0, GL_TEXTURE_2D, m_id);
     }
 
     void assign_texture(size_t width, size_t height) {
         m_width = width;
         m_height = height;
-        glTexImage2D(
-            GL_TEXTURE_2D,
-            mip_map_level,
-            GL_RGBA8,
-            width, height,
-            0,
-            GL_RGBA, GL_UNSIGNED_BYTE,
-            nullptr
-        );
+        m_mip_levels = m_is_mipmapped ? count_mip_levels(width, height) : 1;
+        for (size_t level = 0; level < m_mip_levels; level++) {
+            glm::ivec2 size = level_size(level);
+            glTexImage2D(
+                GL_TEXTURE_2D,
+                level,
+                GL_RGBA8,
+                size.x, size.y,
+                0,
+                GL_RGBA, GL_UNSIGNED_BYTE,
+                nullptr
+            );
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, m_mip_levels - 1);
     }
 
     void resize(size_t width, size_t height) {
@@ -90,8 +104,30 @@ public:
     size_t width() const { return m_width; }
     size_t height() const { return m_height; }
     glm::vec2 size() const { return glm::vec2(m_width, m_height); }
+    size_t mip_levels() const { return m_mip_levels; }
+    bool is_mipmapped() const { return m_is_mipmapped; }
+    // The storage used by every level, assuming 4 bytes per texel.
+    size_t bytes() const {
+        size_t total = 0;
+        for (size_t level = 0; level < m_mip_levels; level++) {
+            glm::ivec2 size = level_size(level);
+            total += size_t(size.x) * size.y * 4;
+        }
+        return total;
+    }
+    glm::ivec2 level_size(size_t level) const {
+        return glm::max(glm::ivec2(int(m_width) >> level, int(m_height) >> level), glm::ivec2(1));
+    }
+
+    static size_t count_mip_levels(size_t width, size_t height) {
+        size_t levels = 1;
+        for (size_t size = std::max(width, height); size > 1; size /= 2) levels++;
+        return levels;
+    }
 
 private:
     size_t m_width, m_height;
+    size_t m_mip_levels;
+    bool m_is_mipmapped;
     GLuint m_id = 0;
 };
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "gl_state.h"
+
+// A 2D array texture. Unlike `Texture2D`, it has no mip levels. It is
+// mostly read with `texelFetch`, but filters linearly for reads that
+// average neighbouring texels.
+class Texture2DArray {
+public:
+    Texture2DArray(size_t width, size_t height, size_t layers, GLenum internal_format = GL_RGBA8) {
+        m_width = width;
+        m_height = height;
+        m_layers = layers;
+        m_internal_format = internal_format;
+        m_id = create_texture(width, height, layers, internal_format);
+    }
+
+    ~Texture2DArray() {
+        if (m_id != 0) {
+            glDeleteTextures(1, &m_id);
+            GlState::forget_texture(m_id);
+        }
+    }
+
+    Texture2DArray(const Texture2DArray&) = delete;
+    Texture2DArray& operator=(const Texture2DArray&) = delete;
+
+    Texture2DArray(Texture2DArray&& other) noexcept
+        : m_width(std::exchange(other.m_width, 0)),
+        m_height(std::exchange(other.m_height, 0)),
+        m_layers(std::exchange(other.m_layers, 0)),
+        m_internal_format(other.m_internal_format),
+        m_id(std::exchange(other.m_id, 0)) {}
+
+    Texture2DArray& operator=(Texture2DArray&& other) noexcept {
+        if (this != &other) {
+            if (m_id != 0) {
+                glDeleteTextures(1, &m_id);
+                GlState::forget_texture(m_id);
+            }
+            m_id = std::exchange(other.m_id, 0);
+            m_width = std::exchange(other.m_width, 0);
+            m_height = std::exchange(other.m_height, 0);
+            m_layers = std::exchange(other.m_layers, 0);
+            m_internal_format = other.m_internal_format;
+        }
+        return *this;
+    }
+
+    void bind() const {
+        GlState::bind_texture(GL_TEXTURE_2D_ARRAY, m_id);
+    }
+
+    static void unbind() {
+        GlState::bind_texture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+
+    void bind_to(size_t slot) const {
+        GlState::bind_texture_to(slot, GL_TEXTURE_2D_ARRAY, m_id);
+    }
+
+    // Reallocates the texture with a different number of layers, copying
+    // across the contents of the layers both have on the GPU. This changes
+    // the texture id, so anything that has the texture attached must
+    // reattach it.
+    void resize(size_t layers) {
+        if (layers == m_layers) return;
+
+        GLuint new_id = create_texture(m_width, m_height, layers, m_internal_format);
+        glCopyImageSubData(
+            m_id, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+            new_id, GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0,
+            m_width, m_height, std::min(layers, m_layers)
+        );
+        glDeleteTextures(1, &m_id);
+        GlState::forget_texture(m_id);
+
+        m_id = new_id;
+        m_layers = layers;
+    }
+
+    GLuint id() const { return m_id; }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
+    size_t layers() const { return m_layers; }
+    GLenum internal_format() const { return m_internal_format; }
+
+private:
+    size_t m_width, m_height, m_layers;
+    GLenum m_internal_format;
+    GLuint m_id = 0;
+
+    static GLuint create_texture(size_t width, size_t height, size_t layers, GLenum internal_format) {
+        GLuint id = 0;
+        glGenTextures(1, &id);
+        if (id == 0) {
+            throw std::runtime_error("Failed to generate OpenGL texture array!");
+        }
+
+        GlState::bind_texture(GL_TEXTURE_2D_ARRAY, id);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+        // No data is uploaded, but the format and type still have to be
+        // compatible with the internal format.
+        bool is_single_channel = internal_format == GL_R8;
+        bool is_float = internal_format == GL_RGBA16F;
+        glTexImage3D(
+            GL_TEXTURE_2D_ARRAY,
+            0,
+            internal_format,
+            width, height, layers,
+            0,
+            is_single_channel ? GL_RED : GL_RGBA,
+            is_float ? GL_HALF_FLOAT : GL_UNSIGNED_BYTE,
+            nullptr
+        );
+        return id;
+    }
+};
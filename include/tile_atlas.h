@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "buffer.h"
+#include "pixel_format.h"
+#include "program.h"
+#include "readback.h"
+#include "rect.h"
+#include "texture_array.h"
+
+// `TileAtlas` owns the GPU storage for the painted tiles of every layer.
+// Tiles live in the slices ("pages") of a single array texture, so any tile
+// can be read through one sampler. The atlas only grows when every slot is
+// in use, which means VRAM scales with painted area rather than with canvas
+// area times layer count. Slots are handed out lowest first, so tiles pack
+// into the first pages, and pages left empty at the end can be released.
+// Each atlas stores tiles of a single pixel format.
+class TileAtlas {
+public:
+    typedef uint32_t Slot;
+    typedef std::function<void(std::vector<std::optional<glm::vec4>>&& colors)> UniformSlotsCallback;
+
+    static constexpr int TILE_SIZE = 256;
+    static constexpr int TILES_PER_PAGE_SIDE = 8;
+    static constexpr int TILES_PER_PAGE = TILES_PER_PAGE_SIDE * TILES_PER_PAGE_SIDE;
+    static constexpr int PAGE_SIZE = TILE_SIZE * TILES_PER_PAGE_SIDE;
+    static constexpr size_t PIXELS_PER_TILE = size_t(TILE_SIZE) * TILE_SIZE;
+
+    // Per-instance data for `tile.vert`. Must match the std430 layout there.
+    // For mask tiles, `color` holds the tint, and the texel's red channel
+    // is used as alpha.
+    struct TileInstance {
+        glm::ivec2 canvas_origin;
+        glm::ivec2 atlas_origin;
+        int page;
+        int is_solid;
+        int is_mask;
+        int padding;
+        glm::vec4 color;
+    };
+
+private:
+    PixelFormat m_format;
+    Texture2DArray m_pages;
+    // A min-heap, so that the lowest free slot is allocated first.
+    std::vector<Slot> m_free_slots;
+    size_t m_max_pages;
+    // Set whenever a slot is freed, until pages are next released.
+    bool m_has_freed_slots = false;
+
+    GLuint m_fbo = 0;
+    GLuint m_attached_texture = 0;
+    int m_attached_page = -1;
+
+    Buffer m_instance_buffer;
+    Buffer m_query_buffer;
+    Program m_tile_program;
+    Program m_uniform_program;
+
+public:
+    explicit TileAtlas(PixelFormat format = PixelFormat::RGBA8);
+    ~TileAtlas();
+    TileAtlas(const TileAtlas&) = delete;
+    TileAtlas& operator=(const TileAtlas&) = delete;
+
+    // Returns std::nullopt if the atlas is full and cannot grow any further.
+    std::optional<Slot> allocate();
+    void free(Slot slot);
+
+    // Whether fewer than half the slots are in use, and some were freed
+    // since pages were last released, so releasing may now succeed.
+    bool should_release_pages() const;
+    // The number of pages that would hold every slot in use with some room
+    // to spare, so that the next few tiles don't grow the atlas right away.
+    size_t target_page_count() const;
+    // Releases empty pages from the end, but keeps at least `min_pages`.
+    // Tiles in later pages must be moved to lower slots first, or their
+    // pages are kept. Returns the number of pages released.
+    size_t release_pages(size_t min_pages);
+
+    // Binds the atlas framebuffer with the viewport covering `slot`. If a
+    // clip rect is given (in tile-local pixels), drawing is also scissored to it.
+    void bind_slot(Slot slot, std::optional<Rect> clip = std::nullopt);
+    void clear_slot(Slot slot, glm::vec4 color);
+
+    // Copy a slot's pixels to and from the CPU, in the atlas' own format.
+    // Reading waits for the GPU to finish drawing to the slot.
+    void read_slot(Slot slot, std::vector<uint8_t>& pixels);
+    void write_slot(Slot slot, const std::vector<uint8_t>& pixels);
+    // Like `read_slot()`, but hands the pixels to `callback` once they
+    // arrive, without waiting for the GPU.
+    void read_slot_async(Slot slot, ReadbackQueue& queue, ReadbackQueue::Callback callback);
+    // Copies a slot's pixels on the GPU, without waiting for anything.
+    void copy_slot(Slot source, Slot destination);
+
+    // Draws tiles 1:1 into the currently bound framebuffer, which has size
+    // `target_size` in pixels.
+    void draw_tiles(const std::vector<TileInstance>& tiles, glm::vec2 target_size);
+
+    // For each slot, finds its texel value if every pixel of it is
+    // identical. Mask atlases give their value in the red channel. The
+    // results reach `callback` through `queue` once the GPU is done, so
+    // the slots may have changed by then.
+    void find_uniform_slots(const std::vector<Slot>& slots, ReadbackQueue& queue, UniformSlotsCallback callback);
+
+    int slot_page(Slot slot) const { return int(slot / TILES_PER_PAGE); }
+    glm::ivec2 slot_origin(Slot slot) const;
+
+    size_t page_count() const { return m_pages.layers(); }
+    size_t capacity() const { return m_pages.layers() * TILES_PER_PAGE; }
+    size_t used_slots() const { return capacity() - m_free_slots.size(); }
+    size_t bytes_per_tile() const { return PIXELS_PER_TILE * bytes_per_pixel(m_format); }
+    size_t used_bytes() const { return used_slots() * bytes_per_tile(); }
+    size_t reserved_bytes() const { return capacity() * bytes_per_tile(); }
+    PixelFormat format() const { return m_format; }
+    const Texture2DArray& texture() const { return m_pages; }
+
+private:
+    bool grow();
+    void attach_page(int page);
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include <span>
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include "buffer.h"
+#include "layer.h"
+#include "program.h"
+#include "rect.h"
+
+// `TileCompositor` composites a stack of layers in a single pass. Every
+// layer's tiles already live in the array textures of the atlases, so the
+// fragment shader can fetch each layer's texel for a pixel and blend them
+// in registers, writing the target once instead of once per layer.
+class TileCompositor {
+public:
+    // Per-tile data for `tile_composite.vert`. Must match the std430 layout
+    // there. Each stack lists its entries bottom up.
+    struct TileStack {
+        glm::ivec2 canvas_origin;
+        int first_entry;
+        int entry_count;
+    };
+
+    // One layer's tile within a stack. `format` is the tile's `PixelFormat`,
+    // or `SOLID` if it has no storage, in which case `color` is its
+    // premultiplied color. For mask tiles, `color` holds the tint.
+    struct StackEntry {
+        glm::ivec2 atlas_origin;
+        int page;
+        int format;
+        glm::vec4 color;
+    };
+
+    static constexpr int SOLID = -1;
+
+private:
+    std::vector<TileStack> m_stacks;
+    std::vector<StackEntry> m_entries;
+    Buffer m_stack_buffer;
+    Buffer m_entry_buffer;
+    Program m_program;
+
+public:
+    TileCompositor();
+    TileCompositor(const TileCompositor&) = delete;
+    TileCompositor& operator=(const TileCompositor&) = delete;
+
+    // Blends `layers`, bottom first, over `region` of the currently bound
+    // framebuffer, which has size `target_size` in pixels. The result is
+    // premultiplied, and must be blended with (ONE, ONE_MINUS_SRC_ALPHA).
+    // Evicted tiles are skipped, so they must be made resident first.
+    //
+    // At a `level` above 0, the target has one pixel per 2^level square
+    // block of canvas pixels, and `target_size` is still given in canvas
+    // pixels. Each layer's block is box filtered before it is blended, which
+    // is close to, but not quite, filtering the blended result.
+    void draw(std::span<const Layer> layers, const Rect& region, glm::vec2 target_size, int level = 0);
+};
@@ -0,0 +1,69 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "readback.h"
+#include "tile_atlas.h"
+
+// `TileCompressor` moves atlas tiles into compressed host memory without
+// stalling the GL thread. A tile's pixels are read back through the
+// `ReadbackQueue`, compressed on a worker thread, and the result is handed
+// to the request's callback from `poll()`, on the thread that owns the GL
+// context. Only then may the callback free the tile's slot.
+class TileCompressor {
+public:
+    typedef std::function<void(std::vector<uint8_t>&& compressed)> Callback;
+
+private:
+    struct Job {
+        std::vector<uint8_t> data;
+        Callback callback;
+    };
+
+    ReadbackQueue& m_readback_queue;
+
+    // Uncompressed jobs wait in `m_jobs`, and compressed ones in
+    // `m_finished` until they are polled.
+    mutable std::mutex m_mutex;
+    std::condition_variable m_job_ready;
+    std::condition_variable m_job_finished;
+    std::deque<Job> m_jobs;
+    std::vector<Job> m_finished;
+    size_t m_jobs_in_progress;
+    // Readbacks requested but not yet handed to a worker.
+    size_t m_pending_readbacks;
+    bool m_is_stopping;
+
+    std::vector<std::thread> m_workers;
+
+public:
+    // A thread count of 0 uses half the cores, leaving the rest to painting
+    // and to saves.
+    explicit TileCompressor(ReadbackQueue& readback_queue, size_t thread_count = 0);
+    // Drops every request that hasn't completed yet.
+    ~TileCompressor();
+    TileCompressor(const TileCompressor&) = delete;
+    TileCompressor& operator=(const TileCompressor&) = delete;
+
+    // Reads back and compresses the pixels of `slot`. The slot must not be
+    // freed or drawn to until the callback has run, or the caller must be
+    // able to tell that the result is stale.
+    void compress_slot(TileAtlas& atlas, TileAtlas::Slot slot, Callback callback);
+
+    // Runs the callbacks of every tile compressed so far. Should be called
+    // once per tick, after polling the readback queue.
+    void poll();
+    // Blocks until every request has been compressed, and runs their
+    // callbacks. The readback queue must have been finished first.
+    void finish();
+
+    bool has_pending() const;
+
+private:
+    void work();
+};
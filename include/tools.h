@@ -57,6 +57,11 @@ public:
     void temp_select_tool_by_name(std::string name);
     void deselect_temp_tool();
 
+    // Presses, drags or releases the selected tool, depending on whether the
+    // mouse was down on the previous tick (`user_state.prev_cursor`) and is
+    // down now. Should be called once per tick, after updating the cursor.
+    void handle_mouse(Canvas& canvas, UserState& user_state, bool is_mouse_down);
+
     const std::vector<std::unique_ptr<Tool>>& tools() const;
 
 private:
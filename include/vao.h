@@ -2,6 +2,8 @@
 
 #include <glad/glad.h>
 
+#include "gl_state.h"
+
 // TODO: In future, expand this into a proper RAII class that
 // handles different types of VAOs. For now, we just use it as
 // a way to get a singleton dummy.
@@ -19,6 +21,6 @@ public:
 	}
 
     static void unbind() {
-        glBindVertexArray(0);
+        GlState::bind_vertex_array(0);
     }
 };
@@ -20,6 +20,10 @@ private:
     glm::vec2 m_mouse_pos;
     bool m_mouse_down;
 
+    // Set whenever the window receives user input, so that the main loop
+    // can tell real input apart from other wake-ups.
+    bool m_has_new_input;
+
 public:
     Window(const char *title, size_t width, size_t height);
     ~Window(); 
@@ -35,6 +39,10 @@ public:
     void set_mouse_pos(const glm::vec2& pos) { m_mouse_pos = pos; }
     void set_mouse_down(bool down) { m_mouse_down = down; }
 
+    void notify_input() { m_has_new_input = true; }
+    // Returns whether there was any input since the last call.
+    bool take_new_input() { bool result = m_has_new_input; m_has_new_input = false; return result; }
+
     glm::vec2 get_mouse_pos() const { return m_pen_down ? m_pen_pos : m_mouse_pos; }
     float get_pressure() const { return m_pen_down ? m_pen_pressure : 1.0; }
     bool is_mouse_down() const { return m_mouse_down || m_pen_down; }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <corecrt.h>
 #include <cstdlib>
@@ -5,6 +6,7 @@
 #include <format>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
@@ -15,14 +17,24 @@
 #include <glm/fwd.hpp>
 
 #include "app.h"
+#include "autosave.h"
 #include "brush.h"
 #include "canvas.h"
+#include "document.h"
+#include "chrome_trace.h"
 #include "frame_buffer.h"
+#include "frame_tracer.h"
+#include "gl_state.h"
+#include "gpu_profiler.h"
 #include "gui.h"
 #include "layer.h"
+#include "png_export.h"
+#include "stroke_recording.h"
 #include "tools.h"
 #include "user_state.h"
 
+static const double AUTOSAVE_INTERVAL_SECONDS = 30.0;
+
 App::App(
     unsigned int screen_width,
     unsigned int screen_height,
@@ -39,10 +51,17 @@ App::App(
     m_gui(m_window.window(), glm::vec2( canvas_display_width, canvas_display_height )),
     m_canvas(canvas_width, canvas_height),
     m_tool_manager(),
-    m_user_state()
+    m_user_state(),
+    m_frame_scheduler(m_target_internal_fps, m_target_display_fps),
+    m_autosave(get_autosave_filename(), AUTOSAVE_INTERVAL_SECONDS)
 {
     m_last_dt = 0.0;
-    m_last_update_time = 0.0;
+    m_last_tick_time = 0.0;
+
+    m_last_cursor_overlay = std::nullopt;
+    m_skipped_frames = 0;
+    m_partial_frames = 0;
+    m_full_frames = 0;
 
     Layer::Id new_layer_id = m_canvas.insert_new_layer_above_selected(m_user_state.selected_layer);
     m_user_state.selected_layer = new_layer_id;
@@ -50,48 +69,106 @@ App::App(
 
 void App::run() {
     while (!m_window.should_close()) {
-        double loop_start_time = glfwGetTime();
+        // Instead of hotlooping, we sleep until there is new input, or until
+        // a deadline from the input or display clock comes up. An idle app
+        // uses no CPU at all.
+        double tick_time = m_frame_scheduler.wait_for_next_tick();
+        m_last_dt = tick_time - m_last_tick_time;
+        m_last_tick_time = tick_time;
+        m_canvas.gpu_profiler().begin_frame();
+        m_last_gl_counts = GlState::take_counts();
+        TRACE_ZONE(m_frame_tracer, "tick");
+
+        if (m_window.take_new_input()) {
+            m_frame_scheduler.notify_input(tick_time);
+        }
+
+        // Readback callbacks can change what the GUI shows, e.g. the color
+        // picked by the color picker.
+        if (m_canvas.has_pending_readbacks()) {
+            m_canvas.poll_readbacks();
+            m_frame_scheduler.invalidate();
+        }
+        // Keeps the export progress bar moving.
+        if (!m_exports.empty()) {
+            update_exports();
+            m_frame_scheduler.invalidate();
+        }
+        if (!m_document_saves.empty()) {
+            update_document_saves();
+            m_frame_scheduler.invalidate();
+        }
+        if (m_canvas.is_streaming_document()) {
+            m_canvas.stream_document_tiles();
+        }
+        // Restoring tiles never fails, but damaged ones are cleared.
+        if (size_t count = m_canvas.take_unreadable_tile_count(); count > 0) {
+            m_gui.show_alert(std::format("{} damaged tiles couldn't be read, and were cleared", count));
+        }
+        m_autosave.update(m_canvas, tick_time);
+        m_frame_scheduler.wake_at(m_autosave.next_save_time());
 
         handle_inputs();
+        handle_document_request();
+        if (m_gui.take_recording_toggle()) toggle_stroke_recording();
+        if (m_gui.take_trace_toggle()) toggle_trace();
+        if (m_gui.take_histogram_reset()) m_frame_tracer.reset_histograms();
+        // Strokes must keep sampling the cursor even if it stops moving, and
+        // pending readbacks, exports, saves and streaming need polling until
+        // they complete.
+        m_frame_scheduler.hold_active(
+            m_window.is_mouse_down()
+            || m_canvas.has_pending_readbacks()
+            || !m_exports.empty()
+            || !m_document_saves.empty()
+            || m_canvas.is_streaming_document()
+            || m_autosave.is_saving()
+        );
 
         DebugState debug_state = generate_debug_state();
-        m_gui.define_interface(
-            m_user_state,
-            m_canvas,
-            m_tool_manager,
-            debug_state
-        );
+        {
+            TRACE_ZONE(m_frame_tracer, "GUI::define_interface");
+            m_gui.define_interface(
+                m_user_state,
+                m_canvas,
+                m_tool_manager,
+                debug_state
+            );
+        }
 
         // We call ImGui::Render() at the internal framerate since calling it
         // allows us to refreshes our input polling, which allows us to 
         // process input at the internal framerate. Things like "key pressed"
         // breaks otherwise.
-        ImGui::Render();
+        {
+            TRACE_ZONE(m_frame_tracer, "ImGui::Render");
+            ImGui::Render();
+        }
 
         // We process the GPU rendering at the display framerate, which is 
         // slower than the internal framerate. Trying to render at the
         // internal framerate overloads the GPU, and causes us to render
         // slower than if we had just picked a slower framerate to begin with.
-        // We multiply by 0.9 since if we wait until after we hit the target_dt,
-        // we miss the next "frame cycle", so we are actually rendering at half
-        // the target display framerate.
-        if (glfwGetTime() - m_last_update_time > m_target_display_dt * 0.9) {
+        // Frames are only rendered when something has been invalidated.
+        double now = glfwGetTime();
+        if (m_frame_scheduler.is_display_frame_due(now)) {
             handle_cursor();
             render();
-            m_last_update_time = glfwGetTime();
+            m_frame_scheduler.on_display_frame(now);
         }
-
-        // Calling `std::this_thread::sleep_for()` has a minimum sleep time
-        // of 16ms. To achieve a higher internal framerate, we hotloop 
-        // instead.
-        while (glfwGetTime() - loop_start_time < m_target_internal_dt) {}
-        m_last_dt = glfwGetTime() - loop_start_time;
     }
+
+    // Let any save in flight finish writing its file. Exports wait for
+    // their threads when destroyed.
+    m_canvas.finish_readbacks();
+    m_exports.clear();
+    m_document_saves.clear();
 }
 
+// Events have already been pumped by the frame scheduler by the time we get
+// here, so this only reads the resulting state.
 void App::handle_inputs() {
-    glfwPollEvents();
-
+    TRACE_ZONE(m_frame_tracer, "App::handle_inputs");
     // TODO: Make a wrapper that generates our own ImGuiIO, but
     // overwrites it with our own mouse events from m_window.
     const ImGuiIO& io = ImGui::GetIO();
@@ -101,6 +178,14 @@ void App::handle_inputs() {
     if (io.KeyCtrl && ImGui::IsKeyPressed(ImGuiKey_S, false)) {
         save_image_to_downloads();
     }
+    // Strokes are only recorded once they finish, so we don't undo mid-stroke.
+    if (io.KeyCtrl && !m_window.is_mouse_down()) {
+        if (ImGui::IsKeyPressed(ImGuiKey_Z) && !io.KeyShift) {
+            m_user_state.selected_layer = m_canvas.undo(m_user_state.selected_layer);
+        } else if (ImGui::IsKeyPressed(ImGuiKey_Y) || (ImGui::IsKeyPressed(ImGuiKey_Z) && io.KeyShift)) {
+            m_user_state.selected_layer = m_canvas.redo(m_user_state.selected_layer);
+        }
+    }
     if (ImGui::IsKeyPressed(ImGuiKey_Escape)) {
         m_window.set_should_close(true);
     }
@@ -139,21 +224,17 @@ void App::handle_inputs() {
             if (ImGui::IsKeyPressed(ImGuiKey_2)) brush->decrease_opacity();
             if (ImGui::IsKeyPressed(ImGuiKey_4)) brush->increase_opacity();
         }
-        
-        bool prev_mouse_down = m_user_state.prev_cursor.has_value();
-        bool mouse_pressed = !prev_mouse_down && m_window.is_mouse_down();
-        bool mouse_released = prev_mouse_down && !m_window.is_mouse_down();
-
-        if (mouse_pressed) tool.on_mouse_press(m_canvas, m_user_state);
-        else if (mouse_released) tool.on_mouse_release(m_canvas, m_user_state);
-        else if (m_window.is_mouse_down()) tool.on_mouse_down(m_canvas, m_user_state);
-    }
-    
-    if (m_window.is_mouse_down()) {
-        m_user_state.prev_cursor = m_user_state.cursor;
-    } else {
-        m_user_state.prev_cursor = std::nullopt;
     }
+
+    m_stroke_recorder.record(
+        m_last_tick_time,
+        m_gui.canvas_window_size(),
+        m_canvas,
+        m_tool_manager,
+        m_user_state,
+        m_window.is_mouse_down()
+    );
+    m_tool_manager.handle_mouse(m_canvas, m_user_state, m_window.is_mouse_down());
 }
 
 std::optional<Tool::Id> App::resolve_temp_tool(const ImGuiIO& io) {
@@ -202,29 +283,68 @@ void App::handle_cursor() {
 }
 
 void App::render() {
-    m_canvas.render(
+    TRACE_ZONE(m_frame_tracer, "App::render");
+    FrameKind frame_kind = m_canvas.render(
         m_gui.canvas_window_size(),
-        m_user_state.cursor.pos
+        m_user_state.cursor.pos,
+        m_user_state.selected_layer
     );
-    render_cursor();
+
+    // The cursor is drawn over a copy of the view, so it only needs redrawing
+    // if the view under it changed or the cursor itself did.
+    CursorOverlay cursor_overlay = get_cursor_overlay();
+    if (frame_kind != FrameKind::Skipped || m_last_cursor_overlay != cursor_overlay) {
+        m_canvas.begin_overlay();
+        render_cursor();
+        m_last_cursor_overlay = cursor_overlay;
+        if (frame_kind == FrameKind::Skipped) frame_kind = FrameKind::Partial;
+    }
     FrameBuffer::unbind();
+    count_frame(frame_kind);
 
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    {
+        GpuPassScope pass(m_canvas.gpu_profiler(), "imgui");
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    }
+    // ImGui binds its own programs and textures, without going through us.
+    GlState::invalidate();
 
+    TRACE_ZONE(m_frame_tracer, "glfwSwapBuffers");
     glfwSwapBuffers(m_window.window());
 }
 
 void App::render_cursor() {
     auto tool_opt = m_tool_manager.get_selected_tool();
     if (tool_opt.has_value()) {
-        m_canvas.bind_screen_fbo();
-
         Tool& tool = tool_opt.value().get();
+        GpuPassScope pass(m_canvas.gpu_profiler(), "cursor");
         tool.render_cursor(m_canvas, m_user_state.cursor.pos);
     }
 }
 
-std::string App::get_new_image_filename() {
+CursorOverlay App::get_cursor_overlay() {
+    CursorOverlay overlay{ std::nullopt, m_user_state.cursor.pos, 0.0f };
+
+    auto tool_opt = m_tool_manager.get_selected_tool();
+    if (tool_opt.has_value()) {
+        Tool& tool = tool_opt.value().get();
+        overlay.tool_id = tool.id();
+        if (Brush* brush = dynamic_cast<Brush*>(&tool)) {
+            overlay.size = brush->size();
+        }
+    }
+    return overlay;
+}
+
+void App::count_frame(FrameKind frame_kind) {
+    switch (frame_kind) {
+        case FrameKind::Skipped: m_skipped_frames++; break;
+        case FrameKind::Partial: m_partial_frames++; break;
+        case FrameKind::Full: m_full_frames++; break;
+    }
+}
+
+std::string App::get_new_filename(const char* extension) {
     auto now = std::chrono::system_clock::now();
     std::time_t t = std::chrono::system_clock::to_time_t(now);
 
@@ -241,25 +361,154 @@ std::string App::get_new_image_filename() {
 
     const char* user_profile = std::getenv("USERPROFILE");
 
-    std::string filename = std::format("{}/Downloads/brush_{}.png", user_profile, time_str);
+    std::string filename = std::format("{}/Downloads/brush_{}.{}", user_profile, time_str, extension);
     return filename;
 }
 
+std::string App::get_autosave_filename() {
+    const char* user_profile = std::getenv("USERPROFILE");
+    return std::format("{}/Downloads/brush_autosave.brush", user_profile);
+}
+
 void App::save_image_to_downloads() {
-    std::string filename = get_new_image_filename();
-    m_canvas.save_as_png(filename.c_str());
-    std::cout << "Saved image: " << filename << std::endl;
+    std::string filename = get_new_filename("png");
+    m_exports.push_back(m_canvas.save_as_png(filename));
+}
+
+void App::update_exports() {
+    auto finished = std::stable_partition(m_exports.begin(), m_exports.end(),
+        [](const std::shared_ptr<PngExport>& png_export) { return !png_export->is_finished(); });
+
+    for (auto it = finished; it != m_exports.end(); it++) {
+        const PngExport& png_export = **it;
+        if (png_export.error().has_value()) {
+            std::cerr << "Failed to save image: " << png_export.error().value() << std::endl;
+            continue;
+        }
+
+        const PngExportStats& stats = png_export.stats();
+        std::cout << std::format("Saved image: {} ({:.2f}s, {:.1f} MB/s per core on {} threads)",
+            png_export.filename(), stats.seconds, stats.megabytes_per_second_per_core(), stats.thread_count) << std::endl;
+        m_last_export_stats = stats;
+    }
+    m_exports.erase(finished, m_exports.end());
+}
+
+// Requests come from the file window, so they are handled on the tick after
+// the one they were made on.
+void App::handle_document_request() {
+    std::optional<DocumentRequest> request = m_gui.take_document_request();
+    if (!request.has_value()) return;
+
+    if (request.value().kind == DocumentRequest::Kind::Save) {
+        m_document_saves.push_back(m_canvas.save_document(request.value().filename));
+        return;
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        m_user_state.selected_layer = m_canvas.open_document(request.value().filename);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::format("Opened document: {} ({:.1f} ms)", request.value().filename, elapsed.count()) << std::endl;
+    } catch (const std::runtime_error& e) {
+        m_gui.show_alert(e.what());
+    }
+    m_frame_scheduler.invalidate();
+}
+
+void App::update_document_saves() {
+    auto finished = std::stable_partition(m_document_saves.begin(), m_document_saves.end(),
+        [](const std::shared_ptr<DocumentWriter>& writer) { return !writer->is_finished(); });
+
+    for (auto it = finished; it != m_document_saves.end(); it++) {
+        const DocumentWriter& writer = **it;
+        if (writer.error().has_value()) {
+            m_gui.show_alert(std::format("Failed to save {}: {}", writer.filename(), writer.error().value()));
+            continue;
+        }
+
+        const DocumentSaveStats& stats = writer.stats();
+        std::cout << std::format("Saved document: {} ({} tiles, {:.1f} MB, {:.2f}s)",
+            writer.filename(), stats.tile_count, stats.output_bytes / (1024.0 * 1024.0), stats.seconds) << std::endl;
+    }
+    m_document_saves.erase(finished, m_document_saves.end());
+}
+
+void App::toggle_stroke_recording() {
+    if (!m_stroke_recorder.is_recording()) {
+        m_stroke_recorder.start(m_canvas, m_last_tick_time);
+        return;
+    }
+
+    std::string filename = get_new_filename("brec");
+    size_t frame_count = m_stroke_recorder.frame_count();
+    size_t byte_count = m_stroke_recorder.byte_count();
+    try {
+        m_stroke_recorder.stop(filename);
+        std::cout << std::format("Saved stroke recording: {} ({} frames, {:.1f} KB)", filename, frame_count, byte_count / 1024.0) << std::endl;
+    } catch (const std::runtime_error& e) {
+        m_gui.show_alert(e.what());
+    }
+}
+
+// Traces the main loop's zones and the render passes together.
+void App::toggle_trace() {
+    GpuProfiler& profiler = m_canvas.gpu_profiler();
+    if (!profiler.is_tracing()) {
+        profiler.start_trace();
+        m_frame_tracer.start_trace();
+        return;
+    }
+
+    ChromeTrace trace;
+    m_frame_tracer.stop_trace(trace);
+    profiler.stop_trace(trace);
+    std::string filename = get_new_filename("json");
+    try {
+        trace.write(filename);
+        std::cout << std::format("Saved trace: {}", filename) << std::endl;
+    } catch (const std::runtime_error& e) {
+        m_gui.show_alert(e.what());
+    }
 }
 
 DebugState App::generate_debug_state() {
     glm::vec2 mouse_pos = get_mouse_pos_in_canvas_window();
     glm::vec2 canvas_pos = m_canvas.screen_space_to_canvas_space(mouse_pos);
     bool is_flipped = m_canvas.is_flipped();
+    std::optional<float> export_progress = std::nullopt;
+    if (!m_exports.empty()) export_progress = m_exports.front()->progress();
+    std::optional<float> document_save_progress = std::nullopt;
+    if (!m_document_saves.empty()) document_save_progress = m_document_saves.front()->progress();
+    std::optional<size_t> recorded_frames = std::nullopt;
+    if (m_stroke_recorder.is_recording()) recorded_frames = m_stroke_recorder.frame_count();
     return DebugState{
         m_last_dt,
         mouse_pos,
         canvas_pos,
-        is_flipped
+        is_flipped,
+        m_canvas.last_dirty_area(),
+        m_canvas.width() * m_canvas.height(),
+        m_canvas.tile_bytes_used(),
+        m_canvas.tile_bytes_reserved(),
+        m_canvas.layer_cache_bytes(),
+        m_canvas.pooled_layer_cache_bytes(),
+        m_skipped_frames,
+        m_partial_frames,
+        m_full_frames,
+        m_last_gl_counts,
+        m_canvas.residency_stats(),
+        m_canvas.history_bytes(),
+        export_progress,
+        m_last_export_stats,
+        document_save_progress,
+        m_autosave.last_stats(),
+        m_autosave.last_error(),
+        recorded_frames,
+        m_frame_tracer.stats(),
+        m_canvas.gpu_profiler().stats(),
+        m_canvas.gpu_profiler().dropped_frames(),
+        m_canvas.gpu_profiler().is_tracing()
     };
 }
 
@@ -0,0 +1,143 @@
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "autosave.h"
+#include "canvas.h"
+#include "document.h"
+#include "layer.h"
+#include "tile_atlas.h"
+
+// Autosaves run on a single thread, so they never compete with painting for
+// more than one core.
+static const size_t AUTOSAVE_THREAD_COUNT = 1;
+
+Autosave::Autosave(std::string filename, double interval_seconds)
+    : m_filename(std::move(filename)),
+    m_interval_seconds(interval_seconds),
+    m_next_save_time(interval_seconds),
+    m_file_size(0),
+    m_live_bytes(0)
+{
+}
+
+void Autosave::set_interval_seconds(double seconds) {
+    m_next_save_time += seconds - m_interval_seconds;
+    m_interval_seconds = seconds;
+}
+
+void Autosave::update(Canvas& canvas, double now) {
+    if (m_writer != nullptr) {
+        if (!m_writer->is_finished()) return;
+        finish_save();
+    }
+
+    if (now < m_next_save_time) return;
+    m_next_save_time = now + m_interval_seconds;
+    start_save(canvas);
+}
+
+void Autosave::finish_save() {
+    if (m_writer->error().has_value()) {
+        // The tiles this save was meant to write are no longer tracked as
+        // modified, so the next save has to write everything.
+        m_last_error = m_writer->error();
+        std::cerr << "Autosave failed: " << m_last_error.value() << std::endl;
+        m_saved_order.clear();
+        m_saved_layers.clear();
+        m_file_size = 0;
+        m_live_bytes = 0;
+    } else {
+        m_last_error = std::nullopt;
+        m_last_stats = m_writer->stats();
+        m_saved_order = m_writer_order;
+        m_saved_layers.clear();
+        m_file_size = m_writer->file_size();
+        m_live_bytes = 0;
+
+        int tiles_x = (int(m_writer->width()) + TileAtlas::TILE_SIZE - 1) / TileAtlas::TILE_SIZE;
+        for (size_t i = 0; i < m_writer_order.size(); i++) {
+            SavedLayer& layer = m_writer_layers[i];
+            for (const DocumentTileRecord& record : m_writer->tile_records(i)) {
+                layer.tiles[size_t(record.pos.y) * tiles_x + record.pos.x] = record;
+                m_live_bytes += record.size;
+            }
+            m_saved_layers.emplace(m_writer_order[i], std::move(layer));
+        }
+    }
+
+    m_writer = nullptr;
+    m_writer_order.clear();
+    m_writer_layers.clear();
+}
+
+void Autosave::start_save(Canvas& canvas) {
+    const std::vector<Layer>& layers = canvas.get_layers();
+
+    // Layers are taken through `lookup_layer()`, since taking their modified
+    // tiles changes them.
+    bool is_changed = m_file_size == 0 || layers.size() != m_saved_order.size();
+    std::vector<std::vector<bool>> modified_tiles;
+    for (size_t i = 0; i < layers.size(); i++) {
+        Layer& layer = canvas.lookup_layer(layers[i].id()).value().get();
+        modified_tiles.push_back(layer.take_modified_tiles());
+
+        for (bool is_modified : modified_tiles.back()) {
+            if (is_modified) is_changed = true;
+        }
+        if (i >= m_saved_order.size() || m_saved_order[i] != layer.id()
+            || m_saved_layers.at(layer.id()).info != document_layer_info(layer)) {
+            is_changed = true;
+        }
+    }
+    if (!is_changed) return;
+
+    for (const Layer& layer : layers) {
+        m_writer_order.push_back(layer.id());
+        m_writer_layers.push_back(SavedLayer{
+            document_layer_info(layer),
+            std::vector<std::optional<DocumentTileRecord>>(size_t(layer.tiles_x()) * layer.tiles_y()),
+        });
+    }
+
+    // Every append leaves the previous index, and any tiles it replaced,
+    // behind in the file.
+    bool is_mostly_garbage = m_file_size - m_live_bytes > m_live_bytes;
+    if (m_file_size == 0 || is_mostly_garbage) {
+        m_writer = canvas.save_document(m_filename, AUTOSAVE_THREAD_COUNT);
+        return;
+    }
+
+    m_writer = std::make_shared<DocumentWriter>(m_filename, canvas.width(), canvas.height(), AUTOSAVE_THREAD_COUNT);
+    m_writer->append_to(m_file_size);
+    for (size_t i = 0; i < layers.size(); i++) {
+        const Layer& layer = layers[i];
+        m_writer->add_layer(document_layer_info(layer));
+
+        auto saved = m_saved_layers.find(layer.id());
+        for (int y = 0; y < layer.tiles_y(); y++) {
+            for (int x = 0; x < layer.tiles_x(); x++) {
+                size_t index = size_t(y) * layer.tiles_x() + x;
+                if (saved == m_saved_layers.end() || modified_tiles[i][index]) {
+                    add_layer_tile(m_writer, layer, { x, y }, canvas.readback_queue());
+                    continue;
+                }
+
+                const std::optional<DocumentTileRecord>& record = saved->second.tiles[index];
+                if (!record.has_value()) continue;
+                if (record.value().is_solid) {
+                    m_writer->add_solid_tile({ x, y }, record.value().color);
+                } else {
+                    m_writer->add_existing_tile({ x, y }, record.value().offset, record.value().size);
+                }
+            }
+        }
+    }
+    m_writer->start();
+}
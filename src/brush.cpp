@@ -3,6 +3,7 @@
 #include <iterator>
 #include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "glad/glad.h"
@@ -10,80 +11,102 @@
 
 #include "brush.h"
 #include "canvas.h"
+#include "frame_buffer.h"
+#include "gl_state.h"
+#include "gpu_profiler.h"
 #include "layer.h"
 #include "program.h"
 #include "texture.h"
+#include "tile_atlas.h"
 #include "vao.h"
 
-Brush::Brush() {
+Brush::Brush() : m_dab_buffer(GL_SHADER_STORAGE_BUFFER), m_dab_count(0) {
     m_name = "Unnamed Brush";
     m_opacity = 1.0;
     m_size = 10.0;
     m_cursor_program = Program("../src/shaders/quad.vert", "../src/shaders/draw_circle_cursor.frag");
 }
 
-void Brush::set_program_uniforms(
-    glm::vec2 image_size,
-    glm::vec2 mouse_pos,
-    float pressure,
-    glm::vec3 color
-) {
-    m_brush_program.use();
-    m_brush_program.set_uniform_2f("u_tex_dim", image_size);
-    m_brush_program.set_uniform_2f("u_circle_pos", mouse_pos);
-    m_brush_program.set_uniform_1f("u_radius", m_size * pressure);
-    m_brush_program.set_uniform_1f("u_opacity", m_opacity);
-    m_brush_program.set_uniform_3f("u_color", color);
-}
-
-void Brush::apply_program() {
+void Brush::apply_program(size_t num_dabs) {
     m_brush_program.use();
 
     GLuint dummy_vao = VAO::get_dummy();
-    glBindVertexArray(dummy_vao);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays_instanced(GL_TRIANGLE_STRIP, 0, 4, num_dabs);
 }
 
 static Program load_brush_program(const char* shader_path) {
-    return Program("../src/shaders/quad.vert", shader_path);
+    return Program("../src/shaders/dab.vert", shader_path);
 }
 
 const float MIN_BRUSH_SIZE = 1.0f;
 const float MAX_BRUSH_SIZE = 1000.0f;
 const std::vector<float> BRUSH_SIZES{ 1, 1.5, 2, 2.5, 3, 4, 5, 6, 7, 8, 9, 10, 12, 15, 17, 20, 25, 30, 40, 60, 70, 80, 100, 120, 150, 170, 200, 250, 300, 400, 500, 600, 700, 800, 1000 };
 
+void Brush::on_mouse_press(Canvas& canvas, UserState& user_state) {
+    m_stroke_rect = Rect();
+    m_stroke_edit = std::nullopt;
+
+    if (!user_state.selected_layer.has_value()) return;
+    auto layer_opt = canvas.lookup_layer(user_state.selected_layer.value());
+    if (layer_opt.has_value()) {
+        m_stroke_edit.emplace(layer_opt.value().get());
+    }
+}
+
 void Brush::on_mouse_down(Canvas& canvas, UserState& user_state) {
+    if (!user_state.selected_layer.has_value()) return;
     Layer::Id layer_id = user_state.selected_layer.value();
     auto layer_opt = canvas.lookup_layer(layer_id);
     if (!layer_opt.has_value()) return;
-    const Layer& layer = layer_opt.value().get();
-
-    layer.bind_canvas_fbo();
+    Layer& layer = layer_opt.value().get();
 
+    GpuPassScope pass(canvas.gpu_profiler(), "dabs");
+    Rect drawn_rect;
     if (!user_state.prev_cursor.has_value()) {
         CursorState cursor = user_state.cursor;
         cursor.pos = canvas.screen_space_to_canvas_space(cursor.pos);
-        draw_at_point(
-            layer.size(),
+        drawn_rect = draw_at_point(
+            layer,
             cursor.pos,
             cursor.pressure,
-            user_state.selected_color,
-            layer.is_alpha_locked()
+            user_state.selected_color
         );
     } else {
         CursorState start = user_state.prev_cursor.value();
         CursorState end = user_state.cursor;
         start.pos = canvas.screen_space_to_canvas_space(start.pos);
         end.pos = canvas.screen_space_to_canvas_space(end.pos);
-        draw_segment(layer.size(), start, end, user_state.selected_color, layer.is_alpha_locked());
+        drawn_rect = draw_segment(layer, start, end, user_state.selected_color);
     }
 
-    layer.unbind_fbo();
+    layer.mark_dirty(drawn_rect);
+    m_stroke_rect = m_stroke_rect.united(drawn_rect);
+    FrameBuffer::unbind();
+}
+
+// Once a stroke is finished, any tile it left as a single color (e.g. fully
+// erased) can give its storage back to the atlas, and the tiles it changed
+// go into the undo history.
+void Brush::on_mouse_release(Canvas& canvas, UserState& user_state) {
+    std::optional<TileEdit> edit = std::exchange(m_stroke_edit, std::nullopt);
+    Rect stroke_rect = std::exchange(m_stroke_rect, Rect());
+    if (!edit.has_value()) return;
+
+    auto layer_opt = canvas.lookup_layer(edit.value().layer_id());
+    if (!layer_opt.has_value()) return;
+    Layer& layer = layer_opt.value().get();
+
+    layer.compact_tiles(stroke_rect, canvas.readback_queue());
+    if (!edit.value().is_empty()) {
+        edit.value().finish(canvas.tile_compressor());
+        canvas.push_history(std::move(edit.value()));
+    }
 }
 
 // By default, brushes use the circular cursor program.
 void Brush::render_cursor(const Canvas& canvas, const glm::vec2 cursor_pos) {
-    const Texture2D& output_texture = canvas.screen_texture();
+    const Texture2D& output_texture = canvas.view_texture();
     output_texture.bind_to_0();
     
     m_cursor_program.use();
@@ -94,29 +117,39 @@ void Brush::render_cursor(const Canvas& canvas, const glm::vec2 cursor_pos) {
     m_cursor_program.set_uniform_1f("u_radius", radius_in_pixels);
 
     GLuint dummy_vao = VAO::get_dummy();
-    glBindVertexArray(dummy_vao);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
 
-void Brush::draw_at_point(
-    glm::vec2 image_size,
+Rect Brush::draw_at_point(
+    Layer& layer,
     glm::vec2 mouse_pos,
     float pressure,
-    glm::vec3 color,
-    bool is_alpha_locked
+    glm::vec3 color
+) {
+    queue_dab(mouse_pos, pressure, color);
+    return flush_dabs(layer);
+}
+
+Rect Brush::draw_segment(
+    Layer& layer, 
+    CursorState start, 
+    CursorState end, 
+    glm::vec3 color
 ) {
-    set_program_uniforms(image_size, mouse_pos, pressure, color);
-    set_blend_mode(is_alpha_locked);
-    apply_program();
+    queue_segment(start, end, color);
+    return flush_dabs(layer);
 }
 
-void Brush::draw_segment(
-    glm::vec2 image_size, 
+void Brush::queue_dab(glm::vec2 pos, float pressure, glm::vec3 color) {
+    m_dabs.push_back(Dab{ pos, m_size * pressure, m_opacity, glm::vec4(color, 1.0f) });
+}
+
+void Brush::queue_segment(
     CursorState start, 
     CursorState end, 
-    glm::vec3 color, 
-    bool is_alpha_locked
+    glm::vec3 color
 ) {
     float dist = glm::length(start.pos - end.pos);
     float min_pressure = std::min(start.pressure, end.pressure);
@@ -130,15 +163,68 @@ void Brush::draw_segment(
         float alpha = (float)i / num_segments;
         glm::vec2 pos = start.pos * alpha + end.pos * (1.0f - alpha);
         float pressure = start.pressure * alpha + end.pressure * (1.0f - alpha);
+        queue_dab(pos, pressure, color);
+    }
+}
 
-        draw_at_point(
-            image_size,
-            pos,
-            pressure,
-            color,
-            is_alpha_locked
-        );
+// Draws every queued dab into the layer. Each dab is drawn as a quad covering
+// only its own bounds, and all dabs touching a tile go out in a single
+// instanced draw, in the order they were queued.
+Rect Brush::flush_dabs(Layer& layer) {
+    Rect drawn_rect;
+    for (const Dab& dab : m_dabs) {
+        drawn_rect = drawn_rect.united(Rect::from_circle(dab.center, dab.radius));
+    }
+    drawn_rect = drawn_rect.intersected(layer.rect());
+    if (drawn_rect.is_empty() || !can_draw_on(layer)) {
+        m_dabs.clear();
+        return Rect();
+    }
+
+    // Masks only store coverage, which the blend mode takes from the red
+    // channel, so every dab is drawn in white.
+    if (layer.is_mask()) {
+        for (Dab& dab : m_dabs) dab.color = glm::vec4(1.0f);
+    }
+
+    m_dab_buffer.upload(m_dabs);
+    m_dab_buffer.bind_base(0);
+    m_dab_count += m_dabs.size();
+
+    set_blend_mode(layer);
+    m_brush_program.use();
+    m_brush_program.set_uniform_1f("u_tile_size", TileAtlas::TILE_SIZE);
+
+    Rect tiles = layer.tile_range(drawn_rect);
+    for (int y = tiles.min.y; y < tiles.max.y; y++) {
+        for (int x = tiles.min.x; x < tiles.max.x; x++) {
+            glm::ivec2 tile(x, y);
+            Rect tile_rect = layer.tile_rect(tile);
+            bool is_touched = std::any_of(m_dabs.begin(), m_dabs.end(), [&](const Dab& dab) {
+                return Rect::from_circle(dab.center, dab.radius).intersects(tile_rect);
+            });
+            if (!is_touched) continue;
+
+            // Tiles that stay empty are left alone, so they need no undo record.
+            bool allocate_if_empty = can_draw_on_empty_tile(layer);
+            if (layer.tile(tile).kind == Layer::Tile::Kind::Empty && !allocate_if_empty) continue;
+            if (m_stroke_edit.has_value() && m_stroke_edit.value().layer_id() == layer.id()) {
+                m_stroke_edit.value().record(layer, tile);
+            }
+            if (!layer.prepare_tile_for_write(tile, allocate_if_empty)) continue;
+
+            // Dabs are never drawn past the edge of the layer, even though
+            // the last row and column of tiles may extend beyond it.
+            layer.bind_tile_for_drawing(tile, layer.rect());
+            m_brush_program.use();
+            m_brush_program.set_uniform_2f("u_tile_origin", glm::vec2(tile_rect.min));
+            apply_program(m_dabs.size());
+        }
     }
+    FrameBuffer::disable_scissor();
+
+    m_dabs.clear();
+    return drawn_rect;
 }
 
 void Brush::decrease_size() {
@@ -162,17 +248,30 @@ Pen::Pen() {
     m_brush_program = load_brush_program("../src/shaders/brush_pen.frag");
 }
 
-void Pen::set_blend_mode(bool is_alpha_locked) {
-    if (!is_alpha_locked) {
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// Dabs are premultiplied, like the layers they are drawn onto.
+void Pen::set_blend_mode(const Layer& layer) {
+    glEnable(GL_BLEND);
+    if (layer.is_mask() || !layer.is_alpha_locked()) {
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
     } else {
-        glEnable(GL_BLEND);
-        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
+        // Scaling by the layer's alpha keeps the new color premultiplied,
+        // without changing the alpha itself.
+        glBlendFuncSeparate(GL_DST_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ZERO, GL_ONE);
     }
 }
 
 
+// An alpha locked mask has nothing left to paint, since its color comes
+// from the layer's tint.
+bool Pen::can_draw_on(const Layer& layer) const {
+    return !(layer.is_mask() && layer.is_alpha_locked());
+}
+
+bool Pen::can_draw_on_empty_tile(const Layer& layer) const {
+    return !layer.is_alpha_locked();
+}
+
+
 Eraser::Eraser() {
     m_name = "Eraser";
     m_size = 200.0f;
@@ -181,24 +280,9 @@ Eraser::Eraser() {
     m_brush_program = load_brush_program("../src/shaders/brush_eraser.frag");
 }
 
-void Eraser::set_blend_mode(bool _is_alpha_locked) {
+// With premultiplied color, erasing scales every channel alike. That also
+// covers masks, whose coverage lives in their red channel.
+void Eraser::set_blend_mode(const Layer& layer) {
     glEnable(GL_BLEND);
-    glBlendFuncSeparate(GL_ZERO, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+    glBlendFunc(GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
 }
-
-void Eraser::set_program_uniforms(
-    glm::vec2 image_size,
-    glm::vec2 mouse_pos,
-    float pressure,
-    glm::vec3 _color
-) {
-    m_brush_program.use();
-    m_brush_program.set_uniform_2f("u_tex_dim", image_size);
-    m_brush_program.set_uniform_2f("u_circle_pos", mouse_pos);
-    m_brush_program.set_uniform_1f("u_radius", m_size * pressure);
-    m_brush_program.set_uniform_1f("u_opacity", m_opacity);
-}
-
-
-
-
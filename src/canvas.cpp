@@ -1,36 +1,73 @@
 #include <algorithm>
+#include <bit>
 #include <cstdint>
-#include <cstdio> // required for stb_image_write.h to work
 #include <exception>
+#include <filesystem>
+#include <format>
 #include <functional>
 #include <iterator>
+#include <memory>
 #include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include "glad/glad.h"
 #include "glm/glm.hpp"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
 #include "brush.h"
 #include "canvas.h"
+#include "document.h"
 #include "frame_buffer.h"
+#include "gl_state.h"
+#include "history.h"
 #include "layer.h"
+#include "png_export.h"
 #include "program.h"
+#include "vao.h"
 
 // SOMEDAY: Reflect on whether having a [CanvasView] class within [Canvas]
 // is truly the best way to separate concerns.
 
 const size_t N_CHANNELS = 4;
 const float MAX_BRUSH_RADIUS = 1000.0;
+const size_t DEFAULT_VRAM_BUDGET = size_t(2048) * 1024 * 1024;
+const size_t DEFAULT_HISTORY_BUDGET = size_t(512) * 1024 * 1024;
+// Small enough that streaming a document doesn't make painting stutter.
+const size_t STREAMED_TILES_PER_TICK = 32;
+// A texel at a deeper level would span several tiles.
+const size_t MAX_PREVIEW_LEVEL = std::countr_zero(unsigned(TileAtlas::TILE_SIZE));
 
 Canvas::Canvas(size_t width, size_t height)
-    : m_output_frame_buffer(width, height),
-    m_canvas_view(m_output_frame_buffer.width(), m_output_frame_buffer.height())
+    : m_tile_atlases{
+        TileAtlas(PixelFormat::R8),
+        TileAtlas(PixelFormat::RGBA8),
+        TileAtlas(PixelFormat::RGBA16F),
+    },
+    m_tile_compressor(m_readback_queue),
+    m_history(DEFAULT_HISTORY_BUDGET),
+    m_residency_manager(DEFAULT_VRAM_BUDGET),
+    m_output_frame_buffer(width, height, true),
+    // Enough to keep both caches while neither is needed.
+    m_frame_buffer_pool(2 * width * height * N_CHANNELS),
+    m_stale_cache_region(width, height),
+    m_stale_output_region(width, height),
+    m_stale_preview_region(width, height),
+    m_canvas_view(m_output_frame_buffer.width(), m_output_frame_buffer.height()),
+    m_quad_program("../src/shaders/quad.vert", "../src/shaders/quad.frag"),
+    m_downsample_program("../src/shaders/mip_downsample.comp")
 {
     m_base_color = glm::vec3( 1.0, 1.0, 1.0 );
 
+    m_cached_selected_layer = std::nullopt;
+    m_is_layer_cache_valid = false;
+    m_last_dirty_area = 0;
+    m_preview_level = 0;
+    m_is_streaming_document = false;
 }
 
 bool Canvas::layer_exists(Layer::Id layer_id) {
@@ -52,7 +89,7 @@ std::optional<std::reference_wrapper<Layer>> Canvas::lookup_layer(Layer::Id laye
     }
 }
 
-Layer::Id Canvas::insert_new_layer_above_selected(std::optional<Layer::Id> selected_layer) {
+Layer::Id Canvas::insert_new_layer_above_selected(std::optional<Layer::Id> selected_layer, PixelFormat format) {
     Layer::Id target_layer_id = selected_layer.has_value() ?
         selected_layer.value() :
         m_layers.size() > 0 ? m_layers.back().id() : 0;
@@ -61,41 +98,27 @@ Layer::Id Canvas::insert_new_layer_above_selected(std::optional<Layer::Id> selec
         [target_layer_id](const Layer& layer) {
             return layer.id() == target_layer_id;
         });
+    size_t index = insert_position == m_layers.end() ?
+        m_layers.size() :
+        std::distance(m_layers.begin(), insert_position) + 1;
 
-    Layer new_layer = Layer(width(), height());
+    Layer new_layer = Layer(width(), height(), m_tile_atlases[size_t(format)]);
     Layer::Id new_layer_id = new_layer.id();
+    insert_layer_at(std::move(new_layer), index);
 
-    if (insert_position == m_layers.end()) {
-        m_layers.push_back(std::move(new_layer));
-    }
-    else {
-        m_layers.insert(insert_position + 1, std::move(new_layer));
-    }
-
+    m_history.push(LayerInsertion{ new_layer_id, index, std::nullopt });
     return new_layer_id;
 }
 
 std::optional<Layer::Id> Canvas::delete_selected_layer(std::optional<Layer::Id> selected_layer) {
     if (!selected_layer.has_value()) return selected_layer;
 
-    Layer::Id target_layer_id = selected_layer.value();
+    std::optional<size_t> index = find_layer_index(selected_layer.value());
+    if (!index.has_value()) return selected_layer;
 
-    auto it = std::find_if(m_layers.begin(), m_layers.end(),
-        [target_layer_id](const Layer& layer) {
-            return layer.id() == target_layer_id;
-        });
-    if (it == m_layers.end()) return selected_layer;
-
-    size_t index = std::distance(m_layers.begin(), it);
-    m_layers.erase(it);
-
-    if (m_layers.empty()) {
-        return std::nullopt;
-    } else if (index == 0) {
-        return m_layers[0].id();
-    } else {
-        return m_layers[index-1].id();
-    }
+    Layer layer = remove_layer_at(index.value());
+    m_history.push(LayerDeletion{ layer.id(), index.value(), std::move(layer) });
+    return selection_after_removal(index.value());
 }
 
 void Canvas::move_layer_up(std::optional<Layer::Id> layer_id) {
@@ -109,23 +132,16 @@ void Canvas::move_layer_down(std::optional<Layer::Id> layer_id) {
 void Canvas::move_layer(std::optional<Layer::Id> layer_id, int delta) {
     if (!layer_id.has_value()) return; 
 
-    // TODO: Move this search into a helper function
-    Layer::Id target_id = layer_id.value();
-    auto it = std::find_if(m_layers.begin(), m_layers.end(),
-        [target_id](const Layer& layer) { return layer.id() == target_id; });
-    if (it == m_layers.end()) return; 
-
-    int index = std::distance(m_layers.begin(), it);
-    int new_index = index + delta;
+    std::optional<size_t> index = find_layer_index(layer_id.value());
+    if (!index.has_value()) return; 
 
+    int new_index = int(index.value()) + delta;
     new_index = std::min(new_index, int(m_layers.size() - 1));
     new_index = std::max(new_index, 0);
-    if (index == new_index) return;
-
-    Layer layer = std::move(m_layers[index]);
-    m_layers.erase(m_layers.begin() + index);
+    if (int(index.value()) == new_index) return;
 
-    m_layers.insert(m_layers.begin() + new_index, std::move(layer));
+    move_layer_to(index.value(), new_index);
+    m_history.push(LayerMove{ layer_id.value(), index.value(), size_t(new_index) });
 }
 
 bool Canvas::get_layer_visibility(Layer::Id layer_id) {
@@ -136,8 +152,11 @@ bool Canvas::get_layer_visibility(Layer::Id layer_id) {
 
 void Canvas::set_layer_visibility(Layer::Id layer_id, bool is_visible) {
     auto layer = lookup_layer(layer_id);
-    if (layer.has_value()) {
+    if (layer.has_value() && layer.value().get().is_visible() != is_visible) {
+        // The layer marks itself dirty, so only its own region of the
+        // caches needs rebuilding.
         layer.value().get().set_visible(is_visible);
+        m_history.push(LayerVisibilityChange{ layer_id, is_visible });
     }
 }
 
@@ -154,8 +173,185 @@ void Canvas::set_layer_alpha_lock(Layer::Id layer_id, bool is_alpha_locked) {
     }
 }
 
-std::optional<glm::vec3> Canvas::get_color_at_pos(glm::vec2 point) {
-    return m_output_frame_buffer.get_color_at_pos(point);
+void Canvas::set_layer_tint(Layer::Id layer_id, glm::vec3 tint) {
+    auto layer = lookup_layer(layer_id);
+    if (layer.has_value()) {
+        layer.value().get().set_tint(tint);
+    }
+}
+
+std::optional<Layer::Id> Canvas::undo(std::optional<Layer::Id> selected_layer) {
+    std::optional<HistoryEntry> entry = m_history.take_undo();
+    if (!entry.has_value()) return selected_layer;
+
+    selected_layer = apply_history_entry(entry.value(), true, selected_layer);
+    m_history.push_undone(std::move(entry.value()));
+    return selected_layer;
+}
+
+std::optional<Layer::Id> Canvas::redo(std::optional<Layer::Id> selected_layer) {
+    std::optional<HistoryEntry> entry = m_history.take_redo();
+    if (!entry.has_value()) return selected_layer;
+
+    selected_layer = apply_history_entry(entry.value(), false, selected_layer);
+    m_history.push_redone(std::move(entry.value()));
+    return selected_layer;
+}
+
+// Undoing and redoing an entry are mirror images of each other, so both go
+// through here. Returns the layer that should be selected afterwards.
+std::optional<Layer::Id> Canvas::apply_history_entry(
+    HistoryEntry& entry, 
+    bool is_undo, 
+    std::optional<Layer::Id> selected_layer
+) {
+    if (TileEdit* edit = std::get_if<TileEdit>(&entry)) {
+        auto layer = lookup_layer(edit->layer_id());
+        if (layer.has_value()) {
+            edit->swap(layer.value().get(), m_tile_compressor);
+        }
+        return selected_layer;
+    }
+
+    if (LayerInsertion* insertion = std::get_if<LayerInsertion>(&entry)) {
+        return set_layer_presence(insertion->layer_id, insertion->index, insertion->removed_layer, !is_undo, selected_layer);
+    }
+
+    if (LayerDeletion* deletion = std::get_if<LayerDeletion>(&entry)) {
+        return set_layer_presence(deletion->layer_id, deletion->index, deletion->removed_layer, is_undo, selected_layer);
+    }
+
+    if (LayerMove* move = std::get_if<LayerMove>(&entry)) {
+        if (is_undo) move_layer_to(move->to_index, move->from_index);
+        else move_layer_to(move->from_index, move->to_index);
+        return selected_layer;
+    }
+
+    if (LayerVisibilityChange* change = std::get_if<LayerVisibilityChange>(&entry)) {
+        auto layer = lookup_layer(change->layer_id);
+        if (layer.has_value()) {
+            layer.value().get().set_visible(is_undo ? !change->is_visible : change->is_visible);
+        }
+        return selected_layer;
+    }
+
+    return selected_layer;
+}
+
+// Moves a layer between the canvas and `removed_layer`, which holds it while
+// it is out of the canvas.
+std::optional<Layer::Id> Canvas::set_layer_presence(
+    Layer::Id layer_id,
+    size_t index,
+    std::optional<Layer>& removed_layer,
+    bool should_be_present,
+    std::optional<Layer::Id> selected_layer
+) {
+    if (should_be_present) {
+        if (!removed_layer.has_value()) return selected_layer;
+        insert_layer_at(std::move(removed_layer.value()), index);
+        removed_layer.reset();
+        return layer_id;
+    }
+
+    std::optional<size_t> current_index = find_layer_index(layer_id);
+    if (!current_index.has_value()) return selected_layer;
+
+    removed_layer = remove_layer_at(current_index.value());
+    if (selected_layer != layer_id) return selected_layer;
+    return selection_after_removal(current_index.value());
+}
+
+std::optional<size_t> Canvas::find_layer_index(Layer::Id layer_id) const {
+    auto it = std::find_if(m_layers.begin(), m_layers.end(),
+        [layer_id](const Layer& layer) { return layer.id() == layer_id; });
+    if (it == m_layers.end()) return std::nullopt;
+    return std::distance(m_layers.begin(), it);
+}
+
+void Canvas::insert_layer_at(Layer layer, size_t index) {
+    index = std::min(index, m_layers.size());
+    m_layers.insert(m_layers.begin() + index, std::move(layer));
+    invalidate_layer_cache();
+}
+
+// Layers removed from the canvas are kept by the history, so their tiles are
+// compressed into host memory in the background, and give their atlas slots
+// back once they are. Removing a layer never waits on the GPU. They let go of
+// the document they were opened from, so that only layers on the canvas can
+// keep it from being saved over.
+Layer Canvas::remove_layer_at(size_t index) {
+    Layer layer = std::move(m_layers[index]);
+    m_layers.erase(m_layers.begin() + index);
+    layer.evict(m_tile_compressor);
+    layer.detach_source_file();
+    invalidate_layer_cache();
+    return layer;
+}
+
+void Canvas::move_layer_to(size_t index, size_t new_index) {
+    if (index >= m_layers.size() || new_index >= m_layers.size()) return;
+
+    Layer layer = std::move(m_layers[index]);
+    m_layers.erase(m_layers.begin() + index);
+    m_layers.insert(m_layers.begin() + new_index, std::move(layer));
+    invalidate_layer_cache();
+}
+
+// After removing the layer at `index`, selects the layer below it, or the
+// new bottom layer if it was at the bottom.
+std::optional<Layer::Id> Canvas::selection_after_removal(size_t index) const {
+    if (m_layers.empty()) {
+        return std::nullopt;
+    } else if (index == 0) {
+        return m_layers[0].id();
+    } else {
+        return m_layers[index-1].id();
+    }
+}
+
+size_t Canvas::tile_bytes_used() const {
+    size_t bytes = 0;
+    for (const TileAtlas& atlas : m_tile_atlases) bytes += atlas.used_bytes();
+    return bytes;
+}
+
+size_t Canvas::tile_bytes_reserved() const {
+    size_t bytes = 0;
+    for (const TileAtlas& atlas : m_tile_atlases) bytes += atlas.reserved_bytes();
+    return bytes;
+}
+
+size_t Canvas::layer_cache_bytes() const {
+    size_t bytes = 0;
+    if (m_below_frame_buffer.has_value()) bytes += m_below_frame_buffer.value().texture().bytes();
+    if (m_above_frame_buffer.has_value()) bytes += m_above_frame_buffer.value().texture().bytes();
+    return bytes;
+}
+
+void Canvas::request_color_at_pos(glm::vec2 point, std::function<void(glm::vec3)> callback) {
+    glm::ivec2 pixel = glm::ivec2(glm::floor(point));
+    Rect pixel_rect(pixel, pixel + 1);
+    if (!rect().intersects(pixel_rect)) return;
+
+    update_output(pixel_rect);
+    m_output_frame_buffer.bind();
+    m_readback_queue.request(pixel_rect, GL_RGBA, GL_UNSIGNED_BYTE, N_CHANNELS,
+        [callback = std::move(callback)](std::vector<uint8_t>&& pixel) {
+            callback(glm::vec3(pixel[0], pixel[1], pixel[2]) / 255.0f);
+        });
+    FrameBuffer::unbind();
+}
+
+// Tiles are compressed once their readbacks arrive, so the readbacks go first.
+void Canvas::poll_readbacks() {
+    m_readback_queue.poll();
+    m_tile_compressor.poll();
+}
+
+void Canvas::finish_readbacks() {
+    m_readback_queue.finish();
+    m_tile_compressor.finish();
 }
 
 void Canvas::bind_canvas_fbo() const {
@@ -163,30 +359,467 @@ void Canvas::bind_canvas_fbo() const {
     m_output_frame_buffer.set_viewport();
 }
 
-// Combines all the layers together in a single framebuffer.
-void Canvas::render(glm::vec2 screen_area, glm::vec2 mouse_pos) {
+// Brings the composite and view up to date. Only the part of the canvas that
+// is visible in the view is composited. Anything else that changed is left
+// stale until it scrolls into view, or until `update_output()` is called for
+// it directly (e.g. for export or color picking). When zoomed out, the
+// visible part is composited at the mip level the view samples, and only
+// what was painted is composited at full resolution.
+FrameKind Canvas::render(glm::vec2 screen_area, glm::vec2 mouse_pos, std::optional<Layer::Id> selected_layer) {
+    FrameKind frame_kind = FrameKind::Skipped;
+    bool should_check_cache_storage = false;
+    if (!m_is_layer_cache_valid || m_cached_selected_layer != selected_layer) {
+        m_cached_selected_layer = selected_layer;
+        m_is_layer_cache_valid = true;
+        m_stale_cache_region.mark_all();
+        m_stale_output_region.mark_all();
+        m_stale_preview_region.mark_all();
+        frame_kind = FrameKind::Full;
+        should_check_cache_storage = true;
+
+        // The selected layer is drawn to directly, so it is always resident.
+        if (selected_layer.has_value()) {
+            auto layer = lookup_layer(selected_layer.value());
+            if (layer.has_value()) {
+                m_residency_manager.make_resident(layer.value().get(), rect());
+            }
+        }
+    }
+
+    Rect painted_rect;
+    for (Layer& layer : m_layers) {
+        if (layer.dirty_rect().is_empty()) continue;
+        if (layer.id() != selected_layer) {
+            m_stale_cache_region.mark(layer.dirty_rect());
+            should_check_cache_storage = true;
+        }
+        m_stale_output_region.mark(layer.dirty_rect());
+        m_stale_preview_region.mark(layer.dirty_rect());
+        painted_rect = painted_rect.united(layer.dirty_rect());
+        m_residency_manager.touch(layer.id());
+        layer.clear_dirty_rect();
+    }
+
+    if (should_check_cache_storage && update_layer_cache_storage()) {
+        m_stale_cache_region.mark_all();
+        m_stale_output_region.mark_all();
+        frame_kind = FrameKind::Full;
+    }
+
+    m_canvas_view.resize(screen_area);
+    Rect visible_rect = m_canvas_view.visible_canvas_rect(output_texture());
+    size_t preview_level = choose_preview_level();
+    if (preview_level != m_preview_level) {
+        // Levels past the last preview level were rebuilt from it, but finer
+        // ones are only current where the full-resolution output is.
+        if (m_preview_level == 0 || preview_level < m_preview_level) {
+            m_stale_preview_region = m_stale_output_region;
+        }
+        m_preview_level = preview_level;
+    }
+
+    Rect updated_rect;
+    Rect preview_rect;
+    {
+        GpuPassScope pass(m_gpu_profiler, "composite");
+        if (preview_level == 0) {
+            updated_rect = update_output(visible_rect);
+        } else {
+            // While painting, only the selected layer changes, so going
+            // through the caches is cheaper than compositing every layer
+            // again, even at full resolution.
+            updated_rect = update_output(m_stale_preview_region.take(painted_rect.intersected(visible_rect)));
+            preview_rect = composite_preview(m_stale_preview_region.take(visible_rect), preview_level);
+        }
+    }
+    m_last_dirty_area = updated_rect.area() + preview_rect.area();
+    bool is_output_updated = !updated_rect.is_empty() || !preview_rect.is_empty();
+    if (is_output_updated && frame_kind == FrameKind::Skipped) {
+        frame_kind = FrameKind::Partial;
+    }
+
+    bool is_view_updated = false;
+    {
+        GpuPassScope pass(m_gpu_profiler, "view");
+        is_view_updated = m_canvas_view.render(m_output_frame_buffer.texture(), is_output_updated);
+    }
+    if (is_view_updated && frame_kind == FrameKind::Skipped) frame_kind = FrameKind::Partial;
+
+    m_residency_manager.enforce_budget(m_layers, selected_layer, tile_bytes_used(), m_tile_compressor);
+    release_tile_pages();
+    return frame_kind;
+}
+
+// Gives atlas pages back once most of their slots are free, e.g. after
+// evicting or deleting layers, so that reserved VRAM follows the painted
+// area down as well as up. Tiles held by the history aren't moved, so they
+// may keep a page or two from being released until they are compressed.
+void Canvas::release_tile_pages() {
+    for (TileAtlas& atlas : m_tile_atlases) {
+        if (!atlas.should_release_pages()) continue;
+
+        size_t target_pages = atlas.target_page_count();
+        TileAtlas::Slot first_slot = TileAtlas::Slot(target_pages * TileAtlas::TILES_PER_PAGE);
+        for (Layer& layer : m_layers) {
+            if (&layer.atlas() == &atlas) layer.move_tiles_below(first_slot);
+        }
+        atlas.release_pages(target_pages);
+    }
+}
+
+// Recomposites whatever is stale within `region` of the output, from the
+// below/above caches and the selected layer. Returns the rect that was
+// recomposited.
+Rect Canvas::update_output(const Rect& region) {
+    Rect cache_rect = m_stale_cache_region.take(region);
+    if (!cache_rect.is_empty()) {
+        rebuild_layer_cache(m_cached_selected_layer, cache_rect);
+    }
+
+    Rect dirty_rect = m_stale_output_region.take(region);
+    if (dirty_rect.is_empty()) return dirty_rect;
+
+    // Undoing an edit can leave tiles of the selected layer compressed.
+    if (m_cached_selected_layer.has_value()) {
+        auto layer = lookup_layer(m_cached_selected_layer.value());
+        if (layer.has_value()) {
+            m_residency_manager.make_resident(layer.value().get(), dirty_rect);
+        }
+    }
+
     bind_canvas_fbo();
+    FrameBuffer::set_scissor(dirty_rect);
+
+    if (m_below_frame_buffer.has_value()) {
+        glDisable(GL_BLEND);
+        draw_texture(m_below_frame_buffer.value().texture());
+    } else {
+        m_output_frame_buffer.clear(glm::vec4(m_base_color, 1.0));
+    }
+
+    // Blending premultiplied color over an opaque target keeps it opaque.
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    if (m_cached_selected_layer.has_value()) {
+        auto layer = lookup_layer(m_cached_selected_layer.value());
+        if (layer.has_value()) {
+            layer.value().get().render(dirty_rect);
+        }
+    }
 
+    if (m_above_frame_buffer.has_value()) {
+        draw_texture(m_above_frame_buffer.value().texture());
+    }
+
+    FrameBuffer::disable_scissor();
+    update_output_mips(dirty_rect);
+    return dirty_rect;
+}
+
+// Takes a cache from the pool once some layer it covers has something to
+// show, and gives it back once none do. Returns whether a cache was taken,
+// in which case its contents are unknown and must be rebuilt before use.
+bool Canvas::update_layer_cache_storage() {
+    auto selected = m_layers.end();
+    if (m_cached_selected_layer.has_value()) {
+        Layer::Id target_id = m_cached_selected_layer.value();
+        selected = std::find_if(m_layers.begin(), m_layers.end(),
+            [target_id](const Layer& layer) { return layer.id() == target_id; });
+    }
+
+    auto has_content = [](const Layer& layer) { return !layer.is_blank(); };
+    bool is_below_needed = std::any_of(m_layers.begin(), selected, has_content);
+    bool is_above_needed = selected != m_layers.end() && std::any_of(std::next(selected), m_layers.end(), has_content);
+
+    bool is_acquired = false;
+    auto update_storage = [&](std::optional<FrameBuffer>& cache, bool is_needed) {
+        if (is_needed && !cache.has_value()) {
+            cache = m_frame_buffer_pool.acquire(width(), height());
+            is_acquired = true;
+        } else if (!is_needed && cache.has_value()) {
+            m_frame_buffer_pool.release(std::move(cache.value()));
+            cache.reset();
+        }
+    };
+    update_storage(m_below_frame_buffer, is_below_needed);
+    update_storage(m_above_frame_buffer, is_above_needed);
+    return is_acquired;
+}
+
+// Recomposites `region` of the below and above caches, where they have storage.
+void Canvas::rebuild_layer_cache(std::optional<Layer::Id> selected_layer, const Rect& region) {
+    // If there is no valid selection, every layer counts as "below".
+    auto selected = m_layers.end();
+    if (selected_layer.has_value()) {
+        Layer::Id target_id = selected_layer.value();
+        selected = std::find_if(m_layers.begin(), m_layers.end(),
+            [target_id](const Layer& layer) { return layer.id() == target_id; });
+    }
+
+    // Every layer is premultiplied, so both caches use the same "over"
+    // blend. Since it is associative, the above cache can be blended over
+    // the result later, just as if each of its layers were.
     glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    FrameBuffer::set_scissor(region);
+
+    if (m_below_frame_buffer.has_value()) {
+        FrameBuffer& below = m_below_frame_buffer.value();
+        below.bind();
+        below.set_viewport();
+        below.clear(glm::vec4(m_base_color, 1.0));
+        composite_layers(m_layers.begin(), selected, region);
+    }
 
+    if (m_above_frame_buffer.has_value() && selected != m_layers.end()) {
+        FrameBuffer& above = m_above_frame_buffer.value();
+        above.bind();
+        above.set_viewport();
+        above.clear(glm::vec4(0.0, 0.0, 0.0, 0.0));
+        composite_layers(std::next(selected), m_layers.end(), region);
+    }
+
+    FrameBuffer::disable_scissor();
+}
+
+// Blends `region` of the layers from `first` to `last` over the bound
+// framebuffer, which holds mip `level` of the canvas. Evicted tiles are
+// restored first, but only as many layers' worth at a time as fit in the
+// VRAM budget. When the next layer doesn't fit, the batch so far is
+// composited, and the tiles restored for it are evicted again, which only
+// frees their slots, since they still have their compressed pixels.
+// Whatever the last batch restored is left to `enforce_budget()`.
+void Canvas::composite_layers(
+    std::vector<Layer>::iterator first,
+    std::vector<Layer>::iterator last,
+    const Rect& region,
+    size_t level
+) {
+    size_t budget_bytes = m_residency_manager.budget_bytes();
+    size_t resident_bytes = tile_bytes_used();
+    // Given in canvas pixels, of which each texel of the level covers a
+    // 2^level square block.
+    glm::vec2 target_size(output_texture().level_size(level) * (1 << int(level)));
+
+    auto batch_first = first;
+    std::vector<Layer*> restored_layers;
+    auto composite_batch = [&](std::vector<Layer>::iterator batch_last) {
+        m_tile_compositor.draw(std::span<const Layer>(batch_first, batch_last), region, target_size, int(level));
+        batch_first = batch_last;
+    };
+
+    for (auto it = first; it != last; it++) {
+        size_t restore_bytes = it->evicted_tile_count(region) * it->atlas().bytes_per_tile();
+        if (restore_bytes == 0) continue;
+
+        // A layer that doesn't fit even on its own is restored anyway.
+        if (resident_bytes + restore_bytes > budget_bytes && it != batch_first) {
+            composite_batch(it);
+            for (Layer* layer : restored_layers) {
+                m_residency_manager.release_restored(*layer, region);
+            }
+            restored_layers.clear();
+            resident_bytes = tile_bytes_used();
+        }
+        m_residency_manager.make_resident(*it, region);
+        restored_layers.push_back(&*it);
+        resident_bytes += restore_bytes;
+    }
+    composite_batch(last);
+}
+
+// The view's mip level, rounded down, or 0 when it is zoomed in too far to
+// composite at a lower resolution.
+size_t Canvas::choose_preview_level() const {
+    return std::min(size_t(m_canvas_view.choose_lod(output_texture())), MAX_PREVIEW_LEVEL);
+}
+
+// Composites `region` of every layer over the base color, straight into mip
+// `level` of the output, bypassing the caches and the full-resolution image.
+// The smaller levels are then rebuilt from it. Returns the texels composited,
+// at `level`.
+Rect Canvas::composite_preview(const Rect& region, size_t level) {
+    glm::ivec2 level_size = output_texture().level_size(level);
+    int block_size = 1 << int(level);
+    Rect level_rect = Rect(region.min / block_size, (region.max + block_size - 1) / block_size)
+        .intersected(Rect(glm::ivec2(0), level_size));
+    if (level_rect.is_empty()) return level_rect;
+
+    m_output_frame_buffer.bind();
+    m_output_frame_buffer.reattach_texture(level);
+    glViewport(0, 0, level_size.x, level_size.y);
+    FrameBuffer::set_scissor(level_rect);
     m_output_frame_buffer.clear(glm::vec4(m_base_color, 1.0));
 
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    composite_layers(m_layers.begin(), m_layers.end(), region, level);
+
+    FrameBuffer::disable_scissor();
+    m_output_frame_buffer.bind();
+    m_output_frame_buffer.reattach_texture();
+    update_output_mips(region, level);
+    return level_rect;
+}
+
+// Rebuilds the output's mip levels past `base_level` from it, but only over
+// `region` (given at full resolution) and the texels it covers on each level.
+void Canvas::update_output_mips(const Rect& region, size_t base_level) {
+    const Texture2D& texture = m_output_frame_buffer.texture();
+    const int GROUP_SIZE = 8;
+
+    m_downsample_program.use();
+    Rect level_region = region;
+    for (size_t level = 1; level < texture.mip_levels(); level++) {
+        glm::ivec2 level_size = texture.level_size(level);
+        // With odd sizes, the last texel of a level covers three texels of
+        // the level above, so we clamp rather than intersect the minimum.
+        level_region = Rect(
+            glm::min(level_region.min / 2, level_size - 1),
+            glm::min((level_region.max + 1) / 2, level_size)
+        );
+        if (level_region.is_empty()) break;
+        if (level <= base_level) continue;
+
+        glBindImageTexture(0, texture.id(), level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA8);
+        glBindImageTexture(1, texture.id(), level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+        m_downsample_program.set_uniform_2i("u_region_min", level_region.min);
+        m_downsample_program.set_uniform_2i("u_region_max", level_region.max);
+        GlState::dispatch_compute(
+            (level_region.width() + GROUP_SIZE - 1) / GROUP_SIZE,
+            (level_region.height() + GROUP_SIZE - 1) / GROUP_SIZE,
+            1
+        );
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+}
+
+void Canvas::draw_texture(const Texture2D& texture) {
+    m_quad_program.use();
+    texture.bind_to_0();
+    m_quad_program.set_uniform_1i("u_texture", 0);
+
+    GLuint dummy_vao = VAO::get_dummy();
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+
+
+// The composite is opaque, so its premultiplied color is also its straight
+// color, and can be written out as is.
+std::shared_ptr<PngExport> Canvas::save_as_png(const std::string& filename) {
+    update_output(rect());
+
+    auto png_export = std::make_shared<PngExport>(filename, width(), height());
+    m_output_frame_buffer.bind();
+    m_readback_queue.request(rect(), GL_RGBA, GL_UNSIGNED_BYTE, N_CHANNELS,
+        [png_export](std::vector<uint8_t>&& pixels) {
+            png_export->start(std::move(pixels));
+        });
+    FrameBuffer::unbind();
+    return png_export;
+}
+
+static bool is_same_file(const std::string& a, const std::string& b) {
+    std::error_code error;
+    return std::filesystem::equivalent(a, b, error);
+}
+
+std::shared_ptr<DocumentWriter> Canvas::save_document(const std::string& filename, size_t thread_count) {
+    // The finished file replaces the old one, which can't happen while the
+    // old one is still mapped.
     for (Layer& layer : m_layers) {
-        layer.render();
+        if (layer.source_file() != nullptr && is_same_file(layer.source_file()->path(), filename)) {
+            layer.detach_source_file();
+        }
     }
-    
-    m_canvas_view.render(screen_area, m_output_frame_buffer.texture());
+
+    auto writer = std::make_shared<DocumentWriter>(filename, width(), height(), thread_count);
+    for (const Layer& layer : m_layers) {
+        writer->add_layer(document_layer_info(layer));
+
+        for (int y = 0; y < layer.tiles_y(); y++) {
+            for (int x = 0; x < layer.tiles_x(); x++) {
+                add_layer_tile(writer, layer, { x, y }, m_readback_queue);
+            }
+        }
+    }
+
+    writer->start();
+    return writer;
 }
 
+std::optional<Layer::Id> Canvas::open_document(const std::string& filename) {
+    Document document = read_document(filename);
+    if (document.width != width() || document.height != height()) {
+        throw std::runtime_error(std::format("{} is {}x{}, but the canvas is {}x{}",
+            filename, document.width, document.height, width(), height()));
+    }
+
+    std::vector<Layer> layers;
+    for (const DocumentLayer& document_layer : document.layers) {
+        const DocumentLayerInfo& info = document_layer.info;
+        Layer layer(width(), height(), m_tile_atlases[size_t(info.format)]);
+        layer.set_name(info.name);
+        layer.set_visible(info.is_visible);
+        layer.set_alpha_lock(info.is_alpha_locked);
+        layer.set_tint(info.tint);
+        layer.set_source_file(document.file);
+
+        // Masks only store coverage, which needs no converting.
+        bool is_straight = !document.is_premultiplied && info.format != PixelFormat::R8;
+        for (const DocumentTile& document_tile : document_layer.tiles) {
+            Layer::Tile tile;
+            if (document_tile.is_solid) {
+                tile.kind = Layer::Tile::Kind::Solid;
+                tile.color = is_straight ? premultiply_legacy_color(document_tile.color) : document_tile.color;
+            } else if (is_straight) {
+                tile.kind = Layer::Tile::Kind::Evicted;
+                tile.compressed = premultiply_legacy_tile(info.format, document_tile.data);
+            } else {
+                tile.kind = Layer::Tile::Kind::Evicted;
+                tile.mapped = document_tile.data;
+            }
+            layer.swap_tile(document_tile.pos, std::move(tile));
+        }
+        layers.push_back(std::move(layer));
+    }
 
+    // Edits to the old layers can't be undone on the new ones.
+    m_history.clear();
+    m_layers = std::move(layers);
+    m_cached_selected_layer = std::nullopt;
+    invalidate_layer_cache();
+    m_is_streaming_document = true;
 
-void Canvas::save_as_png(const char* filename) const {
-    std::vector<uint8_t> pixels;
-    m_output_frame_buffer.get_pixel_data(pixels);
-    stbi_flip_vertically_on_write(true);
-    stbi_write_png(filename, width(), height(), 4, pixels.data(), width() * 4);
+    if (m_layers.empty()) return std::nullopt;
+    return m_layers.back().id();
 }
 
+// Layers are streamed in from the bottom up. Once a layer has no tiles left
+// in the file, it lets go of it.
+void Canvas::stream_document_tiles() {
+    size_t remaining = STREAMED_TILES_PER_TICK;
+    for (Layer& layer : m_layers) {
+        if (layer.source_file() == nullptr) continue;
 
+        // Whatever doesn't fit stays in the file until it is needed.
+        if (tile_bytes_used() + remaining * layer.atlas().bytes_per_tile() > m_residency_manager.budget_bytes()) {
+            m_is_streaming_document = false;
+            return;
+        }
 
+        remaining -= m_residency_manager.make_resident(layer, rect(), remaining);
+        if (remaining == 0) return;
+        layer.detach_source_file();
+    }
+    m_is_streaming_document = false;
+}
+
+size_t Canvas::take_unreadable_tile_count() {
+    size_t count = 0;
+    for (Layer& layer : m_layers) count += layer.take_unreadable_tile_count();
+    return count;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <numbers>
 #include <optional>
@@ -7,6 +8,7 @@
 
 #include "canvas_view.h"
 #include "frame_buffer.h"
+#include "gl_state.h"
 #include "texture.h"
 #include "vao.h"
 
@@ -21,6 +23,7 @@ static size_t INITIAL_WINDOW_HEIGHT = 1;
 
 CanvasView::CanvasView(size_t canvas_width, size_t canvas_height):
     m_frame_buffer(INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT),
+    m_overlay_frame_buffer(INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT),
     m_program("../src/shaders/canvas_view.vert", "../src/shaders/canvas_view.frag")
 {
     m_canvas_width = canvas_width;
@@ -29,6 +32,8 @@ CanvasView::CanvasView(size_t canvas_width, size_t canvas_height):
     m_scale = glm::vec2(1.0, 1.0);
     m_rotation = 0.0;
     m_translation = glm::vec2(0.0, 0.0);
+
+    m_is_transform_dirty = true;
 }
 
 static inline glm::mat3 translate_mat3(const glm::vec2& t) {
@@ -67,8 +72,15 @@ static glm::vec2 fit_canvas_to_screen(glm::vec2 screen_size, glm::vec2 canvas_si
     }
 }
 
-void CanvasView::render(glm::vec2 screen_size, const Texture2D& canvas) {
+void CanvasView::resize(glm::vec2 screen_size) {
+    if (size_t(screen_size.x) == width() && size_t(screen_size.y) == height()) return;
     m_frame_buffer.resize(screen_size.x, screen_size.y);
+    m_overlay_frame_buffer.resize(screen_size.x, screen_size.y);
+    m_is_transform_dirty = true;
+}
+
+bool CanvasView::render(const Texture2D& canvas, bool is_canvas_dirty) {
+    if (!m_is_transform_dirty && !is_canvas_dirty) return false;
 
     m_frame_buffer.bind();
     m_frame_buffer.set_viewport();
@@ -78,22 +90,63 @@ void CanvasView::render(glm::vec2 screen_size, const Texture2D& canvas) {
 
     m_program.use(); 
     m_program.set_uniform_mat3("u_transform", transform);
+    m_program.set_uniform_1f("u_lod", choose_lod(canvas));
 
     canvas.bind_to_0();
     m_program.set_uniform_1i("u_canvas", 0); 
 
     GLuint dummy_vao = VAO::get_dummy();
-    glBindVertexArray(dummy_vao);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-
-    VAO::unbind();
-    Texture2D::unbind();
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays(GL_TRIANGLES, 0, 6);
     FrameBuffer::unbind();
+
+    m_is_transform_dirty = false;
+    return true;
+}
+
+void CanvasView::begin_overlay() {
+    glCopyImageSubData(
+        m_frame_buffer.texture_id(), GL_TEXTURE_2D, 0, 0, 0, 0,
+        m_overlay_frame_buffer.texture_id(), GL_TEXTURE_2D, 0, 0, 0, 0,
+        GLsizei(width()), GLsizei(height()), 1
+    );
+    bind_fbo();
+}
+
+// Picks the mip level of the canvas whose texels are closest in size to a
+// screen pixel. Sampling a finer level when zoomed out both aliases and reads
+// far more memory than it needs to.
+float CanvasView::choose_lod(const Texture2D& canvas) const {
+    float pixels_per_texel = canvas_space_to_screen_space(1.0f);
+    if (pixels_per_texel <= 0.0f) return 0.0f;
+    float lod = -std::log2(pixels_per_texel);
+    return std::clamp(lod, 0.0f, float(canvas.mip_levels() - 1));
+}
+
+Rect CanvasView::visible_canvas_rect(const Texture2D& canvas) const {
+    const glm::vec2 corners[4] = {
+        glm::vec2(0.0f, 0.0f),
+        glm::vec2(width(), 0.0f),
+        glm::vec2(0.0f, height()),
+        glm::vec2(width(), height()),
+    };
+    glm::vec2 min = screen_space_to_canvas_space(corners[0]);
+    glm::vec2 max = min;
+    for (const glm::vec2& corner : corners) {
+        glm::vec2 point = screen_space_to_canvas_space(corner);
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    // A texel at mip level n is built from a 2^n block, and bilinear
+    // filtering reaches one texel further.
+    int padding = 2 << int(std::ceil(choose_lod(canvas)));
+    return Rect(glm::ivec2(glm::floor(min)) - padding, glm::ivec2(glm::ceil(max)) + padding);
 }
 
 void CanvasView::bind_fbo() const {
-    m_frame_buffer.bind();
-    m_frame_buffer.set_viewport();
+    m_overlay_frame_buffer.bind();
+    m_overlay_frame_buffer.set_viewport();
 }
 
 // Transforms from NDC coordinates of full screen in screen space into NDC coordinates of 
@@ -136,7 +189,7 @@ glm::vec2 CanvasView::canvas_space_to_screen_space(glm::vec2 point) const {
     glm::mat3 transform = get_transform();
     glm::vec2 screen_space_ndc = transform * glm::vec3(point_ndc, 1.0f);
     screen_space_ndc.y *= -1.0f;
-    glm::vec2 screen_space_norm = ((screen_space_ndc - 1.0f) / 2.0f);
+    glm::vec2 screen_space_norm = (screen_space_ndc + 1.0f) / 2.0f;
     glm::vec2 screen_space = screen_space_norm * m_frame_buffer.size();
     return screen_space;
 }
@@ -150,6 +203,8 @@ float CanvasView::canvas_space_to_screen_space(float dist) const {
 
 // Zooms into a point defined in screen-space.
 void CanvasView::zoom_into_point(glm::vec2 point, float zoom_factor) {
+    if (zoom_factor == 1.0f) return;
+
     glm::vec2 screen_center = m_frame_buffer.size() * 0.5f;
     glm::vec2 screen_space_offset = screen_center - point;
     glm::vec2 ndc_offset = (screen_space_offset / m_frame_buffer.size()) * 2.0f;
@@ -163,6 +218,7 @@ void CanvasView::zoom_into_point(glm::vec2 point, float zoom_factor) {
     
     m_translation += zoom_offset;
     m_scale *= zoom_factor;
+    m_is_transform_dirty = true;
 
     // TODO: Add a maximum zoom and minimum zoom
     // Min zoom should be something like width is 5% of screen space. 
@@ -192,10 +248,14 @@ void CanvasView::rotate(float delta_radians) {
     );
 
     m_translation = new_translation;
+    m_is_transform_dirty = true;
 }
 
 void CanvasView::set_rotation(float radians) {
-    m_rotation = normalise_angle(radians);
+    float rotation = normalise_angle(radians);
+    if (rotation == m_rotation) return;
+    m_rotation = rotation;
+    m_is_transform_dirty = true;
 }
 
 void CanvasView::move(glm::vec2 translation) {
@@ -204,13 +264,25 @@ void CanvasView::move(glm::vec2 translation) {
         -(translation.y / m_frame_buffer.size().y) * 2.0f
     );
 
+    if (ndc_translation == glm::vec2(0.0f)) return;
     m_translation += ndc_translation;
+    m_is_transform_dirty = true;
+}
+
+void CanvasView::set_view_transform(const ViewTransform& transform) {
+    if (transform == view_transform()) return;
+    m_translation = transform.translation;
+    m_scale = transform.scale;
+    m_rotation = transform.rotation;
+    m_flipped = transform.is_flipped;
+    m_is_transform_dirty = true;
 }
 
 void CanvasView::flip() {
     m_flipped = !m_flipped;
     m_rotation = -m_rotation;
     m_translation.x = -m_translation.x;
+    m_is_transform_dirty = true;
 }
 
 
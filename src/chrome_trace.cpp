@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chrome_trace.h"
+
+int64_t trace_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string escape_json(const std::string& text) {
+    std::string result;
+    for (char c : text) {
+        if (c == '"' || c == '\\') result.push_back('\\');
+        result.push_back(c);
+    }
+    return result;
+}
+
+size_t ChromeTrace::thread(const std::string& name) {
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        if (m_threads[i] == name) return i;
+    }
+    m_threads.push_back(name);
+    return m_threads.size() - 1;
+}
+
+void ChromeTrace::add_event(const std::string& name, size_t thread, int64_t begin_ns, int64_t end_ns) {
+    m_events.push_back(Event{ name, thread, begin_ns, end_ns });
+}
+
+void ChromeTrace::write(const std::string& filename) const {
+    // Times are written in microseconds, relative to the first event, and
+    // every thread belongs to one process.
+    int64_t start_ns = INT64_MAX;
+    for (const Event& event : m_events) start_ns = std::min(start_ns, event.begin_ns);
+
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    const char* separator = "\n";
+    for (size_t i = 0; i < m_threads.size(); i++) {
+        json += std::format("{}{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}}",
+            separator, i, escape_json(m_threads[i]));
+        separator = ",\n";
+    }
+    for (const Event& event : m_events) {
+        json += std::format("{}{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":1,\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}}}",
+            separator,
+            escape_json(event.name),
+            event.thread,
+            (event.begin_ns - start_ns) / 1e3,
+            (event.end_ns - event.begin_ns) / 1e3);
+        separator = ",\n";
+    }
+    json += "\n]}\n";
+
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error(std::format("Failed to open {} for writing", filename));
+    }
+    bool is_written = std::fwrite(json.data(), 1, json.size(), file) == json.size();
+    if (std::fclose(file) != 0 || !is_written) {
+        throw std::runtime_error(std::format("Failed to write {}", filename));
+    }
+}
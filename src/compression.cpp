@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio> // required for stb_image_write.h to work
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "compression.h"
+
+// Part of stb_image_write, but not declared in its header.
+extern "C" unsigned char* stbi_zlib_compress(unsigned char* data, int data_len, int* out_len, int quality);
+
+// The lowest quality stb accepts. We favour speed over ratio, since this runs
+// while the user is painting.
+static const int COMPRESSION_QUALITY = 5;
+
+std::vector<uint8_t> zlib_compress(const uint8_t* data, size_t size) {
+    int out_len = 0;
+    unsigned char* out = stbi_zlib_compress(const_cast<unsigned char*>(data), int(size), &out_len, COMPRESSION_QUALITY);
+    if (out == nullptr) {
+        throw std::runtime_error("Failed to compress data");
+    }
+
+    std::vector<uint8_t> result(out, out + out_len);
+    std::free(out);
+    return result;
+}
+
+std::vector<uint8_t> zlib_decompress(const uint8_t* data, size_t size, size_t expected_size) {
+    int out_len = 0;
+    char* out = stbi_zlib_decode_malloc_guesssize(
+        reinterpret_cast<const char*>(data), int(size), int(expected_size), &out_len);
+    if (out == nullptr || size_t(out_len) != expected_size) {
+        std::free(out);
+        throw std::runtime_error("Failed to decompress data");
+    }
+
+    std::vector<uint8_t> result(expected_size);
+    std::memcpy(result.data(), out, expected_size);
+    std::free(out);
+    return result;
+}
+
+std::vector<uint8_t> zlib_decompress(const std::vector<uint8_t>& data, size_t expected_size) {
+    return zlib_decompress(data.data(), data.size(), expected_size);
+}
+
+namespace {
+
+// Writes deflate's bit stream, which packs bits starting from the least
+// significant bit of each byte.
+class BitWriter {
+    std::vector<uint8_t>& m_out;
+    uint32_t m_bits = 0;
+    int m_bit_count = 0;
+
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+    void write(uint32_t value, int bit_count) {
+        m_bits |= value << m_bit_count;
+        m_bit_count += bit_count;
+        while (m_bit_count >= 8) {
+            m_out.push_back(uint8_t(m_bits));
+            m_bits >>= 8;
+            m_bit_count -= 8;
+        }
+    }
+
+    // Huffman codes are stored most significant bit first.
+    void write_code(uint32_t code, int bit_count) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < bit_count; i++) {
+            reversed = (reversed << 1) | ((code >> i) & 1);
+        }
+        write(reversed, bit_count);
+    }
+
+    void align_to_byte() {
+        if (m_bit_count > 0) write(0, 8 - m_bit_count);
+    }
+};
+
+const std::array<int, 29> LENGTH_BASE = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const std::array<int, 29> LENGTH_EXTRA = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const std::array<int, 30> DISTANCE_BASE = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const std::array<int, 30> DISTANCE_EXTRA = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+const int WINDOW_SIZE = 32768;
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+const int HASH_BITS = 15;
+// How many earlier positions with the same hash are tried for a match. We
+// favour speed over ratio, like stb's lowest quality.
+const int MAX_CHAIN = 8;
+
+// Writes a literal or length symbol with the fixed Huffman code.
+void write_fixed_symbol(BitWriter& writer, int symbol) {
+    if (symbol <= 143) writer.write_code(0x30 + symbol, 8);
+    else if (symbol <= 255) writer.write_code(0x190 + symbol - 144, 9);
+    else if (symbol <= 279) writer.write_code(symbol - 256, 7);
+    else writer.write_code(0xc0 + symbol - 280, 8);
+}
+
+void write_match(BitWriter& writer, int length, int distance) {
+    int length_code = int(std::upper_bound(LENGTH_BASE.begin(), LENGTH_BASE.end(), length) - LENGTH_BASE.begin()) - 1;
+    write_fixed_symbol(writer, 257 + length_code);
+    writer.write(length - LENGTH_BASE[length_code], LENGTH_EXTRA[length_code]);
+
+    int distance_code = int(std::upper_bound(DISTANCE_BASE.begin(), DISTANCE_BASE.end(), distance) - DISTANCE_BASE.begin()) - 1;
+    writer.write_code(distance_code, 5);
+    writer.write(distance - DISTANCE_BASE[distance_code], DISTANCE_EXTRA[distance_code]);
+}
+
+uint32_t hash3(const uint8_t* data) {
+    uint32_t value = uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16);
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+}
+
+// Greedy LZ77 matching with hash chains, coded in a single fixed Huffman
+// block. A part that doesn't end the stream is closed with an empty stored
+// block, which pads it to a whole byte, as zlib's sync flush does.
+void deflate_part(const uint8_t* data, size_t size, bool is_final, std::vector<uint8_t>& out) {
+    BitWriter writer(out);
+    writer.write(is_final ? 1 : 0, 1);
+    writer.write(1, 2);
+
+    std::vector<int32_t> head(size_t(1) << HASH_BITS, -1);
+    std::vector<int32_t> previous(WINDOW_SIZE, -1);
+
+    size_t pos = 0;
+    while (pos < size) {
+        int best_length = 0;
+        int best_distance = 0;
+
+        if (pos + MIN_MATCH <= size) {
+            uint32_t hash = hash3(data + pos);
+            int max_length = int(std::min<size_t>(MAX_MATCH, size - pos));
+            int32_t candidate = head[hash];
+            for (int chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+                int distance = int(pos - candidate);
+                if (distance > WINDOW_SIZE) break;
+
+                int length = 0;
+                while (length < max_length && data[candidate + length] == data[pos + length]) length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = distance;
+                    if (length == max_length) break;
+                }
+                candidate = previous[candidate % WINDOW_SIZE];
+            }
+        }
+
+        size_t advance = best_length >= MIN_MATCH ? best_length : 1;
+        if (best_length >= MIN_MATCH) {
+            write_match(writer, best_length, best_distance);
+        } else {
+            write_fixed_symbol(writer, data[pos]);
+        }
+
+        // Every position we pass goes into the hash chains, so that later
+        // matches can start anywhere.
+        for (size_t end = pos + advance; pos < end; pos++) {
+            if (pos + MIN_MATCH > size) continue;
+            uint32_t hash = hash3(data + pos);
+            previous[pos % WINDOW_SIZE] = head[hash];
+            head[hash] = int32_t(pos);
+        }
+    }
+
+    write_fixed_symbol(writer, 256);
+    if (!is_final) {
+        writer.write(0, 3);
+        writer.align_to_byte();
+        writer.write(0x0000, 16);
+        writer.write(0xffff, 16);
+    }
+    writer.align_to_byte();
+}
+
+const uint32_t ADLER_MODULO = 65521;
+
+uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    // The sums can't overflow within this many bytes, so the modulo is only
+    // taken once per chunk.
+    const size_t CHUNK_SIZE = 5552;
+    while (size > 0) {
+        size_t chunk = std::min(size, CHUNK_SIZE);
+        for (size_t i = 0; i < chunk; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_MODULO;
+        b %= ADLER_MODULO;
+        data += chunk;
+        size -= chunk;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+    uint64_t remainder = second_size % ADLER_MODULO;
+    uint64_t a = (first & 0xffff) + (second & 0xffff) + ADLER_MODULO - 1;
+    uint64_t b = (remainder * (first & 0xffff)) % ADLER_MODULO;
+    b += (first >> 16) + (second >> 16) + ADLER_MODULO - remainder;
+    a %= ADLER_MODULO;
+    b %= ADLER_MODULO;
+    return uint32_t((b << 16) | a);
+}
+
+static std::array<uint32_t, 256> make_crc_table() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc) {
+    static const std::array<uint32_t, 256> table = make_crc_table();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <vector>
+
+#include "dirty_region.h"
+#include "rect.h"
+#include "tile_atlas.h"
+
+static const int CELL_SIZE = TileAtlas::TILE_SIZE;
+
+DirtyRegion::DirtyRegion(size_t width, size_t height)
+    : m_width(int(width)),
+    m_height(int(height))
+{
+    m_cells_x = (m_width + CELL_SIZE - 1) / CELL_SIZE;
+    m_cells_y = (m_height + CELL_SIZE - 1) / CELL_SIZE;
+    m_cells.resize(size_t(m_cells_x) * m_cells_y);
+}
+
+void DirtyRegion::mark(const Rect& rect) {
+    Rect range = cell_range(rect);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            Rect cell_rect(x * CELL_SIZE, y * CELL_SIZE, CELL_SIZE, CELL_SIZE);
+            Rect& cell = m_cells[size_t(y) * m_cells_x + x];
+            cell = cell.united(rect.intersected(cell_rect));
+        }
+    }
+}
+
+Rect DirtyRegion::take(const Rect& region) {
+    Rect taken;
+    Rect range = cell_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            Rect& cell = m_cells[size_t(y) * m_cells_x + x];
+            taken = taken.united(cell);
+            cell = Rect();
+        }
+    }
+    return taken;
+}
+
+bool DirtyRegion::is_empty() const {
+    return std::all_of(m_cells.begin(), m_cells.end(), 
+        [](const Rect& cell) { return cell.is_empty(); });
+}
+
+Rect DirtyRegion::cell_range(const Rect& rect) const {
+    Rect clipped = rect.intersected(Rect(0, 0, m_width, m_height));
+    if (clipped.is_empty()) return Rect();
+    glm::ivec2 min = clipped.min / CELL_SIZE;
+    glm::ivec2 max = (clipped.max + (CELL_SIZE - 1)) / CELL_SIZE;
+    return Rect(min, max);
+}
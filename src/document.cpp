@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "byte_io.h"
+#include "compression.h"
+#include "document.h"
+#include "layer.h"
+#include "mapped_file.h"
+#include "pixel_format.h"
+#include "readback.h"
+#include "tile_atlas.h"
+
+static const char DOCUMENT_MAGIC[4] = { 'B', 'R', 'S', 'H' };
+static const uint32_t DOCUMENT_VERSION = 2;
+// Older versions that can still be opened.
+static const uint32_t STRAIGHT_ALPHA_VERSION = 1;
+static const size_t HEADER_SIZE = 40;
+
+enum DocumentTileKind : uint8_t { TILE_SOLID, TILE_DATA };
+
+Document read_document(const std::string& filename) {
+    auto file = std::make_shared<const MappedFile>(filename);
+    if (file->size() < HEADER_SIZE || std::memcmp(file->bytes(0, 4).data(), DOCUMENT_MAGIC, 4) != 0) {
+        throw std::runtime_error(std::format("{} is not a brush document", filename));
+    }
+
+    ByteReader header(file->bytes(4, HEADER_SIZE - 4), filename);
+    uint32_t version = header.u32();
+    if (version != DOCUMENT_VERSION && version != STRAIGHT_ALPHA_VERSION) {
+        throw std::runtime_error(std::format("{} has unsupported version {}", filename, version));
+    }
+
+    Document document;
+    document.is_premultiplied = version != STRAIGHT_ALPHA_VERSION;
+    document.width = header.u32();
+    document.height = header.u32();
+    uint32_t tile_size = header.u32();
+    if (tile_size != TileAtlas::TILE_SIZE) {
+        throw std::runtime_error(std::format("{} uses {}px tiles, but only {}px are supported",
+            filename, tile_size, TileAtlas::TILE_SIZE));
+    }
+    uint32_t layer_count = header.u32();
+    uint64_t index_offset = header.u64();
+    uint64_t index_size = header.u64();
+
+    uint32_t tiles_x = uint32_t((document.width + tile_size - 1) / tile_size);
+    uint32_t tiles_y = uint32_t((document.height + tile_size - 1) / tile_size);
+
+    ByteReader index(file->bytes(index_offset, index_size), filename);
+    for (uint32_t i = 0; i < layer_count; i++) {
+        DocumentLayer layer;
+        std::span<const uint8_t> name = index.bytes(index.u32());
+        layer.info.name = std::string(name.begin(), name.end());
+
+        uint8_t format = index.u8();
+        if (format >= PIXEL_FORMAT_COUNT) {
+            throw std::runtime_error(std::format("{} is truncated or corrupt", filename));
+        }
+        layer.info.format = PixelFormat(format);
+        layer.info.is_visible = index.u8() != 0;
+        layer.info.is_alpha_locked = index.u8() != 0;
+        index.u8();
+        for (int c = 0; c < 3; c++) layer.info.tint[c] = index.f32();
+
+        uint32_t tile_count = index.u32();
+        for (uint32_t t = 0; t < tile_count; t++) {
+            DocumentTile tile{};
+            uint32_t x = index.u32();
+            uint32_t y = index.u32();
+            uint8_t kind = index.u8();
+            if (x >= tiles_x || y >= tiles_y || kind > TILE_DATA) {
+                throw std::runtime_error(std::format("{} is truncated or corrupt", filename));
+            }
+            tile.pos = glm::ivec2(x, y);
+
+            if (kind == TILE_SOLID) {
+                tile.is_solid = true;
+                for (int c = 0; c < 4; c++) tile.color[c] = index.f32();
+            } else {
+                uint64_t offset = index.u64();
+                uint64_t size = index.u64();
+                tile.data = file->bytes(offset, size);
+            }
+            layer.tiles.push_back(tile);
+        }
+        document.layers.push_back(std::move(layer));
+    }
+
+    document.file = std::move(file);
+    return document;
+}
+
+glm::vec4 premultiply_legacy_color(glm::vec4 color) {
+    return glm::vec4(glm::vec3(color.r, color.g, color.b) * color.a, color.a);
+}
+
+std::vector<uint8_t> premultiply_legacy_tile(PixelFormat format, std::span<const uint8_t> data) {
+    std::vector<uint8_t> texels = zlib_decompress(data.data(), data.size(), TileAtlas::PIXELS_PER_TILE * bytes_per_pixel(format));
+    if (format == PixelFormat::RGBA8) {
+        for (size_t i = 0; i < texels.size(); i += 4) {
+            unsigned alpha = texels[i + 3];
+            for (size_t c = 0; c < 3; c++) texels[i + c] = uint8_t((texels[i + c] * alpha + 127) / 255);
+        }
+    } else if (format == PixelFormat::RGBA16F) {
+        for (size_t i = 0; i < texels.size(); i += 8) {
+            uint16_t halves[4];
+            std::memcpy(halves, &texels[i], 8);
+            float alpha = glm::unpackHalf1x16(halves[3]);
+            for (size_t c = 0; c < 3; c++) halves[c] = glm::packHalf1x16(glm::unpackHalf1x16(halves[c]) * alpha);
+            std::memcpy(&texels[i], halves, 8);
+        }
+    }
+    return zlib_compress(texels.data(), texels.size());
+}
+
+DocumentWriter::DocumentWriter(std::string filename, size_t width, size_t height, size_t thread_count)
+    : m_filename(std::move(filename)),
+    m_width(width),
+    m_height(height),
+    m_data_tile_count(0),
+    m_undelivered_tiles(0),
+    m_tiles_written(0),
+    m_bytes_written(0),
+    m_is_started(false),
+    m_is_cancelled(false),
+    m_file(nullptr),
+    m_file_end(0),
+    m_is_finished(false),
+    m_stats{}
+{
+    m_temp_filename = m_filename + ".tmp";
+    m_thread_count = thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+}
+
+DocumentWriter::~DocumentWriter() {
+    // Nothing can deliver the missing tiles anymore, since their readbacks
+    // hold on to the writer.
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_undelivered_tiles > 0 && !m_is_cancelled) {
+            m_is_cancelled = true;
+            if (!m_error.has_value()) m_error = "Document save was cancelled";
+        }
+    }
+    m_job_ready.notify_all();
+
+    if (m_writer.joinable()) {
+        m_writer.join();
+    }
+}
+
+void DocumentWriter::add_layer(const DocumentLayerInfo& info) {
+    m_layers.push_back(LayerRecord{ info, {} });
+}
+
+void DocumentWriter::add_solid_tile(glm::ivec2 pos, glm::vec4 color) {
+    m_layers.back().tiles.push_back(DocumentTileRecord{ pos, true, color, 0, 0 });
+}
+
+void DocumentWriter::add_compressed_tile(glm::ivec2 pos, std::vector<uint8_t> compressed) {
+    m_layers.back().tiles.push_back(DocumentTileRecord{ pos, false, glm::vec4(0.0f), 0, 0 });
+    m_data_tile_count++;
+    push_job(Job{ m_layers.size() - 1, m_layers.back().tiles.size() - 1, std::move(compressed), true, {} });
+}
+
+void DocumentWriter::add_mapped_tile(glm::ivec2 pos, std::span<const uint8_t> compressed, std::shared_ptr<const MappedFile> file) {
+    if (std::find(m_mapped_files.begin(), m_mapped_files.end(), file) == m_mapped_files.end()) {
+        m_mapped_files.push_back(std::move(file));
+    }
+
+    m_layers.back().tiles.push_back(DocumentTileRecord{ pos, false, glm::vec4(0.0f), 0, 0 });
+    m_data_tile_count++;
+    push_job(Job{ m_layers.size() - 1, m_layers.back().tiles.size() - 1, {}, true, compressed });
+}
+
+size_t DocumentWriter::add_pending_tile(glm::ivec2 pos) {
+    m_layers.back().tiles.push_back(DocumentTileRecord{ pos, false, glm::vec4(0.0f), 0, 0 });
+    m_data_tile_count++;
+    m_pending_tiles.emplace_back(m_layers.size() - 1, m_layers.back().tiles.size() - 1);
+
+    std::lock_guard lock(m_mutex);
+    m_undelivered_tiles++;
+    return m_pending_tiles.size() - 1;
+}
+
+void DocumentWriter::deliver_tile(size_t pending_id, std::vector<uint8_t>&& texels) {
+    auto [layer, tile] = m_pending_tiles[pending_id];
+    {
+        std::lock_guard lock(m_mutex);
+        m_jobs.push_back(Job{ layer, tile, std::move(texels), false, {} });
+        m_undelivered_tiles--;
+    }
+    m_job_ready.notify_all();
+}
+
+void DocumentWriter::add_existing_tile(glm::ivec2 pos, uint64_t offset, uint64_t size) {
+    m_layers.back().tiles.push_back(DocumentTileRecord{ pos, false, glm::vec4(0.0f), offset, size });
+}
+
+void DocumentWriter::push_job(Job job) {
+    {
+        std::lock_guard lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_job_ready.notify_all();
+}
+
+void DocumentWriter::start() {
+    if (m_is_started) return;
+    m_is_started = true;
+    m_writer = std::thread(&DocumentWriter::write_file, this);
+}
+
+float DocumentWriter::progress() const {
+    if (m_data_tile_count == 0) return m_is_finished ? 1.0f : 0.0f;
+    return float(m_tiles_written) / m_data_tile_count;
+}
+
+void DocumentWriter::fail(const std::string& message) {
+    {
+        std::lock_guard lock(m_mutex);
+        if (!m_error.has_value()) m_error = message;
+        m_is_cancelled = true;
+    }
+    m_job_ready.notify_all();
+}
+
+static void write_bytes(FILE* file, const void* data, size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+        throw std::runtime_error("Failed to write document");
+    }
+}
+
+// Documents can be larger than a `long` can address on Windows.
+static void seek(FILE* file, uint64_t offset) {
+#if defined(_WIN32)
+    int result = _fseeki64(file, int64_t(offset), SEEK_SET);
+#else
+    int result = fseeko(file, off_t(offset), SEEK_SET);
+#endif
+    if (result != 0) {
+        throw std::runtime_error("Failed to write document");
+    }
+}
+
+void DocumentWriter::write_file() {
+    auto start_time = std::chrono::steady_clock::now();
+    bool is_append = m_append_offset.has_value();
+
+    try {
+        if (is_append) {
+            // Everything up to the old end stays as it is, so the old header
+            // and index remain valid until the new header is written.
+            m_file = std::fopen(m_filename.c_str(), "r+b");
+            if (m_file == nullptr) {
+                throw std::runtime_error(std::format("Failed to open {} for writing", m_filename));
+            }
+            m_file_end = m_append_offset.value();
+            seek(m_file, m_file_end);
+        } else {
+            m_file = std::fopen(m_temp_filename.c_str(), "wb");
+            if (m_file == nullptr) {
+                throw std::runtime_error(std::format("Failed to open {} for writing", m_temp_filename));
+            }
+            // The header is only known at the end, so we leave room for it.
+            std::vector<uint8_t> placeholder(HEADER_SIZE, 0);
+            write_bytes(m_file, placeholder.data(), placeholder.size());
+            m_file_end = HEADER_SIZE;
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < m_thread_count; i++) {
+            workers.emplace_back(&DocumentWriter::write_tiles, this);
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        {
+            std::lock_guard lock(m_mutex);
+            if (m_is_cancelled) throw std::runtime_error(m_error.value_or("Document save was cancelled"));
+        }
+
+        std::vector<uint8_t> index = encode_index();
+        uint64_t index_offset = m_file_end;
+        write_bytes(m_file, index.data(), index.size());
+        m_file_end += index.size();
+        m_bytes_written += index.size();
+        // The index must be on disk before the header points at it.
+        if (std::fflush(m_file) != 0) {
+            throw std::runtime_error("Failed to write document");
+        }
+
+        std::vector<uint8_t> header;
+        header.insert(header.end(), DOCUMENT_MAGIC, DOCUMENT_MAGIC + 4);
+        put_u32(header, DOCUMENT_VERSION);
+        put_u32(header, uint32_t(m_width));
+        put_u32(header, uint32_t(m_height));
+        put_u32(header, uint32_t(TileAtlas::TILE_SIZE));
+        put_u32(header, uint32_t(m_layers.size()));
+        put_u64(header, index_offset);
+        put_u64(header, index.size());
+        seek(m_file, 0);
+        write_bytes(m_file, header.data(), header.size());
+        if (!is_append) m_bytes_written += header.size();
+
+        FILE* file = std::exchange(m_file, nullptr);
+        if (std::fclose(file) != 0) {
+            throw std::runtime_error("Failed to write document");
+        }
+
+        if (!is_append) {
+            std::error_code error;
+            std::filesystem::rename(m_temp_filename, m_filename, error);
+            if (error) {
+                throw std::runtime_error(std::format("Failed to replace {}: {}", m_filename, error.message()));
+            }
+        }
+    } catch (const std::exception& e) {
+        if (m_file != nullptr) std::fclose(std::exchange(m_file, nullptr));
+        if (!is_append) {
+            std::error_code ignored;
+            std::filesystem::remove(m_temp_filename, ignored);
+        }
+
+        std::lock_guard lock(m_mutex);
+        if (!m_error.has_value()) m_error = e.what();
+        m_is_cancelled = true;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    m_stats = DocumentSaveStats{ m_tiles_written, size_t(m_bytes_written), elapsed.count() };
+    // Tiles copied out of other documents have all been written by now.
+    m_mapped_files.clear();
+    m_is_finished = true;
+}
+
+std::vector<uint8_t> DocumentWriter::encode_index() const {
+    std::vector<uint8_t> index;
+    for (const LayerRecord& layer : m_layers) {
+        put_u32(index, uint32_t(layer.info.name.size()));
+        index.insert(index.end(), layer.info.name.begin(), layer.info.name.end());
+        put_u8(index, uint8_t(layer.info.format));
+        put_u8(index, layer.info.is_visible ? 1 : 0);
+        put_u8(index, layer.info.is_alpha_locked ? 1 : 0);
+        put_u8(index, 0);
+        for (int c = 0; c < 3; c++) put_f32(index, layer.info.tint[c]);
+
+        put_u32(index, uint32_t(layer.tiles.size()));
+        for (const DocumentTileRecord& tile : layer.tiles) {
+            put_u32(index, uint32_t(tile.pos.x));
+            put_u32(index, uint32_t(tile.pos.y));
+            if (tile.is_solid) {
+                put_u8(index, TILE_SOLID);
+                for (int c = 0; c < 4; c++) put_f32(index, tile.color[c]);
+            } else {
+                put_u8(index, TILE_DATA);
+                put_u64(index, tile.offset);
+                put_u64(index, tile.size);
+            }
+        }
+    }
+    return index;
+}
+
+// Runs on each worker thread until every tile has been written.
+void DocumentWriter::write_tiles() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_job_ready.wait(lock, [&] { return !m_jobs.empty() || m_undelivered_tiles == 0 || m_is_cancelled; });
+            if (m_is_cancelled || m_jobs.empty()) return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        try {
+            write_tile(job);
+        } catch (const std::exception& e) {
+            fail(e.what());
+            return;
+        }
+        m_tiles_written++;
+    }
+}
+
+// Compression happens in parallel, and only the append to the file is
+// serialized.
+void DocumentWriter::write_tile(Job& job) {
+    if (!job.is_compressed) {
+        job.data = zlib_compress(job.data.data(), job.data.size());
+    }
+    std::span<const uint8_t> data = job.mapped.empty() ? std::span<const uint8_t>(job.data) : job.mapped;
+
+    std::lock_guard lock(m_file_mutex);
+    write_bytes(m_file, data.data(), data.size());
+
+    DocumentTileRecord& tile = m_layers[job.layer].tiles[job.tile];
+    tile.offset = m_file_end;
+    tile.size = data.size();
+    m_file_end += data.size();
+    m_bytes_written += data.size();
+}
+
+DocumentLayerInfo document_layer_info(const Layer& layer) {
+    return DocumentLayerInfo{
+        layer.name(),
+        layer.format(),
+        layer.is_visible(),
+        layer.is_alpha_locked(),
+        layer.tint(),
+    };
+}
+
+void add_layer_tile(const std::shared_ptr<DocumentWriter>& writer, const Layer& layer, glm::ivec2 pos, ReadbackQueue& queue) {
+    const Layer::Tile& tile = layer.tile(pos);
+    switch (tile.kind) {
+        case Layer::Tile::Kind::Empty:
+            break;
+        case Layer::Tile::Kind::Solid:
+            writer->add_solid_tile(pos, tile.color);
+            break;
+        case Layer::Tile::Kind::Evicted:
+            if (!tile.mapped.empty()) {
+                writer->add_mapped_tile(pos, tile.mapped, layer.source_file());
+            } else {
+                writer->add_compressed_tile(pos, tile.compressed);
+            }
+            break;
+        case Layer::Tile::Kind::Allocated: {
+            size_t pending_id = writer->add_pending_tile(pos);
+            layer.atlas().read_slot_async(tile.slot, queue,
+                [writer, pending_id](std::vector<uint8_t>&& texels) {
+                    writer->deliver_tile(pending_id, std::move(texels));
+                });
+            break;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#include <utility>
+#include <vector>
+
+#include "frame_buffer.h"
+#include "frame_buffer_pool.h"
+
+FrameBufferPool::FrameBufferPool(size_t max_bytes)
+    : m_max_bytes(max_bytes), m_allocated_count(0), m_reused_count(0) {}
+
+FrameBuffer FrameBufferPool::acquire(size_t width, size_t height, bool is_mipmapped) {
+    // The most recently released match is the most likely to still be
+    // resident in VRAM.
+    for (size_t i = m_frame_buffers.size(); i > 0; i--) {
+        const FrameBuffer& candidate = m_frame_buffers[i - 1];
+        if (candidate.width() != width || candidate.height() != height) continue;
+        if (candidate.texture().is_mipmapped() != is_mipmapped) continue;
+
+        FrameBuffer frame_buffer = std::move(m_frame_buffers[i - 1]);
+        m_frame_buffers.erase(m_frame_buffers.begin() + (i - 1));
+        m_reused_count++;
+        return frame_buffer;
+    }
+
+    m_allocated_count++;
+    return FrameBuffer(width, height, is_mipmapped);
+}
+
+void FrameBufferPool::release(FrameBuffer frame_buffer) {
+    m_frame_buffers.push_back(std::move(frame_buffer));
+
+    size_t bytes = pooled_bytes();
+    while (bytes > m_max_bytes && !m_frame_buffers.empty()) {
+        bytes -= m_frame_buffers.front().texture().bytes();
+        m_frame_buffers.erase(m_frame_buffers.begin());
+    }
+}
+
+size_t FrameBufferPool::pooled_bytes() const {
+    size_t bytes = 0;
+    for (const FrameBuffer& frame_buffer : m_frame_buffers) bytes += frame_buffer.texture().bytes();
+    return bytes;
+}
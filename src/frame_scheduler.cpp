@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <optional>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <timeapi.h>
+#endif
+
+#include <glfw/glfw3.h>
+
+#include "frame_scheduler.h"
+
+// How long to keep ticking at the input rate after the last input event.
+static const double ACTIVE_GRACE_PERIOD = 0.25;
+// How many display frames to render after input, so that ImGui's one-frame
+// delayed widgets (hover, popups, etc.) end up in a consistent state.
+static const int DISPLAY_FRAMES_AFTER_INPUT = 3;
+
+FrameScheduler::FrameScheduler(double input_fps, double display_fps) {
+    m_input_dt = 1.0 / input_fps;
+    m_display_dt = 1.0 / display_fps;
+
+    m_next_input_time = 0.0;
+    m_next_display_time = 0.0;
+    m_active_until = 0.0;
+    m_is_held_active = false;
+    m_wake_time = std::nullopt;
+    m_pending_display_frames = DISPLAY_FRAMES_AFTER_INPUT;
+
+#if defined(_WIN32)
+    // By default, Windows only wakes sleeping threads every ~16ms, which is
+    // far too coarse for a 120Hz input clock.
+    timeBeginPeriod(1);
+#endif
+}
+
+FrameScheduler::~FrameScheduler() {
+#if defined(_WIN32)
+    timeEndPeriod(1);
+#endif
+}
+
+double FrameScheduler::wait_for_next_tick() {
+    // Never sample input faster than the input rate. Events that arrive in
+    // the meantime are queued up and handled on the next tick.
+    bool has_waited = wait_until(m_next_input_time);
+
+    double now = glfwGetTime();
+    if (!is_active(now)) {
+        if (m_pending_display_frames > 0) {
+            has_waited |= wait_until(m_next_display_time);
+        } else if (m_wake_time.has_value()) {
+            glfwWaitEventsTimeout(std::max(0.0, m_wake_time.value() - now));
+            has_waited = true;
+        } else {
+            // Fully idle: sleep until the OS has something for us.
+            glfwWaitEvents();
+            has_waited = true;
+        }
+    }
+
+    // A tick that ran past the input interval leaves nothing to wait for,
+    // but the OS still needs its events pumped, or a mouse release could be
+    // missed and the window would be reported as not responding.
+    if (!has_waited) glfwPollEvents();
+
+    now = glfwGetTime();
+    m_next_input_time = now + m_input_dt;
+    return now;
+}
+
+bool FrameScheduler::wait_until(double time) {
+    bool has_waited = false;
+    double remaining = time - glfwGetTime();
+    while (remaining > 0.0) {
+        glfwWaitEventsTimeout(remaining);
+        has_waited = true;
+        remaining = time - glfwGetTime();
+    }
+    return has_waited;
+}
+
+void FrameScheduler::notify_input(double now) {
+    m_active_until = now + ACTIVE_GRACE_PERIOD;
+    invalidate(DISPLAY_FRAMES_AFTER_INPUT);
+}
+
+void FrameScheduler::invalidate(int frames) {
+    m_pending_display_frames = std::max(m_pending_display_frames, frames);
+}
+
+// We allow frames slightly early, since if we wait until after the target dt
+// we miss the next "frame cycle" and end up rendering at half the rate.
+bool FrameScheduler::is_display_frame_due(double now) const {
+    return m_pending_display_frames > 0 && now >= m_next_display_time - m_display_dt * 0.1;
+}
+
+void FrameScheduler::on_display_frame(double now) {
+    m_pending_display_frames = std::max(0, m_pending_display_frames - 1);
+    m_next_display_time = now + m_display_dt;
+}
@@ -0,0 +1,88 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chrome_trace.h"
+#include "frame_tracer.h"
+
+FrameTracer::FrameTracer() : m_is_tracing(false) {}
+
+size_t FrameTracer::find_zone(const char* name) {
+    for (size_t i = 0; i < m_zones.size(); i++) {
+        if (m_zones[i].name == name || std::strcmp(m_zones[i].name, name) == 0) return i;
+    }
+    m_zones.push_back(Zone{ name, {}, 0, 0 });
+    return m_zones.size() - 1;
+}
+
+void FrameTracer::record(size_t zone_index, int64_t begin_ns, int64_t end_ns) {
+    Zone& zone = m_zones[zone_index];
+    int64_t duration_ns = std::max<int64_t>(end_ns - begin_ns, 0);
+    double micros = duration_ns / 1e3;
+    size_t bucket = 0;
+    if (micros > 1.0) {
+        bucket = std::min(size_t(std::log2(micros) * BUCKETS_PER_DOUBLING), BUCKET_COUNT - 1);
+    }
+    zone.buckets[bucket]++;
+    zone.count++;
+    zone.max_ns = std::max(zone.max_ns, duration_ns);
+
+    if (m_is_tracing) m_trace.push_back(TraceEvent{ zone_index, begin_ns, end_ns });
+}
+
+double FrameTracer::bucket_upper_bound_ms(size_t bucket) const {
+    return std::exp2(double(bucket + 1) / BUCKETS_PER_DOUBLING) / 1e3;
+}
+
+std::vector<TraceZoneStats> FrameTracer::stats() const {
+    std::vector<TraceZoneStats> result;
+    for (const Zone& zone : m_zones) {
+        double max_ms = zone.max_ns / 1e6;
+        // The smallest duration that at least `p` percent of samples are under.
+        auto percentile = [&](double p) {
+            uint64_t target = uint64_t(std::ceil(p / 100.0 * zone.count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKET_COUNT; i++) {
+                seen += zone.buckets[i];
+                if (seen >= target) return std::min(bucket_upper_bound_ms(i), max_ms);
+            }
+            return max_ms;
+        };
+        result.push_back(TraceZoneStats{
+            zone.name,
+            zone.count,
+            percentile(50),
+            percentile(95),
+            percentile(99),
+            max_ms,
+        });
+    }
+    return result;
+}
+
+void FrameTracer::reset_histograms() {
+    for (Zone& zone : m_zones) {
+        zone.buckets.fill(0);
+        zone.count = 0;
+        zone.max_ns = 0;
+    }
+}
+
+void FrameTracer::start_trace() {
+    m_trace.clear();
+    m_is_tracing = true;
+}
+
+void FrameTracer::stop_trace(ChromeTrace& trace) {
+    if (!m_is_tracing) return;
+    m_is_tracing = false;
+
+    size_t thread = trace.thread("Main thread");
+    for (const TraceEvent& event : m_trace) {
+        trace.add_event(m_zones[event.zone].name, thread, event.begin_ns, event.end_ns);
+    }
+    m_trace.clear();
+}
@@ -0,0 +1,168 @@
+#include <array>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "gl_state.h"
+
+// An empty optional means the binding is unknown, so the next bind must
+// reach the driver.
+typedef std::optional<GLuint> Binding;
+
+struct TextureUnit {
+    Binding texture_2d;
+    Binding texture_2d_array;
+};
+
+struct Shadow {
+    Binding framebuffer;
+    Binding program;
+    Binding vertex_array;
+    std::optional<size_t> active_unit;
+    std::array<TextureUnit, GlState::TRACKED_TEXTURE_UNITS> units;
+    std::vector<std::pair<GLenum, Binding>> buffers;
+    GlStateCounts counts;
+};
+
+static Shadow& shadow() {
+    static Shadow state;
+    return state;
+}
+
+// Returns whether the binding changed, in which case the caller must make
+// the GL call.
+static bool update(Binding& binding, GLuint id) {
+    Shadow& state = shadow();
+    if (binding == id) {
+        state.counts.skipped_changes++;
+        return false;
+    }
+    binding = id;
+    state.counts.state_changes++;
+    return true;
+}
+
+static Binding* texture_binding(size_t unit, GLenum target) {
+    if (unit >= GlState::TRACKED_TEXTURE_UNITS) return nullptr;
+    TextureUnit& texture_unit = shadow().units[unit];
+    if (target == GL_TEXTURE_2D) return &texture_unit.texture_2d;
+    if (target == GL_TEXTURE_2D_ARRAY) return &texture_unit.texture_2d_array;
+    return nullptr;
+}
+
+static Binding& buffer_binding(GLenum target) {
+    auto& buffers = shadow().buffers;
+    for (auto& [buffer_target, binding] : buffers) {
+        if (buffer_target == target) return binding;
+    }
+    buffers.emplace_back(target, std::nullopt);
+    return buffers.back().second;
+}
+
+void GlState::bind_framebuffer(GLuint id) {
+    if (update(shadow().framebuffer, id)) glBindFramebuffer(GL_FRAMEBUFFER, id);
+}
+
+void GlState::use_program(GLuint id) {
+    if (update(shadow().program, id)) glUseProgram(id);
+}
+
+void GlState::bind_vertex_array(GLuint id) {
+    if (update(shadow().vertex_array, id)) glBindVertexArray(id);
+}
+
+void GlState::active_texture(size_t unit) {
+    Shadow& state = shadow();
+    if (state.active_unit == unit) {
+        state.counts.skipped_changes++;
+        return;
+    }
+    state.active_unit = unit;
+    state.counts.state_changes++;
+    glActiveTexture(GL_TEXTURE0 + GLenum(unit));
+}
+
+void GlState::bind_texture(GLenum target, GLuint id) {
+    Shadow& state = shadow();
+    Binding* binding = state.active_unit.has_value() ? texture_binding(state.active_unit.value(), target) : nullptr;
+    if (binding == nullptr) {
+        state.counts.state_changes++;
+        glBindTexture(target, id);
+    } else if (update(*binding, id)) {
+        glBindTexture(target, id);
+    }
+}
+
+void GlState::bind_texture_to(size_t unit, GLenum target, GLuint id) {
+    // Skipping the bind also skips switching units.
+    Binding* binding = texture_binding(unit, target);
+    if (binding != nullptr && binding->has_value() && binding->value() == id) {
+        shadow().counts.skipped_changes++;
+        return;
+    }
+    active_texture(unit);
+    bind_texture(target, id);
+}
+
+void GlState::bind_buffer(GLenum target, GLuint id) {
+    if (update(buffer_binding(target), id)) glBindBuffer(target, id);
+}
+
+void GlState::bind_buffer_base(GLenum target, GLuint index, GLuint id) {
+    shadow().counts.state_changes++;
+    glBindBufferBase(target, index, id);
+    buffer_binding(target) = id;
+}
+
+void GlState::draw_arrays(GLenum mode, GLint first, GLsizei count) {
+    shadow().counts.draw_calls++;
+    glDrawArrays(mode, first, count);
+}
+
+void GlState::draw_arrays_instanced(GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+    shadow().counts.draw_calls++;
+    glDrawArraysInstanced(mode, first, count, instances);
+}
+
+void GlState::dispatch_compute(GLuint groups_x, GLuint groups_y, GLuint groups_z) {
+    shadow().counts.dispatches++;
+    glDispatchCompute(groups_x, groups_y, groups_z);
+}
+
+void GlState::forget_framebuffer(GLuint id) {
+    Shadow& state = shadow();
+    if (state.framebuffer == id) state.framebuffer = 0;
+}
+
+// A deleted program stays in use until another one is, so its name can't
+// be trusted either way.
+void GlState::forget_program(GLuint id) {
+    Shadow& state = shadow();
+    if (state.program == id) state.program = std::nullopt;
+}
+
+void GlState::forget_texture(GLuint id) {
+    for (TextureUnit& unit : shadow().units) {
+        if (unit.texture_2d == id) unit.texture_2d = 0;
+        if (unit.texture_2d_array == id) unit.texture_2d_array = 0;
+    }
+}
+
+void GlState::forget_buffer(GLuint id) {
+    for (auto& [target, binding] : shadow().buffers) {
+        if (binding == id) binding = 0;
+    }
+}
+
+void GlState::invalidate() {
+    Shadow& state = shadow();
+    GlStateCounts counts = state.counts;
+    state = Shadow();
+    state.counts = counts;
+}
+
+GlStateCounts GlState::take_counts() {
+    return std::exchange(shadow().counts, GlStateCounts());
+}
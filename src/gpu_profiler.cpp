@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "chrome_trace.h"
+#include "gpu_profiler.h"
+
+GpuProfiler::GpuProfiler()
+    : m_current_frame(0),
+    m_is_enabled(true),
+    m_is_tracing(false),
+    m_dropped_frames(0) {}
+
+GpuProfiler::~GpuProfiler() {
+    for (Frame& frame : m_frames) {
+        if (!frame.queries.empty()) glDeleteQueries(GLsizei(frame.queries.size()), frame.queries.data());
+    }
+}
+
+void GpuProfiler::begin_frame() {
+    // Oldest first, ending with the frame that just ended.
+    for (size_t i = 1; i <= FRAMES_IN_FLIGHT; i++) {
+        Frame& frame = m_frames[(m_current_frame + i) % FRAMES_IN_FLIGHT];
+        if (frame.is_pending && is_frame_available(frame)) collect_frame(frame);
+    }
+
+    m_current_frame = (m_current_frame + 1) % FRAMES_IN_FLIGHT;
+    Frame& frame = m_frames[m_current_frame];
+    if (frame.is_pending) m_dropped_frames++;
+    frame.zones.clear();
+    frame.used_queries = 0;
+    frame.is_pending = false;
+
+    // Only traces need the GPU clock, and reading it can be slow.
+    if (m_is_enabled && m_is_tracing) sync_clocks(frame);
+}
+
+void GpuProfiler::finish() {
+    glFinish();
+    for (size_t i = 1; i <= FRAMES_IN_FLIGHT; i++) {
+        Frame& frame = m_frames[(m_current_frame + i) % FRAMES_IN_FLIGHT];
+        if (frame.is_pending) collect_frame(frame);
+    }
+}
+
+std::optional<size_t> GpuProfiler::begin_pass(const char* name) {
+    if (!m_is_enabled) return std::nullopt;
+
+    Frame& frame = m_frames[m_current_frame];
+    Zone zone{ find_pass(name), trace_clock_ns(), 0, take_query(frame), 0 };
+    glQueryCounter(zone.begin_query, GL_TIMESTAMP);
+    frame.zones.push_back(zone);
+    frame.is_pending = true;
+    return frame.zones.size() - 1;
+}
+
+void GpuProfiler::end_pass(std::optional<size_t> zone) {
+    if (!zone.has_value()) return;
+    // Passes must end within the frame they began in.
+    Frame& frame = m_frames[m_current_frame];
+    if (zone.value() >= frame.zones.size()) return;
+
+    GLuint end_query = take_query(frame);
+    glQueryCounter(end_query, GL_TIMESTAMP);
+    frame.zones[zone.value()].end_query = end_query;
+    frame.zones[zone.value()].cpu_end_ns = trace_clock_ns();
+}
+
+void GpuProfiler::sync_clocks(Frame& frame) {
+    GLint64 gpu_now = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpu_now);
+    frame.gpu_to_cpu_ns = trace_clock_ns() - gpu_now;
+}
+
+size_t GpuProfiler::find_pass(const char* name) {
+    for (size_t i = 0; i < m_passes.size(); i++) {
+        if (m_passes[i].name == name) return i;
+    }
+    m_passes.push_back(PassHistory{ name });
+    return m_passes.size() - 1;
+}
+
+GLuint GpuProfiler::take_query(Frame& frame) {
+    if (frame.used_queries == frame.queries.size()) {
+        GLuint query = 0;
+        glGenQueries(1, &query);
+        frame.queries.push_back(query);
+    }
+    return frame.queries[frame.used_queries++];
+}
+
+// Timestamps complete in order, so the frame is done once its last one is.
+bool GpuProfiler::is_frame_available(const Frame& frame) const {
+    if (frame.used_queries == 0) return true;
+    GLint is_available = GL_FALSE;
+    glGetQueryObjectiv(frame.queries[frame.used_queries - 1], GL_QUERY_RESULT_AVAILABLE, &is_available);
+    return is_available == GL_TRUE;
+}
+
+void GpuProfiler::collect_frame(Frame& frame) {
+    std::vector<double> gpu_ms(m_passes.size(), 0.0);
+    std::vector<double> cpu_ms(m_passes.size(), 0.0);
+    std::vector<bool> is_present(m_passes.size(), false);
+
+    for (const Zone& zone : frame.zones) {
+        if (zone.end_query == 0) continue;
+        GLuint64 gpu_begin = 0, gpu_end = 0;
+        glGetQueryObjectui64v(zone.begin_query, GL_QUERY_RESULT, &gpu_begin);
+        glGetQueryObjectui64v(zone.end_query, GL_QUERY_RESULT, &gpu_end);
+
+        gpu_ms[zone.pass] += (gpu_end - gpu_begin) / 1e6;
+        cpu_ms[zone.pass] += (zone.cpu_end_ns - zone.cpu_begin_ns) / 1e6;
+        is_present[zone.pass] = true;
+
+        if (m_is_tracing) {
+            m_trace.push_back(TraceEvent{ zone.pass, false, zone.cpu_begin_ns, zone.cpu_end_ns });
+            m_trace.push_back(TraceEvent{
+                zone.pass,
+                true,
+                int64_t(gpu_begin) + frame.gpu_to_cpu_ns,
+                int64_t(gpu_end) + frame.gpu_to_cpu_ns,
+            });
+        }
+    }
+
+    for (size_t i = 0; i < m_passes.size(); i++) {
+        if (!is_present[i]) continue;
+        PassHistory& pass = m_passes[i];
+        if (pass.gpu_ms.size() < HISTORY_FRAMES) {
+            pass.gpu_ms.push_back(gpu_ms[i]);
+            pass.cpu_ms.push_back(cpu_ms[i]);
+        } else {
+            pass.gpu_ms[pass.next_sample] = gpu_ms[i];
+            pass.cpu_ms[pass.next_sample] = cpu_ms[i];
+        }
+        pass.next_sample = (pass.next_sample + 1) % HISTORY_FRAMES;
+    }
+
+    frame.zones.clear();
+    frame.used_queries = 0;
+    frame.is_pending = false;
+}
+
+std::vector<GpuPassStats> GpuProfiler::stats() const {
+    std::vector<GpuPassStats> result;
+    for (const PassHistory& pass : m_passes) {
+        if (pass.gpu_ms.empty()) continue;
+        GpuPassStats stats{ pass.name, 0.0, 0.0, 0.0, 0.0 };
+        for (size_t i = 0; i < pass.gpu_ms.size(); i++) {
+            stats.average_gpu_ms += pass.gpu_ms[i];
+            stats.average_cpu_ms += pass.cpu_ms[i];
+            stats.max_gpu_ms = std::max(stats.max_gpu_ms, pass.gpu_ms[i]);
+            stats.max_cpu_ms = std::max(stats.max_cpu_ms, pass.cpu_ms[i]);
+        }
+        stats.average_gpu_ms /= pass.gpu_ms.size();
+        stats.average_cpu_ms /= pass.cpu_ms.size();
+        result.push_back(stats);
+    }
+    return result;
+}
+
+void GpuProfiler::start_trace() {
+    m_trace.clear();
+    m_is_tracing = true;
+    sync_clocks(m_frames[m_current_frame]);
+}
+
+void GpuProfiler::stop_trace(ChromeTrace& trace) {
+    if (!m_is_tracing) return;
+    finish();
+    m_is_tracing = false;
+
+    size_t cpu_thread = trace.thread("Main thread");
+    size_t gpu_thread = trace.thread("GPU");
+    for (const TraceEvent& event : m_trace) {
+        trace.add_event(m_passes[event.pass].name, event.is_gpu ? gpu_thread : cpu_thread, event.begin_ns, event.end_ns);
+    }
+    m_trace.clear();
+}
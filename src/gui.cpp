@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdarg>
 #include <cstdio>
 #include <format>
@@ -15,6 +16,8 @@
 #include "brush.h"
 #include "canvas.h"
 #include "conversions.h"
+#include "frame_tracer.h"
+#include "gpu_profiler.h"
 #include "gui.h"
 #include "layer.h"
 #include "user_state.h"
@@ -32,6 +35,12 @@ GUI::GUI(GLFWwindow* window, glm::vec2 canvas_size) {
     m_canvas_display_size = canvas_size;
     m_canvas_window_pos = glm::vec2(0, 0);
     m_canvas_window_size = glm::vec2(0, 0);
+
+    m_new_layer_format = PixelFormat::RGBA8;
+    m_document_path = "untitled.brush";
+    m_is_recording_toggled = false;
+    m_is_trace_toggled = false;
+    m_is_histogram_reset = false;
 }
 
 GUI::~GUI() {
@@ -69,9 +78,10 @@ void GUI::define_interface(
     define_tool_window(tool_manager);
     define_tool_properties_window(tool_manager);
     define_canvas_window(canvas);
-    define_debug_window(debug_state, user_state);
+    define_debug_window(debug_state, user_state, canvas);
     define_error_popup();
     define_layer_window(canvas, user_state.selected_layer);
+    define_file_window(debug_state.document_save_progress);
 }
 
 void GUI::define_color_picker_window(glm::vec3& color) {
@@ -138,7 +148,7 @@ void GUI::define_canvas_window(Canvas& canvas) {
     ImGui::End();
 }
 
-void GUI::define_debug_window(DebugState& debug_state, UserState& user_state) {
+void GUI::define_debug_window(DebugState& debug_state, UserState& user_state, Canvas& canvas) {
     ImGui::Begin("Debug");
     imgui_formatted_label_text("dt", "%.9f", debug_state.dt);
     imgui_formatted_label_text("fps", "%.9f", 1.0 / debug_state.dt);
@@ -147,6 +157,87 @@ void GUI::define_debug_window(DebugState& debug_state, UserState& user_state) {
     imgui_formatted_label_text("selected layer", "%d", user_state.selected_layer.has_value() ? user_state.selected_layer.value() : -1);
     imgui_formatted_label_text("is flipped?", "%s", debug_state.is_flipped ? "true" : "false");
     imgui_formatted_label_text("temp tool?", "%s", user_state.is_using_temp_tool ? "true" : "false");
+    imgui_formatted_label_text("dirty area", "%zu px (%.2f%%)", 
+        debug_state.dirty_area, 
+        100.0 * debug_state.dirty_area / std::max<size_t>(1, debug_state.canvas_area));
+    imgui_formatted_label_text("tile memory", "%.1f / %.1f MB", 
+        debug_state.tile_bytes_used / (1024.0 * 1024.0), 
+        debug_state.tile_bytes_reserved / (1024.0 * 1024.0));
+    imgui_formatted_label_text("layer caches", "%.1f MB (%.1f MB pooled)",
+        debug_state.layer_cache_bytes / (1024.0 * 1024.0),
+        debug_state.pooled_layer_cache_bytes / (1024.0 * 1024.0));
+    imgui_formatted_label_text("frames skipped", "%zu", debug_state.skipped_frames);
+    imgui_formatted_label_text("frames partial", "%zu", debug_state.partial_frames);
+    imgui_formatted_label_text("frames full", "%zu", debug_state.full_frames);
+    imgui_formatted_label_text("draw calls", "%zu (+%zu dispatches)",
+        debug_state.gl_counts.draw_calls,
+        debug_state.gl_counts.dispatches);
+    imgui_formatted_label_text("state changes", "%zu (%zu skipped)",
+        debug_state.gl_counts.state_changes,
+        debug_state.gl_counts.skipped_changes);
+
+    const ResidencyStats& residency = debug_state.residency;
+    int budget_mb = int(residency.budget_bytes / (1024 * 1024));
+    if (ImGui::SliderInt("VRAM budget (MB)", &budget_mb, 16, 8192)) {
+        canvas.set_vram_budget(size_t(budget_mb) * 1024 * 1024);
+    }
+    imgui_formatted_label_text("resident / reserved", "%.1f / %.1f MB",
+        residency.resident_bytes / (1024.0 * 1024.0),
+        debug_state.tile_bytes_reserved / (1024.0 * 1024.0));
+    imgui_formatted_label_text("evicted (compressed)", "%.1f MB", residency.evicted_bytes / (1024.0 * 1024.0));
+    imgui_formatted_label_text("tiles evicted / restored", "%zu / %zu", residency.evicted_tiles, residency.restored_tiles);
+    imgui_formatted_label_text("last eviction", "%.2f ms", residency.last_eviction_ms);
+    imgui_formatted_label_text("last restore", "%.2f ms", residency.last_restore_ms);
+    imgui_formatted_label_text("undo history", "%.1f MB", debug_state.history_bytes / (1024.0 * 1024.0));
+
+    if (debug_state.export_progress.has_value()) {
+        ImGui::ProgressBar(debug_state.export_progress.value(), ImVec2(-1.0f, 0.0f), "Exporting...");
+    }
+    if (debug_state.last_export.has_value()) {
+        const PngExportStats& stats = debug_state.last_export.value();
+        imgui_formatted_label_text("last export", "%.2f s, %.1f MB/s per core (%zu threads)",
+            stats.seconds, stats.megabytes_per_second_per_core(), stats.thread_count);
+    }
+    if (debug_state.last_autosave.has_value()) {
+        const DocumentSaveStats& stats = debug_state.last_autosave.value();
+        imgui_formatted_label_text("last autosave", "%zu tiles, %.1f KB, %.1f ms",
+            stats.tile_count, stats.output_bytes / 1024.0, stats.seconds * 1000.0);
+    }
+    if (debug_state.autosave_error.has_value()) {
+        imgui_formatted_label_text("autosave error", "%s", debug_state.autosave_error.value().c_str());
+    }
+
+    bool is_recording = debug_state.recorded_frames.has_value();
+    if (ImGui::Button(is_recording ? "Stop recording" : "Record strokes")) {
+        m_is_recording_toggled = true;
+    }
+    if (is_recording) {
+        ImGui::SameLine();
+        ImGui::Text("%zu frames", debug_state.recorded_frames.value());
+    }
+
+    bool is_profiling = canvas.gpu_profiler().is_enabled();
+    if (ImGui::Checkbox("Profile passes", &is_profiling)) {
+        canvas.gpu_profiler().set_enabled(is_profiling);
+    }
+    ImGui::SameLine();
+    if (ImGui::Button(debug_state.is_tracing ? "Stop trace" : "Start trace")) {
+        m_is_trace_toggled = true;
+    }
+
+    if (ImGui::Button("Reset")) m_is_histogram_reset = true;
+    ImGui::SameLine();
+    ImGui::Text("p50 / p95 / p99 / max ms");
+    for (const TraceZoneStats& zone : debug_state.frame_zones) {
+        imgui_formatted_label_text(zone.name.c_str(), "%.2f / %.2f / %.2f / %.2f (%zu)",
+            zone.p50_ms, zone.p95_ms, zone.p99_ms, zone.max_ms, zone.count);
+    }
+    ImGui::Text("avg / max ms over %zu frames", GpuProfiler::HISTORY_FRAMES);
+    for (const GpuPassStats& pass : debug_state.gpu_passes) {
+        imgui_formatted_label_text(pass.name.c_str(), "GPU %.2f / %.2f, CPU %.2f / %.2f",
+            pass.average_gpu_ms, pass.max_gpu_ms, pass.average_cpu_ms, pass.max_cpu_ms);
+    }
+    imgui_formatted_label_text("dropped GPU frames", "%zu", debug_state.dropped_gpu_frames);
     ImGui::End();
 }
 
@@ -156,7 +247,7 @@ void GUI::define_error_popup() {
     }
 
     if (ImGui::BeginPopupModal("Error", nullptr)) {
-        ImGui::Text("Error when creating new layer:");
+        ImGui::Text("Something went wrong:");
         if (m_alert_message.has_value()) {
             ImGui::Text(m_alert_message.value().c_str());
         } else {
@@ -174,6 +265,29 @@ void GUI::define_error_popup() {
     }
 }
 
+void GUI::define_file_window(std::optional<float> save_progress) {
+    ImGui::Begin("File");
+
+    char path[1024];
+    std::snprintf(path, sizeof(path), "%s", m_document_path.c_str());
+    if (ImGui::InputText("Path", path, sizeof(path))) {
+        m_document_path = path;
+    }
+
+    if (ImGui::Button("Save")) {
+        m_document_request = DocumentRequest{ DocumentRequest::Kind::Save, m_document_path };
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Open")) {
+        m_document_request = DocumentRequest{ DocumentRequest::Kind::Open, m_document_path };
+    }
+
+    if (save_progress.has_value()) {
+        ImGui::ProgressBar(save_progress.value(), ImVec2(-1.0f, 0.0f), "Saving...");
+    }
+    ImGui::End();
+}
+
 void GUI::define_layer_window(Canvas& canvas, std::optional<Layer::Id>& selected_layer)
 {
     ImGui::Begin("Layers");
@@ -185,7 +299,7 @@ void GUI::define_layer_window(Canvas& canvas, std::optional<Layer::Id>& selected
 void GUI::define_layer_buttons(Canvas& canvas, std::optional<Layer::Id>& selected_layer) {
     if (ImGui::Button("New")) {
         try {
-            Layer::Id new_layer_id = canvas.insert_new_layer_above_selected(selected_layer);
+            Layer::Id new_layer_id = canvas.insert_new_layer_above_selected(selected_layer, m_new_layer_format);
             selected_layer = new_layer_id;
         }
         catch (const std::runtime_error& e) {
@@ -218,7 +332,27 @@ void GUI::define_layer_buttons(Canvas& canvas, std::optional<Layer::Id>& selecte
         }
     }
 
+    // Masks are drawn in a single color, which we let the user pick here.
+    auto layer_opt = selected_layer.has_value() ? 
+        canvas.lookup_layer(selected_layer.value()) : 
+        std::nullopt;
+    if (layer_opt.has_value() && layer_opt.value().get().is_mask()) {
+        glm::vec3 tint = layer_opt.value().get().tint();
+        if (ImGui::ColorEdit3("Tint", &tint.r, ImGuiColorEditFlags_NoInputs)) {
+            canvas.set_layer_tint(selected_layer.value(), tint);
+        }
+    }
+
     ImGui::EndDisabled();
+
+    if (ImGui::BeginCombo("Format", pixel_format_name(m_new_layer_format))) {
+        for (PixelFormat format : PIXEL_FORMATS) {
+            if (ImGui::Selectable(pixel_format_name(format), format == m_new_layer_format)) {
+                m_new_layer_format = format;
+            }
+        }
+        ImGui::EndCombo();
+    }
 }
 
 void GUI::define_layer_list(Canvas& canvas, std::optional<Layer::Id>& selected_layer) {
@@ -0,0 +1,125 @@
+#include <cstring>
+#include <stdexcept>
+
+#include <glad/glad.h>
+#if defined(_WIN32)
+#include <glfw/glfw3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "headless_context.h"
+
+#if defined(_WIN32)
+
+HeadlessContext::HeadlessContext() : m_window(nullptr) {
+    if (!glfwInit()) {
+        throw std::runtime_error("Failed to initialize GLFW");
+    }
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    GLFWwindow* window = glfwCreateWindow(1, 1, "brush", nullptr, nullptr);
+    if (window == nullptr) {
+        glfwTerminate();
+        throw std::runtime_error("Failed to create an OpenGL 4.3 context");
+    }
+    m_window = window;
+    glfwMakeContextCurrent(window);
+
+    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress)) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        throw std::runtime_error("Failed to initialize GLAD");
+    }
+}
+
+HeadlessContext::~HeadlessContext() {
+    glfwDestroyWindow(static_cast<GLFWwindow*>(m_window));
+    glfwTerminate();
+}
+
+#else
+
+static bool has_extension(const char* extensions, const char* name) {
+    if (extensions == nullptr) return false;
+    size_t length = std::strlen(name);
+    for (const char* found = std::strstr(extensions, name); found != nullptr; found = std::strstr(found + length, name)) {
+        bool starts_word = found == extensions || found[-1] == ' ';
+        bool ends_word = found[length] == '\0' || found[length] == ' ';
+        if (starts_word && ends_word) return true;
+    }
+    return false;
+}
+
+// Mesa's surfaceless platform needs neither a display server nor a GPU.
+// Other drivers only offer their default display.
+static EGLDisplay get_display() {
+    const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT")
+    );
+    if (has_extension(client_extensions, "EGL_MESA_platform_surfaceless") && get_platform_display != nullptr) {
+        EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        if (display != EGL_NO_DISPLAY) return display;
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+HeadlessContext::HeadlessContext() : m_display(nullptr), m_context(nullptr) {
+    EGLDisplay display = get_display();
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr)) {
+        throw std::runtime_error("Failed to initialize EGL");
+    }
+    m_display = display;
+
+    auto fail = [&](const char* message) {
+        if (m_context != nullptr) eglDestroyContext(display, m_context);
+        eglTerminate(display);
+        throw std::runtime_error(message);
+    };
+
+    if (!eglBindAPI(EGL_OPENGL_API)) fail("EGL doesn't support OpenGL");
+
+    // Nothing is ever drawn to a surface, so any config will do, or none at
+    // all where the driver allows it.
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    if (!has_extension(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_no_config_context")) {
+        const EGLint config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+        EGLint config_count = 0;
+        if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || config_count == 0) {
+            fail("Failed to find an EGL config for OpenGL");
+        }
+    }
+
+    const EGLint context_attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE,
+    };
+    m_context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+    if (m_context == EGL_NO_CONTEXT) {
+        m_context = nullptr;
+        fail("Failed to create an OpenGL 4.3 context");
+    }
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context)) {
+        fail("Failed to make the OpenGL context current without a surface");
+    }
+
+    if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        fail("Failed to initialize GLAD");
+    }
+}
+
+HeadlessContext::~HeadlessContext() {
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(m_display, m_context);
+    eglTerminate(m_display);
+}
+
+#endif
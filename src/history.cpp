@@ -0,0 +1,208 @@
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "history.h"
+#include "layer.h"
+#include "tile_atlas.h"
+#include "tile_compressor.h"
+
+TileEdit::TileEdit(const Layer& layer) {
+    m_layer_id = layer.id();
+    m_atlas = &layer.atlas();
+    m_tiles = std::make_shared<Tiles>();
+    m_is_recorded.resize(size_t(layer.tiles_x()) * layer.tiles_y());
+}
+
+TileEdit::~TileEdit() {
+    free_tiles();
+}
+
+TileEdit& TileEdit::operator=(TileEdit&& other) noexcept {
+    if (this != &other) {
+        free_tiles();
+        m_layer_id = other.m_layer_id;
+        m_atlas = other.m_atlas;
+        m_positions = std::move(other.m_positions);
+        m_tiles = std::move(other.m_tiles);
+        m_is_recorded = std::move(other.m_is_recorded);
+    }
+    return *this;
+}
+
+// Copies that were never compressed still hold an atlas slot.
+void TileEdit::free_tiles() {
+    if (m_tiles == nullptr) return;
+    for (const Layer::Tile& tile : m_tiles->tiles) {
+        if (tile.kind == Layer::Tile::Kind::Allocated) {
+            m_atlas->free(tile.slot);
+        }
+    }
+    m_tiles = nullptr;
+}
+
+void TileEdit::record(const Layer& layer, glm::ivec2 tile) {
+    size_t index = size_t(tile.y) * layer.tiles_x() + tile.x;
+    if (m_is_recorded[index]) return;
+
+    m_is_recorded[index] = true;
+    m_positions.push_back(tile);
+    m_tiles->tiles.push_back(layer.copy_tile(tile));
+    m_tiles->generations.push_back(0);
+}
+
+void TileEdit::finish(TileCompressor& compressor) {
+    m_is_recorded = std::vector<bool>();
+    compress_tiles(compressor);
+}
+
+// The tiles put back into the layer are decompressed the next time it is
+// rendered or drawn to, and the tiles taken out are compressed in the
+// background, so neither has to wait on the GPU.
+void TileEdit::swap(Layer& layer, TileCompressor& compressor) {
+    std::vector<Layer::Tile>& tiles = m_tiles->tiles;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        tiles[i] = layer.swap_tile(m_positions[i], std::move(tiles[i]));
+        m_tiles->generations[i]++;
+    }
+    compress_tiles(compressor);
+}
+
+void TileEdit::compress_tiles(TileCompressor& compressor) {
+    std::weak_ptr<Tiles> weak_tiles = m_tiles;
+    TileAtlas* atlas = m_atlas;
+
+    for (size_t i = 0; i < m_tiles->tiles.size(); i++) {
+        const Layer::Tile& tile = m_tiles->tiles[i];
+        if (tile.kind != Layer::Tile::Kind::Allocated) continue;
+
+        uint64_t generation = m_tiles->generations[i];
+        compressor.compress_slot(*atlas, tile.slot, [weak_tiles, atlas, i, generation](std::vector<uint8_t>&& compressed) {
+            // The edit may have been dropped from the history, or the tile
+            // swapped back into the layer, while it was being compressed.
+            std::shared_ptr<Tiles> tiles = weak_tiles.lock();
+            if (tiles == nullptr || tiles->generations[i] != generation) return;
+
+            Layer::Tile& tile = tiles->tiles[i];
+            tile.compressed = std::move(compressed);
+            atlas->free(tile.slot);
+            tile.kind = Layer::Tile::Kind::Evicted;
+        });
+    }
+}
+
+size_t TileEdit::byte_size() const {
+    size_t bytes = sizeof(TileEdit) + m_positions.size() * sizeof(glm::ivec2);
+    for (const Layer::Tile& tile : m_tiles->tiles) {
+        bytes += sizeof(Layer::Tile) + tile.compressed.size();
+        if (tile.kind == Layer::Tile::Kind::Allocated) bytes += m_atlas->bytes_per_tile();
+    }
+    return bytes;
+}
+
+// Like those of edits, tiles still waiting to be compressed count at their
+// full size.
+static size_t removed_layer_byte_size(const std::optional<Layer>& layer) {
+    if (!layer.has_value()) return 0;
+    const Layer& removed = layer.value();
+    return removed.evicted_bytes() + removed.resident_bytes() + removed.tiles_x() * removed.tiles_y() * sizeof(Layer::Tile);
+}
+
+size_t history_entry_byte_size(const HistoryEntry& entry) {
+    if (const TileEdit* edit = std::get_if<TileEdit>(&entry)) {
+        return edit->byte_size();
+    }
+    if (const LayerInsertion* insertion = std::get_if<LayerInsertion>(&entry)) {
+        return sizeof(HistoryEntry) + removed_layer_byte_size(insertion->removed_layer);
+    }
+    if (const LayerDeletion* deletion = std::get_if<LayerDeletion>(&entry)) {
+        return sizeof(HistoryEntry) + removed_layer_byte_size(deletion->removed_layer);
+    }
+    return sizeof(HistoryEntry);
+}
+
+History::History(size_t budget_bytes) {
+    m_budget_bytes = budget_bytes;
+    m_used_bytes = 0;
+}
+
+History::Record History::make_record(HistoryEntry entry) const {
+    size_t bytes = history_entry_byte_size(entry);
+    return Record{ std::move(entry), bytes };
+}
+
+void History::push(HistoryEntry entry) {
+    for (const Record& record : m_redo_records) m_used_bytes -= record.bytes;
+    m_redo_records.clear();
+
+    push_redone(std::move(entry));
+}
+
+void History::clear() {
+    m_undo_records.clear();
+    m_redo_records.clear();
+    m_used_bytes = 0;
+}
+
+std::optional<HistoryEntry> History::take_undo() {
+    if (m_undo_records.empty()) return std::nullopt;
+
+    Record record = std::move(m_undo_records.back());
+    m_undo_records.pop_back();
+    m_used_bytes -= record.bytes;
+    return std::move(record.entry);
+}
+
+std::optional<HistoryEntry> History::take_redo() {
+    if (m_redo_records.empty()) return std::nullopt;
+
+    Record record = std::move(m_redo_records.back());
+    m_redo_records.pop_back();
+    m_used_bytes -= record.bytes;
+    return std::move(record.entry);
+}
+
+void History::push_undone(HistoryEntry entry) {
+    Record record = make_record(std::move(entry));
+    m_used_bytes += record.bytes;
+    m_redo_records.push_back(std::move(record));
+    trim();
+}
+
+void History::push_redone(HistoryEntry entry) {
+    Record record = make_record(std::move(entry));
+    m_used_bytes += record.bytes;
+    m_undo_records.push_back(std::move(record));
+    trim();
+}
+
+void History::set_budget_bytes(size_t budget_bytes) {
+    m_budget_bytes = budget_bytes;
+    trim();
+}
+
+// Entries shrink once their tiles have been compressed in the background, so
+// their sizes are measured again before deciding to drop any.
+void History::trim() {
+    if (m_used_bytes <= m_budget_bytes) return;
+
+    m_used_bytes = 0;
+    for (Record& record : m_undo_records) {
+        record.bytes = history_entry_byte_size(record.entry);
+        m_used_bytes += record.bytes;
+    }
+    for (Record& record : m_redo_records) {
+        record.bytes = history_entry_byte_size(record.entry);
+        m_used_bytes += record.bytes;
+    }
+
+    while (m_used_bytes > m_budget_bytes && m_undo_records.size() > 1) {
+        m_used_bytes -= m_undo_records.front().bytes;
+        m_undo_records.pop_front();
+    }
+}
@@ -1,19 +1,25 @@
 #include <algorithm>
+#include <cstdint>
 #include <format>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "glad/glad.h"
 
-#include "frame_buffer.h"
+#include "compression.h"
 #include "layer.h"
-#include "program.h"
-#include "texture.h"
-#include "vao.h"
+#include "parallel.h"
+#include "rect.h"
+#include "tile_atlas.h"
 
-Layer::Layer(size_t width, size_t height)
-    : m_quad_program("../src/shaders/quad.vert", "../src/shaders/quad.frag"),
-    m_frame_buffer(width, height)
+Layer::Layer(size_t width, size_t height, TileAtlas& atlas)
+    : m_width(width),
+    m_height(height),
+    m_atlas(&atlas)
 {
     static Id current_id = 0;
     current_id++;
@@ -23,42 +29,423 @@ Layer::Layer(size_t width, size_t height)
 
     m_is_visible = true;
     m_is_alpha_locked = false;
+    m_tint = glm::vec3(0.0, 0.0, 0.0);
+
+    // A new layer is fully transparent, so it needs no tile storage at all.
+    m_tiles.resize(size_t(tiles_x()) * tiles_y());
+    m_modified_tiles.resize(m_tiles.size());
+    m_tile_generations.resize(m_tiles.size());
+    m_evicting_tiles.resize(m_tiles.size());
+    m_handle = std::make_shared<Layer*>(this);
+    m_unreadable_tile_count = 0;
+}
+
+Layer::~Layer() {
+    free_tiles();
 }
 
 Layer::Layer(Layer&& other) noexcept
-    : m_frame_buffer(std::move(other.m_frame_buffer)),
-    m_id(other.m_id),
+    : m_id(other.m_id),
     m_name(std::move(other.m_name)),
     m_is_visible(other.m_is_visible),
     m_is_alpha_locked(other.m_is_alpha_locked),
-    m_quad_program(std::move(other.m_quad_program))
-{}
+    m_tint(other.m_tint),
+    m_width(other.m_width),
+    m_height(other.m_height),
+    m_atlas(other.m_atlas),
+    m_source_file(std::move(other.m_source_file)),
+    m_tiles(std::move(other.m_tiles)),
+    m_modified_tiles(std::move(other.m_modified_tiles)),
+    m_tile_generations(std::move(other.m_tile_generations)),
+    m_evicting_tiles(std::move(other.m_evicting_tiles)),
+    m_handle(std::move(other.m_handle)),
+    m_unreadable_tile_count(other.m_unreadable_tile_count),
+    m_dirty_rect(other.m_dirty_rect)
+{
+    other.m_tiles.clear();
+    if (m_handle != nullptr) *m_handle = this;
+}
 
 Layer& Layer::operator=(Layer&& other) noexcept {
     if (this != &other) {
-        m_frame_buffer = std::move(other.m_frame_buffer);
+        free_tiles();
         m_id = other.m_id;
         m_name = std::move(other.m_name);
         m_is_visible = other.m_is_visible;
         m_is_alpha_locked = other.m_is_alpha_locked;
-        m_quad_program = std::move(other.m_quad_program);
+        m_tint = other.m_tint;
+        m_width = other.m_width;
+        m_height = other.m_height;
+        m_atlas = other.m_atlas;
+        m_tiles = std::move(other.m_tiles);
+        m_source_file = std::move(other.m_source_file);
+        m_modified_tiles = std::move(other.m_modified_tiles);
+        m_tile_generations = std::move(other.m_tile_generations);
+        m_evicting_tiles = std::move(other.m_evicting_tiles);
+        // Work still pending for the tiles we just freed finds no layer.
+        m_handle = std::move(other.m_handle);
+        if (m_handle != nullptr) *m_handle = this;
+        m_unreadable_tile_count = other.m_unreadable_tile_count;
+        m_dirty_rect = other.m_dirty_rect;
+        other.m_tiles.clear();
     }
     return *this;
 }
 
-void Layer::bind_canvas_fbo() const {
-    m_frame_buffer.bind();
-    m_frame_buffer.set_viewport();
+void Layer::free_tiles() {
+    for (Tile& tile : m_tiles) {
+        if (tile.kind == Tile::Kind::Allocated) {
+            m_atlas->free(tile.slot);
+        }
+        tile = Tile();
+    }
 }
 
-void Layer::render() {
+void Layer::render(const Rect& region) const {
     if (!m_is_visible) return;
 
-    m_quad_program.use();
-    m_frame_buffer.texture().bind_to_0();
-    m_quad_program.set_uniform_1i("u_texture", 0);
+    std::vector<TileAtlas::TileInstance> instances;
+    Rect range = tile_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            const Tile& tile = m_tiles[tile_index({ x, y })];
+            // Evicted tiles must be made resident before rendering.
+            if (tile.kind == Tile::Kind::Empty || tile.kind == Tile::Kind::Evicted) continue;
+
+            TileAtlas::TileInstance instance{};
+            instance.canvas_origin = glm::ivec2(x, y) * TileAtlas::TILE_SIZE;
+            if (tile.kind == Tile::Kind::Solid) {
+                instance.is_solid = 1;
+                instance.color = is_mask() ? glm::vec4(m_tint * tile.color.r, tile.color.r) : tile.color;
+            } else {
+                instance.atlas_origin = m_atlas->slot_origin(tile.slot);
+                instance.page = m_atlas->slot_page(tile.slot);
+                instance.is_mask = is_mask() ? 1 : 0;
+                instance.color = glm::vec4(m_tint, 1.0);
+            }
+            instances.push_back(instance);
+        }
+    }
+
+    m_atlas->draw_tiles(instances, size());
+}
+
+bool Layer::prepare_tile_for_write(glm::ivec2 tile_pos, bool allocate_if_empty) {
+    size_t index = tile_index(tile_pos);
+    Tile& tile = m_tiles[index];
+    if (tile.kind == Tile::Kind::Evicted) {
+        make_resident(tile_rect(tile_pos));
+        if (tile.kind != Tile::Kind::Allocated) return false;
+    }
+    if (tile.kind == Tile::Kind::Allocated) {
+        touch_tile(index);
+        m_modified_tiles[index] = true;
+        return true;
+    }
+    if (tile.kind == Tile::Kind::Empty && !allocate_if_empty) return false;
+
+    std::optional<TileAtlas::Slot> slot = m_atlas->allocate();
+    if (!slot.has_value()) return false;
+
+    // Solid tiles are expanded into real storage filled with their color.
+    m_atlas->clear_slot(slot.value(), tile.color);
+    tile.kind = Tile::Kind::Allocated;
+    tile.slot = slot.value();
+    touch_tile(index);
+    m_modified_tiles[index] = true;
+    return true;
+}
+
+void Layer::bind_tile_for_drawing(glm::ivec2 tile_pos, const Rect& clip) const {
+    const Tile& tile = m_tiles[tile_index(tile_pos)];
+    glm::ivec2 origin = tile_pos * TileAtlas::TILE_SIZE;
+    m_atlas->bind_slot(tile.slot, Rect(clip.min - origin, clip.max - origin));
+}
+
+void Layer::compact_tiles(const Rect& region, ReadbackQueue& queue) {
+    std::vector<size_t> indices;
+    std::vector<uint64_t> generations;
+    std::vector<TileAtlas::Slot> slots;
+
+    Rect range = tile_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            size_t index = tile_index({ x, y });
+            if (m_tiles[index].kind != Tile::Kind::Allocated) continue;
+            indices.push_back(index);
+            generations.push_back(m_tile_generations[index]);
+            slots.push_back(m_tiles[index].slot);
+        }
+    }
+
+    std::weak_ptr<Layer*> weak_handle = m_handle;
+    m_atlas->find_uniform_slots(slots, queue,
+        [weak_handle, indices = std::move(indices), generations = std::move(generations)](std::vector<std::optional<glm::vec4>>&& colors) {
+            // Tiles drawn to, swapped or evicted since they were checked
+            // are left alone.
+            std::shared_ptr<Layer*> handle = weak_handle.lock();
+            if (handle == nullptr) return;
+            Layer& layer = **handle;
+
+            for (size_t i = 0; i < indices.size(); i++) {
+                if (!colors[i].has_value()) continue;
+                if (layer.m_tile_generations[indices[i]] != generations[i]) continue;
+                if (layer.m_tiles[indices[i]].kind != Tile::Kind::Allocated) continue;
+
+                layer.touch_tile(indices[i]);
+                Tile& tile = layer.m_tiles[indices[i]];
+                layer.m_atlas->free(tile.slot);
+                glm::vec4 color = colors[i].value();
+                tile = Tile();
+                if (layer.texel_alpha(color) > 0.0f) {
+                    tile.kind = Tile::Kind::Solid;
+                    tile.color = color;
+                }
+            }
+        });
+}
+
+size_t Layer::evict(TileCompressor& compressor) {
+    size_t evicted = 0;
+    for (size_t index = 0; index < m_tiles.size(); index++) {
+        Tile& tile = m_tiles[index];
+        if (tile.kind != Tile::Kind::Allocated || m_evicting_tiles[index]) continue;
+        evicted++;
+        if (release_clean_tile(tile)) continue;
+
+        m_evicting_tiles[index] = true;
+        std::weak_ptr<Layer*> weak_handle = m_handle;
+        uint64_t generation = m_tile_generations[index];
+        compressor.compress_slot(*m_atlas, tile.slot, [weak_handle, index, generation](std::vector<uint8_t>&& compressed) {
+            // The layer may have been deleted, or the tile drawn to, while
+            // it was being compressed.
+            std::shared_ptr<Layer*> handle = weak_handle.lock();
+            if (handle == nullptr) return;
+            Layer& layer = **handle;
+            if (layer.m_tile_generations[index] != generation) return;
+
+            Tile& tile = layer.m_tiles[index];
+            layer.m_evicting_tiles[index] = false;
+            tile.compressed = std::move(compressed);
+            layer.release_clean_tile(tile);
+        });
+    }
+    return evicted;
+}
+
+bool Layer::release_clean_tile(Tile& tile) const {
+    if (tile.kind != Tile::Kind::Allocated || tile.compressed_data().empty()) return false;
+
+    m_atlas->free(tile.slot);
+    tile.kind = Tile::Kind::Evicted;
+    return true;
+}
+
+void Layer::touch_tile(size_t index) {
+    m_tile_generations[index]++;
+    m_evicting_tiles[index] = false;
+
+    Tile& tile = m_tiles[index];
+    if (tile.kind == Tile::Kind::Allocated) {
+        tile.compressed = std::vector<uint8_t>();
+        tile.mapped = std::span<const uint8_t>();
+    }
+}
+
+// Decompressing is the slow part, so each batch of tiles is decompressed on
+// every core, and only the uploads happen one by one on the GL thread.
+// Batches bound the memory held by decompressed tiles. A tile that fails to
+// decompress is left without pixels, and cleared rather than uploaded.
+size_t Layer::make_resident(const Rect& region, size_t max_tiles) {
+    const size_t BATCH_SIZE = 64;
+
+    std::vector<size_t> indices;
+    Rect range = tile_range(region);
+    for (int y = range.min.y; y < range.max.y && indices.size() < max_tiles; y++) {
+        for (int x = range.min.x; x < range.max.x && indices.size() < max_tiles; x++) {
+            size_t index = tile_index({ x, y });
+            if (m_tiles[index].kind == Tile::Kind::Evicted) indices.push_back(index);
+        }
+    }
+
+    std::vector<std::vector<uint8_t>> pixels;
+    for (size_t first = 0; first < indices.size(); first += BATCH_SIZE) {
+        size_t count = std::min(BATCH_SIZE, indices.size() - first);
+        pixels.resize(count);
+        parallel_for(count, [&](size_t i) {
+            std::span<const uint8_t> data = m_tiles[indices[first + i]].compressed_data();
+            try {
+                pixels[i] = zlib_decompress(data.data(), data.size(), m_atlas->bytes_per_tile());
+            } catch (const std::runtime_error&) {
+                pixels[i].clear();
+            }
+        });
+
+        for (size_t i = 0; i < count; i++) {
+            size_t index = indices[first + i];
+            if (pixels[i].empty()) {
+                // Marked as modified, so that the next save stores it as
+                // cleared rather than keeping the damaged data.
+                m_tiles[index] = Tile();
+                touch_tile(index);
+                m_modified_tiles[index] = true;
+                m_unreadable_tile_count++;
+                continue;
+            }
+
+            std::optional<TileAtlas::Slot> slot = m_atlas->allocate();
+            if (!slot.has_value()) {
+                throw std::runtime_error("Out of tile memory while restoring a layer");
+            }
+
+            // The compressed pixels are kept, so the tile can be evicted
+            // again without reading it back.
+            Tile& tile = m_tiles[index];
+            m_atlas->write_slot(slot.value(), pixels[i]);
+            tile.kind = Tile::Kind::Allocated;
+            tile.slot = slot.value();
+        }
+    }
+    return indices.size();
+}
+
+size_t Layer::release_clean_tiles(const Rect& region) {
+    size_t released = 0;
+    Rect range = tile_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            if (release_clean_tile(m_tiles[tile_index({ x, y })])) released++;
+        }
+    }
+    return released;
+}
+
+// Only the slot changes, so the tile keeps its generation and its compressed
+// pixels, and any work pending on it still applies.
+size_t Layer::move_tiles_below(TileAtlas::Slot first_slot) {
+    size_t moved = 0;
+    for (size_t index = 0; index < m_tiles.size(); index++) {
+        Tile& tile = m_tiles[index];
+        if (tile.kind != Tile::Kind::Allocated || tile.slot < first_slot || m_evicting_tiles[index]) continue;
+
+        std::optional<TileAtlas::Slot> slot = m_atlas->allocate();
+        if (!slot.has_value()) break;
+        if (slot.value() >= first_slot) {
+            m_atlas->free(slot.value());
+            break;
+        }
+        m_atlas->copy_slot(tile.slot, slot.value());
+        m_atlas->free(tile.slot);
+        tile.slot = slot.value();
+        moved++;
+    }
+    return moved;
+}
+
+size_t Layer::evicted_tile_count(const Rect& region) const {
+    size_t count = 0;
+    Rect range = tile_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            if (m_tiles[tile_index({ x, y })].kind == Tile::Kind::Evicted) count++;
+        }
+    }
+    return count;
+}
+
+size_t Layer::evicted_bytes() const {
+    size_t bytes = 0;
+    // Tiles opened from a document may only be in the mapped file.
+    for (const Tile& tile : m_tiles) {
+        if (tile.kind == Tile::Kind::Evicted) bytes += tile.compressed_data().size();
+    }
+    return bytes;
+}
+
+size_t Layer::evicting_bytes() const {
+    size_t count = std::count(m_evicting_tiles.begin(), m_evicting_tiles.end(), true);
+    return count * m_atlas->bytes_per_tile();
+}
+
+Layer::Tile Layer::copy_tile(glm::ivec2 tile_pos) const {
+    const Tile& tile = m_tiles[tile_index(tile_pos)];
+    if (tile.kind != Tile::Kind::Allocated) {
+        Tile copy = tile;
+        detach_tile(copy);
+        return copy;
+    }
+
+    // A tile that still has its compressed pixels needs no copy on the GPU.
+    Tile copy = tile;
+    if (!tile.compressed_data().empty()) {
+        copy.kind = Tile::Kind::Evicted;
+        detach_tile(copy);
+        return copy;
+    }
+
+    std::optional<TileAtlas::Slot> slot = m_atlas->allocate();
+    if (slot.has_value()) {
+        m_atlas->copy_slot(tile.slot, slot.value());
+        copy.slot = slot.value();
+    } else {
+        std::vector<uint8_t> pixels;
+        m_atlas->read_slot(tile.slot, pixels);
+        copy.compressed = zlib_compress(pixels.data(), pixels.size());
+        copy.kind = Tile::Kind::Evicted;
+    }
+    return copy;
+}
+
+Layer::Tile Layer::swap_tile(glm::ivec2 tile_pos, Tile replacement) {
+    mark_dirty(tile_rect(tile_pos).intersected(rect()));
+    size_t index = tile_index(tile_pos);
+    m_modified_tiles[index] = true;
+    Tile replaced = std::exchange(m_tiles[index], std::move(replacement));
+    touch_tile(index);
+    release_clean_tile(replaced);
+    detach_tile(replaced);
+    return replaced;
+}
+
+void Layer::detach_tile(Tile& tile) {
+    if (tile.mapped.empty()) return;
+    tile.compressed.assign(tile.mapped.begin(), tile.mapped.end());
+    tile.mapped = std::span<const uint8_t>();
+}
+
+void Layer::detach_source_file() {
+    for (Tile& tile : m_tiles) {
+        detach_tile(tile);
+    }
+    m_source_file = nullptr;
+}
+
+std::vector<bool> Layer::take_modified_tiles() {
+    return std::exchange(m_modified_tiles, std::vector<bool>(m_tiles.size()));
+}
+
+Rect Layer::tile_range(const Rect& rect) const {
+    Rect clipped = rect.intersected(this->rect());
+    if (clipped.is_empty()) return Rect();
+
+    const int size = TileAtlas::TILE_SIZE;
+    glm::ivec2 min = clipped.min / size;
+    glm::ivec2 max = (clipped.max + (size - 1)) / size;
+    return Rect(min, max);
+}
+
+Rect Layer::tile_rect(glm::ivec2 tile) const {
+    const int size = TileAtlas::TILE_SIZE;
+    return Rect(tile.x * size, tile.y * size, size, size);
+}
+
+size_t Layer::allocated_tile_count() const {
+    return std::count_if(m_tiles.begin(), m_tiles.end(),
+        [](const Tile& tile) { return tile.kind == Tile::Kind::Allocated; });
+}
 
-    GLuint dummy_vao = VAO::get_dummy();
-    glBindVertexArray(dummy_vao);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+bool Layer::is_blank() const {
+    if (!m_is_visible) return true;
+    return std::all_of(m_tiles.begin(), m_tiles.end(),
+        [](const Tile& tile) { return tile.kind == Tile::Kind::Empty; });
 }
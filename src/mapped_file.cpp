@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string& path)
+    : m_path(path),
+    m_data(nullptr),
+    m_size(0),
+    m_file(INVALID_HANDLE_VALUE),
+    m_mapping(nullptr)
+{
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error(std::format("Failed to open {}", path));
+    }
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw std::runtime_error(std::format("Failed to read {}", path));
+    }
+    m_size = size_t(size.QuadPart);
+    // Empty files can't be mapped, but there is nothing to read anyway.
+    if (m_size == 0) return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping != nullptr) {
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (m_data == nullptr) {
+        if (m_mapping != nullptr) CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw std::runtime_error(std::format("Failed to map {}", path));
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (m_data != nullptr) UnmapViewOfFile(m_data);
+    if (m_mapping != nullptr) CloseHandle(m_mapping);
+    CloseHandle(m_file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path)
+    : m_path(path),
+    m_data(nullptr),
+    m_size(0),
+    m_file(-1)
+{
+    m_file = open(path.c_str(), O_RDONLY);
+    if (m_file < 0) {
+        throw std::runtime_error(std::format("Failed to open {}", path));
+    }
+
+    struct stat info{};
+    if (fstat(m_file, &info) != 0) {
+        close(m_file);
+        throw std::runtime_error(std::format("Failed to read {}", path));
+    }
+    m_size = size_t(info.st_size);
+    if (m_size == 0) return;
+
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+    if (data == MAP_FAILED) {
+        close(m_file);
+        throw std::runtime_error(std::format("Failed to map {}", path));
+    }
+    m_data = static_cast<const uint8_t*>(data);
+}
+
+MappedFile::~MappedFile() {
+    if (m_data != nullptr) munmap(const_cast<uint8_t*>(m_data), m_size);
+    close(m_file);
+}
+
+#endif
+
+std::span<const uint8_t> MappedFile::bytes(uint64_t offset, uint64_t size) const {
+    if (offset > m_size || size > m_size - offset) {
+        throw std::runtime_error(std::format("{} is truncated or corrupt", m_path));
+    }
+    return std::span<const uint8_t>(m_data + offset, size_t(size));
+}
@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <format>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "png_export.h"
+
+static const size_t CHANNELS = 4;
+// Bands are small enough to spread over every core and to report progress
+// smoothly, but large enough that restarting compression for each of them
+// costs little in file size.
+static const size_t TARGET_BAND_BYTES = size_t(2) * 1024 * 1024;
+// Workers stay at most this many bands per thread ahead of the writer, which
+// bounds the memory held by compressed bands that are waiting to be written.
+static const size_t BANDS_IN_FLIGHT_PER_THREAD = 2;
+
+enum PngFilter : uint8_t { FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVERAGE, FILTER_PAETH, FILTER_COUNT };
+
+static uint8_t paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return uint8_t(a);
+    if (pb <= pc) return uint8_t(b);
+    return uint8_t(c);
+}
+
+// Filters a row with every filter type, and keeps the one whose output is
+// smallest when read as signed bytes. This is the heuristic suggested by the
+// PNG spec, and the one stb uses too.
+static void filter_row(const uint8_t* row, const uint8_t* previous_row, size_t row_size, std::vector<uint8_t>& scratch, uint8_t* out) {
+    scratch.resize(row_size);
+
+    uint64_t best_cost = UINT64_MAX;
+    for (uint8_t filter = FILTER_NONE; filter < FILTER_COUNT; filter++) {
+        uint64_t cost = 0;
+        for (size_t i = 0; i < row_size; i++) {
+            int a = i >= CHANNELS ? row[i - CHANNELS] : 0;
+            int b = previous_row != nullptr ? previous_row[i] : 0;
+            int c = i >= CHANNELS && previous_row != nullptr ? previous_row[i - CHANNELS] : 0;
+
+            uint8_t predicted = 0;
+            switch (filter) {
+                case FILTER_SUB: predicted = uint8_t(a); break;
+                case FILTER_UP: predicted = uint8_t(b); break;
+                case FILTER_AVERAGE: predicted = uint8_t((a + b) / 2); break;
+                case FILTER_PAETH: predicted = paeth_predictor(a, b, c); break;
+            }
+            scratch[i] = uint8_t(row[i] - predicted);
+            cost += std::abs(int(int8_t(scratch[i])));
+        }
+
+        if (cost < best_cost) {
+            best_cost = cost;
+            out[0] = filter;
+            std::copy(scratch.begin(), scratch.end(), out + 1);
+        }
+    }
+}
+
+static void write_bytes(FILE* file, const void* data, size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file) != size) {
+        throw std::runtime_error("Failed to write PNG file");
+    }
+}
+
+static void write_u32(std::vector<uint8_t>& out, uint32_t value) {
+    out.push_back(uint8_t(value >> 24));
+    out.push_back(uint8_t(value >> 16));
+    out.push_back(uint8_t(value >> 8));
+    out.push_back(uint8_t(value));
+}
+
+static void write_chunk(FILE* file, const char* type, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> header;
+    write_u32(header, uint32_t(data.size()));
+    header.insert(header.end(), type, type + 4);
+    write_bytes(file, header.data(), header.size());
+    write_bytes(file, data.data(), data.size());
+
+    uint32_t crc = crc32(header.data() + 4, 4);
+    crc = crc32(data.data(), data.size(), crc);
+    std::vector<uint8_t> footer;
+    write_u32(footer, crc);
+    write_bytes(file, footer.data(), footer.size());
+}
+
+PngExport::PngExport(std::string filename, size_t width, size_t height, size_t thread_count)
+    : m_filename(std::move(filename)),
+    m_width(width),
+    m_height(height),
+    m_next_band(0),
+    m_bands_written(0),
+    m_is_cancelled(false),
+    m_is_finished(false),
+    m_stats{}
+{
+    m_thread_count = thread_count > 0 ? thread_count : std::max(1u, std::thread::hardware_concurrency());
+    m_rows_per_band = std::max<size_t>(1, TARGET_BAND_BYTES / (m_width * CHANNELS + 1));
+}
+
+PngExport::~PngExport() {
+    for (std::thread& worker : m_workers) {
+        worker.join();
+    }
+    if (m_writer.joinable()) {
+        m_writer.join();
+    }
+}
+
+void PngExport::start(std::vector<uint8_t>&& pixels) {
+    if (is_started()) return;
+    if (pixels.size() != m_width * m_height * CHANNELS) {
+        throw std::runtime_error("Image data has the wrong size");
+    }
+
+    m_pixels = std::move(pixels);
+    m_bands = std::vector<Band>((m_height + m_rows_per_band - 1) / m_rows_per_band);
+
+    m_writer = std::thread(&PngExport::write_file, this);
+    for (size_t i = 0; i < m_thread_count; i++) {
+        m_workers.emplace_back(&PngExport::encode_bands, this);
+    }
+}
+
+float PngExport::progress() const {
+    if (m_bands.empty()) return 0.0f;
+    return float(m_bands_written) / m_bands.size();
+}
+
+const uint8_t* PngExport::row(size_t y) const {
+    return m_pixels.data() + (m_height - 1 - y) * m_width * CHANNELS;
+}
+
+void PngExport::write_file() {
+    auto start_time = std::chrono::steady_clock::now();
+    size_t output_bytes = 0;
+    FILE* file = nullptr;
+
+    try {
+        file = std::fopen(m_filename.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error(std::format("Failed to open {} for writing", m_filename));
+        }
+
+        const std::array<uint8_t, 8> SIGNATURE = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        write_bytes(file, SIGNATURE.data(), SIGNATURE.size());
+
+        // 8 bits per channel RGBA, with the standard compression and
+        // filtering, and no interlacing.
+        std::vector<uint8_t> header;
+        write_u32(header, uint32_t(m_width));
+        write_u32(header, uint32_t(m_height));
+        header.insert(header.end(), { 8, 6, 0, 0, 0 });
+        write_chunk(file, "IHDR", header);
+
+        uint32_t adler = 1;
+        for (size_t i = 0; i < m_bands.size(); i++) {
+            std::vector<uint8_t> data;
+            {
+                std::unique_lock lock(m_mutex);
+                m_band_ready.wait(lock, [&] { return m_bands[i].is_ready || m_is_cancelled; });
+                if (m_is_cancelled) break;
+                data = std::move(m_bands[i].data);
+            }
+
+            // The bands only hold deflate data, so the zlib header goes in
+            // front of the first one, and the checksum of everything after
+            // the last one.
+            adler = adler32_combine(adler, m_bands[i].adler, m_bands[i].filtered_size);
+            if (i == 0) {
+                data.insert(data.begin(), { 0x78, 0x01 });
+            }
+            if (i == m_bands.size() - 1) {
+                write_u32(data, adler);
+            }
+            write_chunk(file, "IDAT", data);
+
+            {
+                std::lock_guard lock(m_mutex);
+                m_bands_written++;
+            }
+            m_band_written.notify_all();
+        }
+
+        if (m_is_cancelled) {
+            throw std::runtime_error("PNG export was cancelled");
+        }
+        write_chunk(file, "IEND", {});
+        output_bytes = size_t(std::ftell(file));
+
+        if (std::fclose(file) != 0) {
+            file = nullptr;
+            throw std::runtime_error("Failed to write PNG file");
+        }
+        file = nullptr;
+    } catch (const std::exception& e) {
+        if (file != nullptr) std::fclose(file);
+        std::lock_guard lock(m_mutex);
+        if (!m_error.has_value()) m_error = e.what();
+        m_is_cancelled = true;
+        m_band_written.notify_all();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    m_stats = PngExportStats{ m_pixels.size(), output_bytes, elapsed.count(), m_thread_count };
+    m_is_finished = true;
+}
+
+void PngExport::encode_bands() {
+    const size_t max_bands_in_flight = m_thread_count * BANDS_IN_FLIGHT_PER_THREAD;
+
+    while (true) {
+        size_t band_index = m_next_band++;
+        if (band_index >= m_bands.size()) return;
+
+        {
+            std::unique_lock lock(m_mutex);
+            m_band_written.wait(lock, [&] {
+                return band_index < m_bands_written + max_bands_in_flight || m_is_cancelled;
+            });
+            if (m_is_cancelled) return;
+        }
+
+        try {
+            encode_band(band_index);
+        } catch (const std::exception& e) {
+            std::lock_guard lock(m_mutex);
+            if (!m_error.has_value()) m_error = e.what();
+            m_is_cancelled = true;
+            m_band_ready.notify_all();
+            return;
+        }
+
+        std::lock_guard lock(m_mutex);
+        m_bands[band_index].is_ready = true;
+        m_band_ready.notify_all();
+    }
+}
+
+void PngExport::encode_band(size_t band_index) {
+    size_t first_row = band_index * m_rows_per_band;
+    size_t end_row = std::min(m_height, first_row + m_rows_per_band);
+    size_t row_size = m_width * CHANNELS;
+
+    std::vector<uint8_t> filtered((end_row - first_row) * (row_size + 1));
+    std::vector<uint8_t> scratch;
+    for (size_t y = first_row; y < end_row; y++) {
+        const uint8_t* previous_row = y > 0 ? row(y - 1) : nullptr;
+        filter_row(row(y), previous_row, row_size, scratch, filtered.data() + (y - first_row) * (row_size + 1));
+    }
+
+    Band& band = m_bands[band_index];
+    band.adler = adler32(filtered.data(), filtered.size());
+    band.filtered_size = filtered.size();
+    deflate_part(filtered.data(), filtered.size(), band_index == m_bands.size() - 1, band.data);
+}
@@ -0,0 +1,252 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "byte_io.h"
+#include "gl_state.h"
+#include "program_registry.h"
+
+static const char CACHE_MAGIC[4] = { 'B', 'P', 'R', 'G' };
+static const uint32_t CACHE_VERSION = 1;
+
+// FNV-1a, which unlike `std::hash` gives the same keys in every build.
+static const uint64_t HASH_SEED = 14695981039346656037ull;
+static uint64_t hash_string(uint64_t hash, const std::string& text) {
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    // Keeps "ab" + "c" apart from "a" + "bc".
+    hash ^= text.size();
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+static std::string load_shader_source(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open shader file: " + path);
+    }
+
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+static GLenum shader_type(const std::string& path) {
+    std::string extension = std::filesystem::path(path).extension().string();
+    if (extension == ".vert") return GL_VERTEX_SHADER;
+    if (extension == ".frag") return GL_FRAGMENT_SHADER;
+    if (extension == ".comp") return GL_COMPUTE_SHADER;
+    throw std::runtime_error(std::format("Unknown shader stage: {}", path));
+}
+
+LinkedProgram::LinkedProgram(
+    GLuint program_id,
+    std::string name,
+    std::vector<GLuint> shaders,
+    std::optional<std::filesystem::path> cache_path,
+    uint64_t cache_key
+) : m_program_id(program_id),
+    m_name(std::move(name)),
+    m_shaders(std::move(shaders)),
+    m_is_checked(false),
+    m_cache_path(std::move(cache_path)),
+    m_cache_key(cache_key) {}
+
+LinkedProgram::~LinkedProgram() {
+    for (GLuint shader : m_shaders) glDeleteShader(shader);
+    glDeleteProgram(m_program_id);
+    GlState::forget_program(m_program_id);
+}
+
+GLuint LinkedProgram::id() {
+    if (!m_is_checked) check_link();
+    return m_program_id;
+}
+
+GLint LinkedProgram::uniform_location(const char* name) {
+    for (const auto& [uniform_name, location] : m_uniform_locations) {
+        if (uniform_name == name) return location;
+    }
+    GLint location = glGetUniformLocation(id(), name);
+    m_uniform_locations.emplace_back(name, location);
+    return location;
+}
+
+// A failed program keeps its shaders, so that every later use throws the
+// same error.
+void LinkedProgram::check_link() {
+    GLint success;
+    glGetProgramiv(m_program_id, GL_LINK_STATUS, &success);
+    if (!success) {
+        // A compile error is more useful than the link error it causes.
+        char info_log[512];
+        for (GLuint shader : m_shaders) {
+            glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+            if (!success) {
+                glGetShaderInfoLog(shader, 512, nullptr, info_log);
+                throw std::runtime_error(std::format("Shader compilation failed ({}): {}", m_name, info_log));
+            }
+        }
+        glGetProgramInfoLog(m_program_id, 512, nullptr, info_log);
+        throw std::runtime_error(std::format("Shader program linking failed ({}): {}", m_name, info_log));
+    }
+
+    for (GLuint shader : m_shaders) {
+        glDetachShader(m_program_id, shader);
+        glDeleteShader(shader);
+    }
+    m_shaders.clear();
+    m_is_checked = true;
+    if (!m_cache_path.has_value()) return;
+
+    // The cache only saves time, so failing to write it isn't an error.
+    GLint length = 0;
+    glGetProgramiv(m_program_id, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    std::vector<uint8_t> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(m_program_id, length, &length, &format, binary.data());
+
+    std::vector<uint8_t> data(CACHE_MAGIC, CACHE_MAGIC + 4);
+    put_u32(data, CACHE_VERSION);
+    put_u64(data, m_cache_key);
+    put_u32(data, format);
+    put_u32(data, uint32_t(length));
+    data.insert(data.end(), binary.begin(), binary.begin() + length);
+
+    // Written aside first, so that another instance never reads half a file.
+    const std::filesystem::path& path = m_cache_path.value();
+    std::filesystem::path temp_path = path;
+    temp_path += std::format(".{}.tmp", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+        if (!file.flush()) return;
+    }
+    std::filesystem::rename(temp_path, path, error);
+    if (error) std::filesystem::remove(temp_path, error);
+}
+
+ProgramRegistry::ProgramRegistry() : m_compiled_count(0), m_cache_hit_count(0) {
+    std::error_code error;
+    std::filesystem::path temp_directory = std::filesystem::temp_directory_path(error);
+    if (!error) m_cache_directory = temp_directory / "brush_program_cache";
+}
+
+ProgramRegistry& ProgramRegistry::instance() {
+    static ProgramRegistry registry;
+    return registry;
+}
+
+const std::string& ProgramRegistry::driver() {
+    if (!m_driver.has_value()) {
+        m_driver = std::format("{}|{}|{}",
+            reinterpret_cast<const char*>(glGetString(GL_VENDOR)),
+            reinterpret_cast<const char*>(glGetString(GL_RENDERER)),
+            reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+    }
+    return m_driver.value();
+}
+
+std::shared_ptr<LinkedProgram> ProgramRegistry::get(const std::vector<std::string>& shader_paths) {
+    std::string name;
+    for (const std::string& path : shader_paths) {
+        if (!name.empty()) name += ", ";
+        name += path;
+    }
+    auto it = m_programs.find(name);
+    if (it != m_programs.end()) {
+        if (std::shared_ptr<LinkedProgram> program = it->second.lock()) return program;
+    }
+
+    std::vector<std::string> sources;
+    uint64_t key = hash_string(HASH_SEED, driver());
+    for (const std::string& path : shader_paths) {
+        sources.push_back(load_shader_source(path));
+        key = hash_string(key, std::to_string(shader_type(path)));
+        key = hash_string(key, sources.back());
+    }
+
+    std::optional<std::filesystem::path> cache_path;
+    if (!m_cache_directory.empty()) {
+        cache_path = m_cache_directory / std::format("{:016x}.bin", key);
+        GLuint program_id = load_cached_binary(cache_path.value(), key);
+        if (program_id != 0) {
+            m_cache_hit_count++;
+            auto program = std::make_shared<LinkedProgram>(program_id, name, std::vector<GLuint>{}, std::nullopt, key);
+            m_programs[name] = program;
+            return program;
+        }
+    }
+
+    // Nothing is checked here, so the driver can compile and link in the
+    // background while other programs are requested.
+    GLuint program_id = glCreateProgram();
+    std::vector<GLuint> shaders;
+    for (size_t i = 0; i < shader_paths.size(); i++) {
+        GLuint shader = glCreateShader(shader_type(shader_paths[i]));
+        const char* source = sources[i].c_str();
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+        glAttachShader(program_id, shader);
+        shaders.push_back(shader);
+    }
+    if (cache_path.has_value()) {
+        glProgramParameteri(program_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    glLinkProgram(program_id);
+    m_compiled_count++;
+
+    auto program = std::make_shared<LinkedProgram>(program_id, name, std::move(shaders), cache_path, key);
+    m_programs[name] = program;
+    return program;
+}
+
+// Returns 0 if there is no usable binary, e.g. because the driver was
+// updated since it was written.
+GLuint ProgramRegistry::load_cached_binary(const std::filesystem::path& path, uint64_t key) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return 0;
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::string filename = path.string();
+    try {
+        ByteReader reader(data, filename);
+        if (std::memcmp(reader.bytes(4).data(), CACHE_MAGIC, 4) != 0) return 0;
+        if (reader.u32() != CACHE_VERSION || reader.u64() != key) return 0;
+        GLenum format = reader.u32();
+        uint32_t length = reader.u32();
+        std::span<const uint8_t> binary = reader.bytes(length);
+
+        GLuint program_id = glCreateProgram();
+        glProgramBinary(program_id, format, binary.data(), GLsizei(length));
+        GLint success;
+        glGetProgramiv(program_id, GL_LINK_STATUS, &success);
+        if (!success) {
+            glDeleteProgram(program_id);
+            return 0;
+        }
+        return program_id;
+    } catch (const std::runtime_error&) {
+        return 0;
+    }
+}
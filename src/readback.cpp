@@ -0,0 +1,118 @@
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+#include "buffer.h"
+#include "gl_state.h"
+#include "readback.h"
+#include "rect.h"
+
+ReadbackQueue::~ReadbackQueue() {
+    for (Request& request : m_pending) {
+        glDeleteSync(request.fence);
+    }
+}
+
+void ReadbackQueue::request(const Rect& region, GLenum format, GLenum type, size_t bytes_per_pixel, Callback callback) {
+    size_t size = size_t(region.width()) * region.height() * bytes_per_pixel;
+    Buffer buffer = take_buffer(size);
+
+    // With a pack buffer bound, glReadPixels writes into it at the given
+    // offset, and returns without waiting for the copy to happen.
+    buffer.bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(region.min.x, region.min.y, region.width(), region.height(), format, type, nullptr);
+    buffer.unbind();
+
+    enqueue(std::move(buffer), size, std::move(callback));
+}
+
+void ReadbackQueue::request_buffer(const Buffer& source, size_t size, Callback callback) {
+    Buffer buffer = take_buffer(size);
+
+    GlState::bind_buffer(GL_COPY_READ_BUFFER, source.id());
+    GlState::bind_buffer(GL_COPY_WRITE_BUFFER, buffer.id());
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size);
+
+    enqueue(std::move(buffer), size, std::move(callback));
+}
+
+void ReadbackQueue::enqueue(Buffer buffer, size_t size, Callback callback) {
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // Make sure the fence reaches the GPU, or polling could wait forever.
+    glFlush();
+
+    m_pending.push_back(Request{ std::move(buffer), fence, size, std::move(callback) });
+}
+
+void ReadbackQueue::poll() {
+    size_t completed = 0;
+    while (completed < m_pending.size()) {
+        GLenum status = glClientWaitSync(m_pending[completed].fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+        completed++;
+    }
+    if (completed == 0) return;
+
+    // Callbacks may make new requests, so the completed ones are taken out
+    // of the queue before any of them run.
+    std::vector<Request> requests(
+        std::make_move_iterator(m_pending.begin()),
+        std::make_move_iterator(m_pending.begin() + completed)
+    );
+    m_pending.erase(m_pending.begin(), m_pending.begin() + completed);
+
+    for (Request& request : requests) {
+        complete(request);
+    }
+}
+
+void ReadbackQueue::finish() {
+    while (!m_pending.empty()) {
+        glClientWaitSync(m_pending.back().fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        poll();
+    }
+}
+
+Buffer ReadbackQueue::take_buffer(size_t size) {
+    for (auto it = m_free_buffers.begin(); it != m_free_buffers.end(); it++) {
+        if (it->size() != size) continue;
+        Buffer buffer = std::move(*it);
+        m_free_buffers.erase(it);
+        return buffer;
+    }
+
+    Buffer buffer(GL_PIXEL_PACK_BUFFER);
+    buffer.upload(nullptr, size, GL_STREAM_READ);
+    buffer.unbind();
+    return buffer;
+}
+
+void ReadbackQueue::complete(Request& request) {
+    glDeleteSync(request.fence);
+
+    std::vector<uint8_t> pixels(request.size);
+    request.buffer.bind();
+    const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, request.size, GL_MAP_READ_BIT);
+    if (mapped == nullptr) {
+        throw std::runtime_error("Failed to map readback buffer");
+    }
+    std::memcpy(pixels.data(), mapped, request.size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    request.buffer.unbind();
+
+    // Only small buffers are worth keeping, since an export can be hundreds
+    // of megabytes.
+    const size_t MAX_REUSED_BUFFER_SIZE = size_t(4) * 1024 * 1024;
+    const size_t MAX_FREE_BUFFERS = 64;
+    if (request.size <= MAX_REUSED_BUFFER_SIZE && m_free_buffers.size() < MAX_FREE_BUFFERS) {
+        m_free_buffers.push_back(std::move(request.buffer));
+    }
+
+    request.callback(std::move(pixels));
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "layer.h"
+#include "rect.h"
+#include "residency_manager.h"
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+ResidencyManager::ResidencyManager(size_t budget_bytes) {
+    m_budget_bytes = budget_bytes;
+    m_clock = 0;
+
+    m_evicted_tiles = 0;
+    m_restored_tiles = 0;
+    m_last_eviction_ms = 0.0;
+    m_last_restore_ms = 0.0;
+}
+
+void ResidencyManager::touch(Layer::Id layer_id) {
+    m_clock++;
+    m_last_used[layer_id] = m_clock;
+}
+
+size_t ResidencyManager::make_resident(Layer& layer, const Rect& region, size_t max_tiles) {
+    auto start = std::chrono::steady_clock::now();
+    size_t restored = layer.make_resident(region, max_tiles);
+    if (restored == 0) return 0;
+
+    m_last_restore_ms = elapsed_ms(start);
+    m_restored_tiles += restored;
+    touch(layer.id());
+    return restored;
+}
+
+size_t ResidencyManager::release_restored(Layer& layer, const Rect& region) {
+    size_t released = layer.release_clean_tiles(region);
+    m_evicted_tiles += released;
+    return released;
+}
+
+void ResidencyManager::enforce_budget(
+    std::vector<Layer>& layers, 
+    std::optional<Layer::Id> selected_layer, 
+    size_t resident_bytes,
+    TileCompressor& compressor
+) {
+    for (const Layer& layer : layers) {
+        resident_bytes -= layer.evicting_bytes();
+    }
+    if (resident_bytes <= m_budget_bytes) return;
+
+    std::vector<Layer*> candidates;
+    for (Layer& layer : layers) {
+        if (layer.id() == selected_layer) continue;
+        if (layer.resident_bytes() == layer.evicting_bytes()) continue;
+        candidates.push_back(&layer);
+    }
+    // Layers we have never seen used count as the oldest.
+    std::sort(candidates.begin(), candidates.end(), [this](const Layer* a, const Layer* b) {
+        auto a_it = m_last_used.find(a->id());
+        auto b_it = m_last_used.find(b->id());
+        uint64_t a_time = a_it != m_last_used.end() ? a_it->second : 0;
+        uint64_t b_time = b_it != m_last_used.end() ? b_it->second : 0;
+        return a_time < b_time;
+    });
+
+    for (Layer* layer : candidates) {
+        if (resident_bytes <= m_budget_bytes) break;
+
+        auto start = std::chrono::steady_clock::now();
+        size_t freed_bytes = layer->resident_bytes() - layer->evicting_bytes();
+        m_evicted_tiles += layer->evict(compressor);
+        m_last_eviction_ms = elapsed_ms(start);
+
+        resident_bytes -= freed_bytes;
+    }
+}
+
+ResidencyStats ResidencyManager::stats(const std::vector<Layer>& layers, size_t resident_bytes) const {
+    size_t evicted_bytes = 0;
+    for (const Layer& layer : layers) {
+        evicted_bytes += layer.evicted_bytes();
+    }
+
+    return ResidencyStats{
+        m_budget_bytes,
+        resident_bytes,
+        evicted_bytes,
+        m_evicted_tiles,
+        m_restored_tiles,
+        m_last_eviction_ms,
+        m_last_restore_ms,
+    };
+}
@@ -1,23 +1,22 @@
 #version 430 core
 
-in vec2 tex_coord;
-out vec4 frag_color;
+in vec2 v_pixel_pos;
+flat in vec2 v_center;
+flat in float v_radius;
+flat in float v_opacity;
+flat in vec3 v_color;
 
-uniform vec2 u_tex_dim;
-uniform vec2 u_circle_pos;
-uniform float u_radius;
-uniform float u_opacity;
+out vec4 frag_color;
 
 void main() {
-	vec2 pixel_pos = tex_coord * u_tex_dim;
-	float dist = distance(pixel_pos, u_circle_pos);
+	float dist = distance(v_pixel_pos, v_center);
 
-	// The blend mode should ignore the color and only modify
-	// the opacity
+	// The blend mode ignores the color, and scales every channel of the
+	// premultiplied layer by one minus the opacity.
 	vec3 ignored_color = vec3(0., 0., 0.);
-	if (dist < u_radius) {
-		frag_color = vec4(ignored_color, u_opacity);
+	if (dist < v_radius) {
+		frag_color = vec4(ignored_color, v_opacity);
 	} else {
 		frag_color = vec4(ignored_color, 0.);	
 	}
-}
\ No newline at end of file
+}
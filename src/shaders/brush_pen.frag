@@ -1,21 +1,20 @@
 #version 430 core
 
-in vec2 tex_coord;
-out vec4 frag_color;
+in vec2 v_pixel_pos;
+flat in vec2 v_center;
+flat in float v_radius;
+flat in float v_opacity;
+flat in vec3 v_color;
 
-uniform vec2 u_tex_dim;
-uniform vec2 u_circle_pos;
-uniform float u_radius;
-uniform vec3 u_color;
-uniform float u_opacity;
+out vec4 frag_color;
 
 void main() {
-	vec2 pixel_pos = tex_coord * u_tex_dim;
-	float dist = distance(pixel_pos, u_circle_pos);
+	float dist = distance(v_pixel_pos, v_center);
 
-	if (dist < u_radius) {
-		frag_color = vec4(u_color, u_opacity);
+	// Layers store premultiplied color.
+	if (dist < v_radius) {
+		frag_color = vec4(v_color * v_opacity, v_opacity);
 	} else {
 		frag_color = vec4(0., 0., 0., 0.);	
 	}
-}
\ No newline at end of file
+}
@@ -3,10 +3,11 @@
 in vec2 v_tex_coord;
 
 uniform sampler2D u_canvas;
+uniform float u_lod;
 
 out vec4 frag_color;
 
 void main() {
-    frag_color = texture(u_canvas, vec2(v_tex_coord.x, v_tex_coord.y));
+    frag_color = textureLod(u_canvas, vec2(v_tex_coord.x, v_tex_coord.y), u_lod);
 }
 
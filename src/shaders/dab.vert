@@ -0,0 +1,46 @@
+#version 430 core
+
+struct Dab {
+    vec2 center;
+    float radius;
+    float opacity;
+    vec4 color;
+};
+
+layout(std430, binding = 0) readonly buffer Dabs {
+    Dab dabs[];
+};
+
+uniform vec2 u_tile_origin;
+uniform float u_tile_size;
+
+out vec2 v_pixel_pos;
+flat out vec2 v_center;
+flat out float v_radius;
+flat out float v_opacity;
+flat out vec3 v_color;
+
+const vec2 verts[4] = vec2[](
+    vec2(-1, -1),
+    vec2(1, -1),
+    vec2(-1, 1),
+    vec2(1, 1)
+);
+
+// Each instance is a quad covering one dab's bounding box, positioned
+// relative to the tile currently being drawn to.
+void main() {
+    Dab dab = dabs[gl_InstanceID];
+
+    // Pad by a pixel so that pixel centres on the edge of the circle are
+    // always covered by the quad.
+    vec2 pixel_pos = dab.center + verts[gl_VertexID] * (dab.radius + 1.0);
+    vec2 tile_pos = (pixel_pos - u_tile_origin) / u_tile_size;
+    gl_Position = vec4(tile_pos * 2.0 - 1.0, 0.0, 1.0);
+
+    v_pixel_pos = pixel_pos;
+    v_center = dab.center;
+    v_radius = dab.radius;
+    v_opacity = dab.opacity;
+    v_color = dab.color.rgb;
+}
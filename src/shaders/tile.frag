@@ -0,0 +1,25 @@
+#version 430 core
+
+flat in ivec2 v_canvas_origin;
+flat in ivec3 v_atlas_origin;
+flat in int v_is_solid;
+flat in int v_is_mask;
+flat in vec4 v_color;
+
+out vec4 frag_color;
+
+uniform sampler2DArray u_atlas;
+
+// Tiles are always drawn 1:1 with the canvas, so we can fetch texels directly.
+void main() {
+    if (v_is_solid != 0) {
+        frag_color = v_color;
+        return;
+    }
+
+    ivec2 local = ivec2(gl_FragCoord.xy) - v_canvas_origin;
+    vec4 texel = texelFetch(u_atlas, ivec3(v_atlas_origin.xy + local, v_atlas_origin.z), 0);
+    // Masks only store coverage, and take their color from the layer's tint.
+    // Everything else is already premultiplied.
+    frag_color = v_is_mask != 0 ? vec4(v_color.rgb * texel.r, texel.r) : texel;
+}
@@ -0,0 +1,44 @@
+#version 430 core
+
+struct TileInstance {
+    ivec2 canvas_origin;
+    ivec2 atlas_origin;
+    int page;
+    int is_solid;
+    int is_mask;
+    int padding;
+    vec4 color;
+};
+
+layout(std430, binding = 0) readonly buffer Tiles {
+    TileInstance tiles[];
+};
+
+uniform vec2 u_target_size;
+uniform int u_tile_size;
+
+flat out ivec2 v_canvas_origin;
+flat out ivec3 v_atlas_origin;
+flat out int v_is_solid;
+flat out int v_is_mask;
+flat out vec4 v_color;
+
+const vec2 verts[4] = vec2[](
+    vec2(0, 0),
+    vec2(1, 0),
+    vec2(0, 1),
+    vec2(1, 1)
+);
+
+void main() {
+    TileInstance tile = tiles[gl_InstanceID];
+
+    vec2 pos = vec2(tile.canvas_origin) + verts[gl_VertexID] * float(u_tile_size);
+    gl_Position = vec4(pos / u_target_size * 2.0 - 1.0, 0.0, 1.0);
+
+    v_canvas_origin = tile.canvas_origin;
+    v_atlas_origin = ivec3(tile.atlas_origin, tile.page);
+    v_is_solid = tile.is_solid;
+    v_is_mask = tile.is_mask;
+    v_color = tile.color;
+}
@@ -0,0 +1,90 @@
+#version 430 core
+
+// Matches `PixelFormat`, with solid tiles as -1.
+const int SOLID = -1;
+const int FORMAT_R8 = 0;
+const int FORMAT_RGBA8 = 1;
+
+struct StackEntry {
+    ivec2 atlas_origin;
+    int page;
+    int format;
+    vec4 color;
+};
+
+layout(std430, binding = 1) readonly buffer Entries {
+    StackEntry entries[];
+};
+
+flat in ivec2 v_canvas_origin;
+flat in int v_first_entry;
+flat in int v_entry_count;
+
+out vec4 frag_color;
+
+uniform sampler2DArray u_mask_atlas;
+uniform sampler2DArray u_color_atlas;
+uniform sampler2DArray u_float_atlas;
+// Each fragment covers a 2^u_level square block of canvas pixels.
+uniform int u_level;
+
+vec4 fetch(StackEntry entry, ivec2 local) {
+    if (entry.format == SOLID) return entry.color;
+
+    ivec3 coord = ivec3(entry.atlas_origin + local, entry.page);
+    if (entry.format == FORMAT_R8) {
+        // Masks only store coverage, and take their color from the tint.
+        float coverage = texelFetch(u_mask_atlas, coord, 0).r;
+        return vec4(entry.color.rgb * coverage, coverage);
+    }
+    if (entry.format == FORMAT_RGBA8) return texelFetch(u_color_atlas, coord, 0);
+    return texelFetch(u_float_atlas, coord, 0);
+}
+
+// Bilinearly samples the entry's page at `pos`, given in texels.
+vec4 sample_atlas(StackEntry entry, vec2 pos) {
+    if (entry.format == FORMAT_R8) {
+        vec3 coord = vec3(pos / vec2(textureSize(u_mask_atlas, 0).xy), entry.page);
+        float coverage = textureLod(u_mask_atlas, coord, 0.0).r;
+        return vec4(entry.color.rgb * coverage, coverage);
+    }
+    if (entry.format == FORMAT_RGBA8) {
+        return textureLod(u_color_atlas, vec3(pos / vec2(textureSize(u_color_atlas, 0).xy), entry.page), 0.0);
+    }
+    return textureLod(u_float_atlas, vec3(pos / vec2(textureSize(u_float_atlas, 0).xy), entry.page), 0.0);
+}
+
+// Averages the block of the tile starting at `local`. A bilinear tap on the
+// corner between four texels averages them, so blocks of up to 8x8 are
+// covered exactly, and larger ones by 4x4 evenly spread taps. Taps never
+// reach past the block, so nothing bleeds in from neighbouring slots.
+vec4 fetch_block(StackEntry entry, ivec2 local) {
+    if (entry.format == SOLID) return entry.color;
+
+    int block_size = 1 << u_level;
+    int taps = min(block_size / 2, 4);
+    int spacing = block_size / taps;
+    vec4 sum = vec4(0.0);
+    for (int y = 0; y < taps; y++) {
+        for (int x = 0; x < taps; x++) {
+            ivec2 corner = entry.atlas_origin + local + ivec2(x, y) * spacing + spacing / 2;
+            sum += sample_atlas(entry, vec2(corner));
+        }
+    }
+    return sum / float(taps * taps);
+}
+
+// Blends the stack bottom up with the premultiplied "over" operator. Since
+// it is associative, blending the result over the target is the same as
+// blending each layer over it in turn.
+void main() {
+    ivec2 local = (ivec2(gl_FragCoord.xy) << u_level) - v_canvas_origin;
+
+    vec4 result = vec4(0.0);
+    for (int i = 0; i < v_entry_count; i++) {
+        StackEntry entry = entries[v_first_entry + i];
+        vec4 color = u_level == 0 ? fetch(entry, local) : fetch_block(entry, local);
+        result = color + result * (1.0 - color.a);
+    }
+    frag_color = result;
+}
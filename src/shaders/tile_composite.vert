@@ -0,0 +1,36 @@
+#version 430 core
+
+struct TileStack {
+    ivec2 canvas_origin;
+    int first_entry;
+    int entry_count;
+};
+
+layout(std430, binding = 0) readonly buffer Stacks {
+    TileStack stacks[];
+};
+
+uniform vec2 u_target_size;
+uniform int u_tile_size;
+
+flat out ivec2 v_canvas_origin;
+flat out int v_first_entry;
+flat out int v_entry_count;
+
+const vec2 verts[4] = vec2[](
+    vec2(0, 0),
+    vec2(1, 0),
+    vec2(0, 1),
+    vec2(1, 1)
+);
+
+void main() {
+    TileStack stack = stacks[gl_InstanceID];
+
+    vec2 pos = vec2(stack.canvas_origin) + verts[gl_VertexID] * float(u_tile_size);
+    gl_Position = vec4(pos / u_target_size * 2.0 - 1.0, 0.0, 1.0);
+
+    v_canvas_origin = stack.canvas_origin;
+    v_first_entry = stack.first_entry;
+    v_entry_count = stack.entry_count;
+}
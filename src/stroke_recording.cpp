@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "brush.h"
+#include "byte_io.h"
+#include "canvas.h"
+#include "canvas_view.h"
+#include "mapped_file.h"
+#include "stroke_recording.h"
+#include "tools.h"
+#include "user_state.h"
+
+static const char RECORDING_MAGIC[4] = { 'B', 'R', 'E', 'C' };
+static const uint32_t RECORDING_VERSION = 1;
+static const size_t HEADER_SIZE = 20;
+static const uint32_t NO_LAYER = 0xFFFFFFFF;
+
+enum RecordedFrameFlags : uint8_t {
+    FRAME_MOUSE_DOWN = 1 << 0,
+    FRAME_SCREEN_SIZE = 1 << 1,
+    FRAME_VIEW = 1 << 2,
+    FRAME_TOOL = 1 << 3,
+    FRAME_BRUSH = 1 << 4,
+    FRAME_COLOR = 1 << 5,
+    FRAME_LAYER = 1 << 6,
+};
+
+static const uint8_t FRAME_ALL_FIELDS = FRAME_SCREEN_SIZE | FRAME_VIEW | FRAME_TOOL | FRAME_BRUSH | FRAME_COLOR | FRAME_LAYER;
+
+// Only the fields that differ from `last` are written, apart from the
+// cursor, which is always written. Returns `frame` with its time rounded
+// to what was written, so that rounding errors don't add up.
+static RecordedFrame encode_frame(std::vector<uint8_t>& out, RecordedFrame frame, const std::optional<RecordedFrame>& last) {
+    uint8_t flags = frame.is_mouse_down ? FRAME_MOUSE_DOWN : 0;
+    if (!last.has_value() || frame.screen_size != last.value().screen_size) flags |= FRAME_SCREEN_SIZE;
+    if (!last.has_value() || frame.view != last.value().view) flags |= FRAME_VIEW;
+    if (!last.has_value() || frame.tool_name != last.value().tool_name) flags |= FRAME_TOOL;
+    if (!last.has_value()
+        || frame.brush_size != last.value().brush_size
+        || frame.brush_opacity != last.value().brush_opacity) {
+        flags |= FRAME_BRUSH;
+    }
+    if (!last.has_value() || frame.color != last.value().color) flags |= FRAME_COLOR;
+    if (!last.has_value() || frame.layer_index != last.value().layer_index) flags |= FRAME_LAYER;
+
+    double last_time = last.has_value() ? last.value().time : 0.0;
+    double micros = std::clamp(std::round((frame.time - last_time) * 1e6), 0.0, double(UINT32_MAX));
+    frame.time = last_time + micros / 1e6;
+
+    put_u8(out, flags);
+    put_u32(out, uint32_t(micros));
+    put_f32(out, frame.cursor.pos.x);
+    put_f32(out, frame.cursor.pos.y);
+    put_f32(out, frame.cursor.pressure);
+    if (flags & FRAME_SCREEN_SIZE) {
+        put_f32(out, frame.screen_size.x);
+        put_f32(out, frame.screen_size.y);
+    }
+    if (flags & FRAME_VIEW) {
+        put_f32(out, frame.view.translation.x);
+        put_f32(out, frame.view.translation.y);
+        put_f32(out, frame.view.scale.x);
+        put_f32(out, frame.view.scale.y);
+        put_f32(out, frame.view.rotation);
+        put_u8(out, frame.view.is_flipped ? 1 : 0);
+    }
+    if (flags & FRAME_TOOL) {
+        size_t name_size = std::min<size_t>(frame.tool_name.size(), UINT8_MAX);
+        frame.tool_name.resize(name_size);
+        put_u8(out, uint8_t(name_size));
+        out.insert(out.end(), frame.tool_name.begin(), frame.tool_name.end());
+    }
+    if (flags & FRAME_BRUSH) {
+        put_f32(out, frame.brush_size);
+        put_f32(out, frame.brush_opacity);
+    }
+    if (flags & FRAME_COLOR) {
+        put_f32(out, frame.color.r);
+        put_f32(out, frame.color.g);
+        put_f32(out, frame.color.b);
+    }
+    if (flags & FRAME_LAYER) {
+        put_u32(out, frame.layer_index.value_or(NO_LAYER));
+    }
+    return frame;
+}
+
+static RecordedFrame decode_frame(ByteReader& reader, const std::optional<RecordedFrame>& last, const std::string& filename) {
+    RecordedFrame frame = last.value_or(RecordedFrame{});
+    uint8_t flags = reader.u8();
+    // There is nothing to carry over into the first frame.
+    if (!last.has_value() && (flags & FRAME_ALL_FIELDS) != FRAME_ALL_FIELDS) {
+        throw std::runtime_error(std::format("{} is truncated or corrupt", filename));
+    }
+
+    frame.is_mouse_down = (flags & FRAME_MOUSE_DOWN) != 0;
+    frame.time += reader.u32() / 1e6;
+    frame.cursor.pos.x = reader.f32();
+    frame.cursor.pos.y = reader.f32();
+    frame.cursor.pressure = reader.f32();
+    if (flags & FRAME_SCREEN_SIZE) {
+        frame.screen_size.x = reader.f32();
+        frame.screen_size.y = reader.f32();
+    }
+    if (flags & FRAME_VIEW) {
+        frame.view.translation.x = reader.f32();
+        frame.view.translation.y = reader.f32();
+        frame.view.scale.x = reader.f32();
+        frame.view.scale.y = reader.f32();
+        frame.view.rotation = reader.f32();
+        frame.view.is_flipped = reader.u8() != 0;
+    }
+    if (flags & FRAME_TOOL) {
+        std::span<const uint8_t> name = reader.bytes(reader.u8());
+        frame.tool_name.assign(name.begin(), name.end());
+    }
+    if (flags & FRAME_BRUSH) {
+        frame.brush_size = reader.f32();
+        frame.brush_opacity = reader.f32();
+    }
+    if (flags & FRAME_COLOR) {
+        frame.color.r = reader.f32();
+        frame.color.g = reader.f32();
+        frame.color.b = reader.f32();
+    }
+    if (flags & FRAME_LAYER) {
+        uint32_t index = reader.u32();
+        frame.layer_index = index != NO_LAYER ? std::optional(index) : std::nullopt;
+    }
+    return frame;
+}
+
+StrokeRecording read_stroke_recording(const std::string& filename) {
+    MappedFile file(filename);
+    if (file.size() < HEADER_SIZE || std::memcmp(file.bytes(0, 4).data(), RECORDING_MAGIC, 4) != 0) {
+        throw std::runtime_error(std::format("{} is not a stroke recording", filename));
+    }
+
+    ByteReader reader(file.bytes(4, file.size() - 4), filename);
+    uint32_t version = reader.u32();
+    if (version != RECORDING_VERSION) {
+        throw std::runtime_error(std::format("{} has unsupported version {}", filename, version));
+    }
+
+    StrokeRecording recording;
+    recording.canvas_width = reader.u32();
+    recording.canvas_height = reader.u32();
+    uint32_t frame_count = reader.u32();
+
+    std::optional<RecordedFrame> last;
+    for (uint32_t i = 0; i < frame_count; i++) {
+        last = decode_frame(reader, last, filename);
+        recording.frames.push_back(last.value());
+    }
+    return recording;
+}
+
+StrokeRecorder::StrokeRecorder()
+    : m_frame_count(0),
+    m_canvas_width(0),
+    m_canvas_height(0),
+    m_start_time(0.0),
+    m_is_recording(false) {}
+
+void StrokeRecorder::start(const Canvas& canvas, double now) {
+    m_data.clear();
+    m_last_frame = std::nullopt;
+    m_frame_count = 0;
+    m_canvas_width = canvas.width();
+    m_canvas_height = canvas.height();
+    m_start_time = now;
+    m_is_recording = true;
+}
+
+void StrokeRecorder::record(
+    double now,
+    glm::vec2 screen_size,
+    const Canvas& canvas,
+    ToolManager& tool_manager,
+    const UserState& user_state,
+    bool is_mouse_down
+) {
+    if (!m_is_recording) return;
+
+    RecordedFrame frame{};
+    frame.time = now - m_start_time;
+    frame.screen_size = screen_size;
+    frame.view = canvas.view_transform();
+    // Tools other than brushes don't change the brush settings.
+    if (m_last_frame.has_value()) {
+        frame.brush_size = m_last_frame.value().brush_size;
+        frame.brush_opacity = m_last_frame.value().brush_opacity;
+    }
+    auto tool_opt = tool_manager.get_selected_tool();
+    if (tool_opt.has_value()) {
+        Tool& tool = tool_opt.value().get();
+        frame.tool_name = tool.name();
+        if (Brush* brush = dynamic_cast<Brush*>(&tool)) {
+            frame.brush_size = brush->size();
+            frame.brush_opacity = brush->opacity();
+        }
+    }
+    frame.color = user_state.selected_color;
+    if (user_state.selected_layer.has_value()) {
+        const std::vector<Layer>& layers = canvas.get_layers();
+        auto it = std::find_if(layers.begin(), layers.end(), [&](const Layer& layer) {
+            return layer.id() == user_state.selected_layer.value();
+        });
+        if (it != layers.end()) frame.layer_index = uint32_t(it - layers.begin());
+    }
+    frame.cursor = user_state.cursor;
+    frame.is_mouse_down = is_mouse_down;
+
+    m_last_frame = encode_frame(m_data, std::move(frame), m_last_frame);
+    m_frame_count++;
+}
+
+void StrokeRecorder::stop(const std::string& filename) {
+    if (!m_is_recording) return;
+    m_is_recording = false;
+    std::vector<uint8_t> data = std::exchange(m_data, {});
+
+    std::vector<uint8_t> header(RECORDING_MAGIC, RECORDING_MAGIC + 4);
+    put_u32(header, RECORDING_VERSION);
+    put_u32(header, uint32_t(m_canvas_width));
+    put_u32(header, uint32_t(m_canvas_height));
+    put_u32(header, uint32_t(m_frame_count));
+
+    FILE* file = std::fopen(filename.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error(std::format("Failed to open {} for writing", filename));
+    }
+    bool is_written = std::fwrite(header.data(), 1, header.size(), file) == header.size()
+        && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (std::fclose(file) != 0 || !is_written) {
+        throw std::runtime_error(std::format("Failed to write {}", filename));
+    }
+}
+
+void replay_frame(const RecordedFrame& frame, Canvas& canvas, ToolManager& tool_manager, UserState& user_state) {
+    canvas.set_view_transform(frame.view);
+    tool_manager.select_tool_by_name(frame.tool_name);
+    auto tool_opt = tool_manager.get_selected_tool();
+    if (tool_opt.has_value()) {
+        if (Brush* brush = dynamic_cast<Brush*>(&tool_opt.value().get())) {
+            brush->size() = frame.brush_size;
+            brush->opacity() = frame.brush_opacity;
+        }
+    }
+    user_state.selected_color = frame.color;
+
+    user_state.selected_layer = std::nullopt;
+    if (frame.layer_index.has_value()) {
+        size_t index = frame.layer_index.value();
+        while (canvas.get_layers().size() <= index) {
+            std::optional<Layer::Id> top_layer = std::nullopt;
+            if (!canvas.get_layers().empty()) top_layer = canvas.get_layers().back().id();
+            canvas.insert_new_layer_above_selected(top_layer);
+        }
+        user_state.selected_layer = canvas.get_layers()[index].id();
+    }
+
+    user_state.cursor = frame.cursor;
+    tool_manager.handle_mouse(canvas, user_state, frame.is_mouse_down);
+}
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glad/glad.h"
+#include "glm/glm.hpp"
+
+#include "frame_buffer.h"
+#include "gl_state.h"
+#include "program.h"
+#include "readback.h"
+#include "rect.h"
+#include "texture_array.h"
+#include "tile_atlas.h"
+#include "vao.h"
+
+// Must match the std430 layout in `tile_uniform.comp`.
+struct UniformQuery {
+    glm::ivec2 atlas_origin;
+    int page;
+    int is_uniform;
+    glm::vec4 color;
+};
+
+TileAtlas::TileAtlas(PixelFormat format)
+    : m_format(format),
+    m_pages(PAGE_SIZE, PAGE_SIZE, 1, gl_internal_format(format)),
+    m_instance_buffer(GL_SHADER_STORAGE_BUFFER),
+    m_query_buffer(GL_SHADER_STORAGE_BUFFER),
+    m_tile_program("../src/shaders/tile.vert", "../src/shaders/tile.frag"),
+    m_uniform_program("../src/shaders/tile_uniform.comp")
+{
+    GLint max_layers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    m_max_pages = std::max(1, max_layers);
+
+    // Ascending order is already a valid min-heap.
+    for (size_t i = 0; i < capacity(); i++) {
+        m_free_slots.push_back(Slot(i));
+    }
+
+    glGenFramebuffers(1, &m_fbo);
+    if (m_fbo == 0) {
+        throw std::runtime_error("Failed to generate tile atlas framebuffer");
+    }
+
+    GlState::bind_framebuffer(m_fbo);
+    attach_page(0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("Tile atlas framebuffer incomplete: status = " + std::to_string(status));
+    }
+    FrameBuffer::unbind();
+}
+
+TileAtlas::~TileAtlas() {
+    if (m_fbo != 0) {
+        glDeleteFramebuffers(1, &m_fbo);
+        GlState::forget_framebuffer(m_fbo);
+    }
+}
+
+std::optional<TileAtlas::Slot> TileAtlas::allocate() {
+    if (m_free_slots.empty() && !grow()) {
+        return std::nullopt;
+    }
+
+    std::pop_heap(m_free_slots.begin(), m_free_slots.end(), std::greater<Slot>());
+    Slot slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    return slot;
+}
+
+void TileAtlas::free(Slot slot) {
+    m_free_slots.push_back(slot);
+    std::push_heap(m_free_slots.begin(), m_free_slots.end(), std::greater<Slot>());
+    m_has_freed_slots = true;
+}
+
+bool TileAtlas::should_release_pages() const {
+    return m_has_freed_slots && page_count() > 1 && used_slots() * 2 < capacity();
+}
+
+// Growing adds half the current size, so a quarter to spare keeps an atlas
+// that has just shrunk from growing again straight away.
+size_t TileAtlas::target_page_count() const {
+    size_t slots = used_slots() + used_slots() / 4;
+    return std::max<size_t>(1, (slots + TILES_PER_PAGE - 1) / TILES_PER_PAGE);
+}
+
+size_t TileAtlas::release_pages(size_t min_pages) {
+    m_has_freed_slots = false;
+
+    std::vector<size_t> free_counts(page_count());
+    for (Slot slot : m_free_slots) free_counts[slot_page(slot)]++;
+
+    size_t pages = page_count();
+    while (pages > std::max<size_t>(1, min_pages) && free_counts[pages - 1] == TILES_PER_PAGE) pages--;
+    if (pages == page_count()) return 0;
+
+    size_t released = page_count() - pages;
+    Slot end = Slot(pages * TILES_PER_PAGE);
+    std::erase_if(m_free_slots, [end](Slot slot) { return slot >= end; });
+    std::make_heap(m_free_slots.begin(), m_free_slots.end(), std::greater<Slot>());
+    m_pages.resize(pages);
+    m_attached_page = -1;
+    return released;
+}
+
+// Growing copies every existing page, so we grow by half the current size
+// each time to keep the number of copies logarithmic in the painted area.
+bool TileAtlas::grow() {
+    size_t pages = m_pages.layers();
+    if (pages >= m_max_pages) return false;
+
+    size_t new_pages = std::min(m_max_pages, pages + std::max<size_t>(1, pages / 2));
+    m_pages.resize(new_pages);
+    m_attached_page = -1;
+
+    // Only an atlas without free slots grows, and ascending order is
+    // already a valid min-heap.
+    for (size_t i = pages * TILES_PER_PAGE; i < new_pages * TILES_PER_PAGE; i++) {
+        m_free_slots.push_back(Slot(i));
+    }
+    return true;
+}
+
+void TileAtlas::attach_page(int page) {
+    if (page == m_attached_page && m_attached_texture == m_pages.id()) return;
+
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_pages.id(), 0, page);
+    m_attached_page = page;
+    m_attached_texture = m_pages.id();
+}
+
+glm::ivec2 TileAtlas::slot_origin(Slot slot) const {
+    int cell = int(slot % TILES_PER_PAGE);
+    return glm::ivec2(cell % TILES_PER_PAGE_SIDE, cell / TILES_PER_PAGE_SIDE) * TILE_SIZE;
+}
+
+void TileAtlas::bind_slot(Slot slot, std::optional<Rect> clip) {
+    GlState::bind_framebuffer(m_fbo);
+    attach_page(slot_page(slot));
+
+    glm::ivec2 origin = slot_origin(slot);
+    glViewport(origin.x, origin.y, TILE_SIZE, TILE_SIZE);
+
+    Rect cell_rect = Rect(origin.x, origin.y, TILE_SIZE, TILE_SIZE);
+    if (clip.has_value()) {
+        Rect clip_rect = Rect(clip.value().min + origin, clip.value().max + origin);
+        FrameBuffer::set_scissor(clip_rect.intersected(cell_rect));
+    }
+}
+
+void TileAtlas::clear_slot(Slot slot, glm::vec4 color) {
+    bind_slot(slot, Rect(0, 0, TILE_SIZE, TILE_SIZE));
+    glClearColor(color.r, color.g, color.b, color.a);
+    glClear(GL_COLOR_BUFFER_BIT);
+    FrameBuffer::disable_scissor();
+}
+
+void TileAtlas::draw_tiles(const std::vector<TileInstance>& tiles, glm::vec2 target_size) {
+    if (tiles.empty()) return;
+
+    m_instance_buffer.upload(tiles);
+    m_instance_buffer.bind_base(0);
+
+    m_tile_program.use();
+    m_tile_program.set_uniform_2f("u_target_size", target_size);
+    m_tile_program.set_uniform_1i("u_tile_size", TILE_SIZE);
+    m_pages.bind_to(0);
+    m_tile_program.set_uniform_1i("u_atlas", 0);
+
+    GLuint dummy_vao = VAO::get_dummy();
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays_instanced(GL_TRIANGLE_STRIP, 0, 4, tiles.size());
+}
+
+void TileAtlas::read_slot(Slot slot, std::vector<uint8_t>& pixels) {
+    pixels.resize(bytes_per_tile());
+    bind_slot(slot);
+
+    glm::ivec2 origin = slot_origin(slot);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(
+        origin.x, origin.y, TILE_SIZE, TILE_SIZE,
+        gl_transfer_format(m_format), gl_transfer_type(m_format),
+        pixels.data()
+    );
+    FrameBuffer::unbind();
+}
+
+void TileAtlas::read_slot_async(Slot slot, ReadbackQueue& queue, ReadbackQueue::Callback callback) {
+    bind_slot(slot);
+    Rect region(slot_origin(slot), slot_origin(slot) + TILE_SIZE);
+    queue.request(region, gl_transfer_format(m_format), gl_transfer_type(m_format), bytes_per_pixel(m_format), std::move(callback));
+    FrameBuffer::unbind();
+}
+
+void TileAtlas::write_slot(Slot slot, const std::vector<uint8_t>& pixels) {
+    if (pixels.size() != bytes_per_tile()) {
+        throw std::runtime_error("Tile data has the wrong size");
+    }
+
+    glm::ivec2 origin = slot_origin(slot);
+    m_pages.bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(
+        GL_TEXTURE_2D_ARRAY, 0,
+        origin.x, origin.y, slot_page(slot),
+        TILE_SIZE, TILE_SIZE, 1,
+        gl_transfer_format(m_format), gl_transfer_type(m_format),
+        pixels.data()
+    );
+}
+
+void TileAtlas::copy_slot(Slot source, Slot destination) {
+    glm::ivec2 source_origin = slot_origin(source);
+    glm::ivec2 destination_origin = slot_origin(destination);
+    glCopyImageSubData(
+        m_pages.id(), GL_TEXTURE_2D_ARRAY, 0, source_origin.x, source_origin.y, slot_page(source),
+        m_pages.id(), GL_TEXTURE_2D_ARRAY, 0, destination_origin.x, destination_origin.y, slot_page(destination),
+        TILE_SIZE, TILE_SIZE, 1
+    );
+}
+
+// Checks the slots on the GPU with one work group per tile. The results are
+// read back like pixels, so nothing waits for the dispatch to finish.
+void TileAtlas::find_uniform_slots(const std::vector<Slot>& slots, ReadbackQueue& queue, UniformSlotsCallback callback) {
+    if (slots.empty()) return;
+
+    std::vector<UniformQuery> queries;
+    queries.reserve(slots.size());
+    for (Slot slot : slots) {
+        queries.push_back(UniformQuery{ slot_origin(slot), slot_page(slot), 1, glm::vec4(0.0f) });
+    }
+
+    m_query_buffer.upload(queries);
+    m_query_buffer.bind_base(0);
+
+    m_uniform_program.use();
+    m_pages.bind_to(0);
+    m_uniform_program.set_uniform_1i("u_atlas", 0);
+    GlState::dispatch_compute(slots.size(), 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    size_t query_count = queries.size();
+    queue.request_buffer(m_query_buffer, query_count * sizeof(UniformQuery),
+        [query_count, callback = std::move(callback)](std::vector<uint8_t>&& bytes) {
+            std::vector<UniformQuery> queries(query_count);
+            std::memcpy(queries.data(), bytes.data(), bytes.size());
+
+            std::vector<std::optional<glm::vec4>> results;
+            results.reserve(query_count);
+            for (const UniformQuery& query : queries) {
+                if (query.is_uniform != 0) results.push_back(query.color);
+                else results.push_back(std::nullopt);
+            }
+            callback(std::move(results));
+        });
+}
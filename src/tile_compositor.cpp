@@ -0,0 +1,92 @@
+#include <array>
+#include <span>
+#include <vector>
+
+#include "glad/glad.h"
+#include "glm/glm.hpp"
+
+#include "gl_state.h"
+#include "layer.h"
+#include "pixel_format.h"
+#include "program.h"
+#include "rect.h"
+#include "tile_atlas.h"
+#include "tile_compositor.h"
+#include "vao.h"
+
+// Each format is sampled from its own unit, in `PixelFormat` order.
+static constexpr std::array<const char*, PIXEL_FORMAT_COUNT> ATLAS_UNIFORMS = {
+    "u_mask_atlas",
+    "u_color_atlas",
+    "u_float_atlas",
+};
+
+TileCompositor::TileCompositor()
+    : m_stack_buffer(GL_SHADER_STORAGE_BUFFER),
+    m_entry_buffer(GL_SHADER_STORAGE_BUFFER),
+    m_program("../src/shaders/tile_composite.vert", "../src/shaders/tile_composite.frag")
+{}
+
+void TileCompositor::draw(std::span<const Layer> layers, const Rect& region, glm::vec2 target_size, int level) {
+    if (layers.empty()) return;
+
+    m_stacks.clear();
+    m_entries.clear();
+    std::array<const TileAtlas*, PIXEL_FORMAT_COUNT> atlases{};
+
+    // Every layer covers the canvas, so they all share the same tile grid.
+    Rect range = layers.front().tile_range(region);
+    for (int y = range.min.y; y < range.max.y; y++) {
+        for (int x = range.min.x; x < range.max.x; x++) {
+            TileStack stack{};
+            stack.canvas_origin = glm::ivec2(x, y) * TileAtlas::TILE_SIZE;
+            stack.first_entry = int(m_entries.size());
+
+            for (const Layer& layer : layers) {
+                if (!layer.is_visible()) continue;
+                const Layer::Tile& tile = layer.tile({ x, y });
+                if (tile.kind == Layer::Tile::Kind::Empty || tile.kind == Layer::Tile::Kind::Evicted) continue;
+
+                StackEntry entry{};
+                if (tile.kind == Layer::Tile::Kind::Solid) {
+                    entry.format = SOLID;
+                    entry.color = layer.is_mask() ? glm::vec4(layer.tint() * tile.color.r, tile.color.r) : tile.color;
+                    // Nothing below an opaque tile can show through it.
+                    if (entry.color.a >= 1.0f) m_entries.resize(stack.first_entry);
+                } else {
+                    const TileAtlas& atlas = layer.atlas();
+                    entry.atlas_origin = atlas.slot_origin(tile.slot);
+                    entry.page = atlas.slot_page(tile.slot);
+                    entry.format = int(atlas.format());
+                    entry.color = glm::vec4(layer.tint(), 1.0);
+                    atlases[size_t(atlas.format())] = &atlas;
+                }
+                m_entries.push_back(entry);
+            }
+
+            stack.entry_count = int(m_entries.size()) - stack.first_entry;
+            if (stack.entry_count > 0) m_stacks.push_back(stack);
+        }
+    }
+    if (m_stacks.empty()) return;
+
+    m_stack_buffer.upload(m_stacks);
+    m_stack_buffer.bind_base(0);
+    m_entry_buffer.upload(m_entries);
+    m_entry_buffer.bind_base(1);
+
+    m_program.use();
+    m_program.set_uniform_2f("u_target_size", target_size);
+    m_program.set_uniform_1i("u_tile_size", TileAtlas::TILE_SIZE);
+    m_program.set_uniform_1i("u_level", level);
+    for (size_t i = 0; i < PIXEL_FORMAT_COUNT; i++) {
+        // Units of formats no tile uses are left as they are, since the
+        // shader never samples them.
+        if (atlases[i] != nullptr) atlases[i]->texture().bind_to(i);
+        m_program.set_uniform_1i(ATLAS_UNIFORMS[i], int(i));
+    }
+
+    GLuint dummy_vao = VAO::get_dummy();
+    GlState::bind_vertex_array(dummy_vao);
+    GlState::draw_arrays_instanced(GL_TRIANGLE_STRIP, 0, 4, m_stacks.size());
+}
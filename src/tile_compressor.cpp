@@ -0,0 +1,95 @@
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "compression.h"
+#include "readback.h"
+#include "tile_atlas.h"
+#include "tile_compressor.h"
+
+TileCompressor::TileCompressor(ReadbackQueue& readback_queue, size_t thread_count)
+    : m_readback_queue(readback_queue),
+    m_jobs_in_progress(0),
+    m_pending_readbacks(0),
+    m_is_stopping(false)
+{
+    if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency() / 2);
+    for (size_t i = 0; i < thread_count; i++) {
+        m_workers.emplace_back(&TileCompressor::work, this);
+    }
+}
+
+TileCompressor::~TileCompressor() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_is_stopping = true;
+    }
+    m_job_ready.notify_all();
+    for (std::thread& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void TileCompressor::compress_slot(TileAtlas& atlas, TileAtlas::Slot slot, Callback callback) {
+    m_pending_readbacks++;
+    atlas.read_slot_async(slot, m_readback_queue, [this, callback = std::move(callback)](std::vector<uint8_t>&& pixels) mutable {
+        m_pending_readbacks--;
+        {
+            std::lock_guard lock(m_mutex);
+            m_jobs.push_back(Job{ std::move(pixels), std::move(callback) });
+        }
+        m_job_ready.notify_one();
+    });
+}
+
+void TileCompressor::work() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_job_ready.wait(lock, [this]() { return m_is_stopping || !m_jobs.empty(); });
+            if (m_is_stopping) return;
+
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+            m_jobs_in_progress++;
+        }
+
+        job.data = zlib_compress(job.data.data(), job.data.size());
+
+        {
+            std::lock_guard lock(m_mutex);
+            m_finished.push_back(std::move(job));
+            m_jobs_in_progress--;
+        }
+        m_job_finished.notify_all();
+    }
+}
+
+void TileCompressor::poll() {
+    std::vector<Job> finished;
+    {
+        std::lock_guard lock(m_mutex);
+        finished = std::exchange(m_finished, std::vector<Job>());
+    }
+    // Callbacks run without the lock, since they may request more work.
+    for (Job& job : finished) {
+        job.callback(std::move(job.data));
+    }
+}
+
+void TileCompressor::finish() {
+    {
+        std::unique_lock lock(m_mutex);
+        m_job_finished.wait(lock, [this]() { return m_jobs.empty() && m_jobs_in_progress == 0; });
+    }
+    poll();
+}
+
+bool TileCompressor::has_pending() const {
+    std::lock_guard lock(m_mutex);
+    return m_pending_readbacks > 0 || !m_jobs.empty() || m_jobs_in_progress > 0 || !m_finished.empty();
+}
@@ -84,6 +84,27 @@ void ToolManager::deselect_temp_tool() {
     m_prev_tool = std::nullopt;
 }
 
+void ToolManager::handle_mouse(Canvas& canvas, UserState& user_state, bool is_mouse_down) {
+    auto tool_opt = get_selected_tool();
+    if (tool_opt.has_value()) {
+        Tool& tool = tool_opt.value().get();
+
+        bool prev_mouse_down = user_state.prev_cursor.has_value();
+        bool mouse_pressed = !prev_mouse_down && is_mouse_down;
+        bool mouse_released = prev_mouse_down && !is_mouse_down;
+
+        if (mouse_pressed) tool.on_mouse_press(canvas, user_state);
+        else if (mouse_released) tool.on_mouse_release(canvas, user_state);
+        else if (is_mouse_down) tool.on_mouse_down(canvas, user_state);
+    }
+
+    if (is_mouse_down) {
+        user_state.prev_cursor = user_state.cursor;
+    } else {
+        user_state.prev_cursor = std::nullopt;
+    }
+}
+
 const std::optional<std::reference_wrapper<Tool>> ToolManager::get_tool_by_id(Tool::Id tool_id) {
     return find_tool([tool_id](const auto& tool) {
         return tool->id() == tool_id;
@@ -117,11 +138,11 @@ ColorPicker::ColorPicker() {
 }
 
 void ColorPicker::on_mouse_down(Canvas& canvas, UserState& user_state) {
+    // The color arrives a frame or two later, so picking never stalls.
     glm::vec2 cursor_pos = canvas.screen_space_to_canvas_space(user_state.cursor.pos);
-    std::optional<glm::vec3> color_opt = canvas.get_color_at_pos(cursor_pos);
-    if (color_opt.has_value()) {
-        user_state.selected_color = color_opt.value();
-    }
+    canvas.request_color_at_pos(cursor_pos, [&user_state](glm::vec3 color) {
+        user_state.selected_color = color;
+    });
 }
 
 Zoom::Zoom() {
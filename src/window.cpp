@@ -36,9 +36,25 @@
 #define TABLET_DISABLE_TOUCHUIFORCEON 0x00000100
 #endif
 
+// Messages that can change what the user sees, and so should wake up the
+// main loop. Anything else (timers, paints, etc.) is ignored.
+static bool is_input_message(UINT msg) {
+    return (msg >= WM_MOUSEFIRST && msg <= WM_MOUSELAST)
+        || (msg >= WM_KEYFIRST && msg <= WM_KEYLAST)
+        || msg == WM_POINTERUPDATE
+        || msg == WM_POINTERDOWN
+        || msg == WM_POINTERUP
+        || msg == WM_MOUSELEAVE
+        || msg == WM_SIZE
+        || msg == WM_SETFOCUS
+        || msg == WM_KILLFOCUS;
+}
+
 static LRESULT CALLBACK wnd_proc(HWND hwnd, UINT msg, WPARAM w_param, LPARAM l_param) {
     Window* window = reinterpret_cast<Window*>(GetWindowLongPtr(hwnd, GWLP_USERDATA));
 
+    if (is_input_message(msg)) window->notify_input();
+
     if (ImGui::GetCurrentContext() == NULL) {
         return CallWindowProc(window->original_wnd_proc(), hwnd, msg, w_param, l_param);
     }
@@ -126,7 +142,8 @@ Window::Window(const char* title, size_t width, size_t height) :
     m_pen_pressure(0.0),
     m_pen_down(false),
     m_mouse_pos(0.0, 0.0),
-    m_mouse_down(false)
+    m_mouse_down(false),
+    m_has_new_input(true)
 {
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;